@@ -4,6 +4,14 @@
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <time.h>
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "mu-mips.h"
 
@@ -23,1106 +31,6654 @@ void help() {
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
 	printf("show\t-- print the current content of the pipeline registers\n");
+	printf("stats\t-- print the pipeline counters: stalls by cause, forwards, flushes, CPI\n");
+	printf("cache i|d <spec>\t-- configure the L1 I/D cache, e.g. 16k:4:32:lru:wb:10, or off\n");
+	printf("cache l2 <spec>\t-- unified L2 in the same format, its latency is the hit latency, or off\n");
+	printf("cache dram <spec>\t-- DRAM below the caches, <banks>:<row bytes>[:<tCAS>[:<tRCD>[:<tRP>]]], e.g. 8:2k:15:15:15\n");
+	printf("cache mshrs <n>\t-- misses that can be outstanding below the L1s (default 8)\n");
+	printf("cache show\t-- print the cache configuration and hit/miss statistics\n");
+	printf("prefetch <kind>[:<degree>[:<entries>]]\t-- L1D prefetcher: nextline, stride, stream or off\n");
+	printf("prefetch show\t-- print the prefetcher's coverage, accuracy and timeliness\n");
+	printf("storebuffer <n>\t-- buffer up to <n> stores between MEM and the L1D (0-%d), or off\n", STORE_BUFFER_MAX);
+	printf("storebuffer show\t-- print store buffer combining, forwarding and stall statistics\n");
+	printf("stages <list>\t-- pipeline depth as a stage list, e.g. IF1,IF2,ID,EX1,EX2,MEM,WB (IF, EX, MEM split up to %d ways)\n", PIPE_MAX_SPLIT);
+	printf("stages show\t-- print the current stage list\n");
+	printf("early <0|1>\t-- resolve branches in EX (0) or ID (1)\n");
+	printf("delay <0|1>\t-- MIPS branch delay slots off (0) or on (1)\n");
+	printf("issue <n>\t-- issue up to <n> instructions per cycle in order (1-%d, 1 is the scalar pipeline)\n", SS_MAX_WIDTH);
+	printf("ooo <rob>[:<rs>[:<lsq>[:<width>]]]\t-- out-of-order core, e.g. 64:32:16:4, or off\n");
+	printf("ooo check\t-- compare the state so far with a functional run of as many instructions\n");
+	printf("mdu <mult>[:<div>]\t-- multiply/divide unit latency in cycles, e.g. 12:35\n");
+	printf("bp <spec>\t-- branch predictor, e.g. gshare:12:512:8 (kind:table bits:BTB entries:RAS entries)\n");
+	printf("pipetrace <file>|off\t-- record the pipeline registers every cycle into a binary trace, see --pipetrace-convert\n");
+	printf("profile on|off|reset\t-- count executions, stalls, cache misses and mispredicts of every instruction\n");
+	printf("profile <n>\t-- print the <n> most expensive instructions and basic blocks\n");
+	printf("verbose <n>\t-- set trace level (0 none, 1 info, 2 stages, 3 detail)\n");
+	printf("bench mem <n>\t-- time <n> iterations of the memory access path\n");
+	printf("bench sim <n>\t-- rerun the program for <n> cycles and report cycles/sec\n");
+	printf("bench ff <n>\t-- rerun the program functionally for <n> instructions\n");
+	printf("ff <n>\t\t-- fast-forward <n> instructions functionally, then continue pipelined\n");
+	printf("ff pc <addr>\t-- fast-forward functionally until the PC reaches <addr>\n");
+	printf("snapshot save|restore|drop <n>\t-- save, restore or free snapshot slot <n> (0-%d)\n", NUM_SNAPSHOTS - 1);
+	printf("bench reset <n>\t-- time <n> resets by reparsing against restoring the boot snapshot\n");
+	printf("jit on|off\t-- fast-forward through the JIT or the interpreter\n");
+	printf("jit check <n>\t-- run <n> instructions through both and compare the results\n");
+	printf("bench jit <n>\t-- interpreter vs JIT speed in millions of instructions/sec\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Check that an address falls inside one of the memory regions              */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+static bool mem_in_region(uint32_t address)
 {
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) &&  ( address <= MEM_REGIONS[i].end) ) {
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset+3] << 24) |
-					(MEM_REGIONS[i].mem[offset+2] << 16) |
-					(MEM_REGIONS[i].mem[offset+1] <<  8) |
-					(MEM_REGIONS[i].mem[offset+0] <<  0);
-		}
+	return MEM_CHUNK_LEGAL[address >> MEM_CHUNK_SHIFT];
+}
+
+/***************************************************************/
+/* Find the page backing an address, NULL if it was never written       */
+/***************************************************************/
+static uint8_t *mem_page_lookup(uint32_t address)
+{
+	uint8_t **table = MEM_PAGE_DIR[address >> MEM_DIR_SHIFT];
+	if (table == NULL) {
+		return NULL;
 	}
-	return 0;
+	return table[(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)];
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* Allocate a zeroed page with a reference count of one.                     */
+/* The count lives in a header in front of the page data, pages are   */
+/* shared copy-on-write between memory and its snapshots.               */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+static uint8_t *mem_page_new()
 {
-	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		if ( (address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end) ) {
-			offset = address - MEM_REGIONS[i].begin;
+	uint8_t *base = calloc(1, MEM_PAGE_HEADER + MEM_PAGE_SIZE);
+	assert(base != NULL);
+	*(uint32_t *)base = 1;
+	return base + MEM_PAGE_HEADER;
+}
 
-			MEM_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
-			MEM_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
-		}
+static uint32_t *mem_page_refs(uint8_t *page)
+{
+	return (uint32_t *)(page - MEM_PAGE_HEADER);
+}
+
+static void mem_page_release(uint8_t *page)
+{
+	if (page != NULL && --*mem_page_refs(page) == 0) {
+		free(page - MEM_PAGE_HEADER);
 	}
 }
 
 /***************************************************************/
-/* Execute one cycle                                                                                                              */
+/* Find the page backing an address, allocating it on first touch         */
 /***************************************************************/
-void cycle() {                                                
-	handle_pipeline();
-	CURRENT_STATE = NEXT_STATE;
-	CYCLE_COUNT++;
+static uint8_t *mem_page_alloc(uint32_t address)
+{
+	uint8_t ***table = &MEM_PAGE_DIR[address >> MEM_DIR_SHIFT];
+	uint8_t **page;
+
+	if (*table == NULL) {
+		*table = calloc(MEM_TABLE_ENTRIES, sizeof(uint8_t *));
+		assert(*table != NULL);
+	}
+	page = &(*table)[(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)];
+	if (*page == NULL) {
+		*page = mem_page_new();
+		MEM_PAGES_ALLOCATED++;
+	}
+	return *page;
 }
 
 /***************************************************************/
-/* Simulate MIPS for n cycles                                                                                       */
+/* Find the page backing an address for writing, first giving memory */
+/* its own copy if the page is still shared with a snapshot                  */
 /***************************************************************/
-void run(int num_cycles) {                                      
-	
-	if (RUN_FLAG == FALSE) {
-		CURRENT_STATE = NEXT_STATE;
-		printf("Simulation Stopped\n\n");
-		return;
+static uint8_t *mem_page_writable(uint32_t address, bool alloc)
+{
+	uint8_t **table, **slot, *copy;
+
+	if (alloc) {
+		mem_page_alloc(address);
+	}
+	table = MEM_PAGE_DIR[address >> MEM_DIR_SHIFT];
+	if (table == NULL) {
+		return NULL;
 	}
+	slot = &table[(address >> MEM_PAGE_SHIFT) & (MEM_TABLE_ENTRIES - 1)];
+	if (*slot != NULL && *mem_page_refs(*slot) > 1) {
+		copy = mem_page_new();
+		memcpy(copy, *slot, MEM_PAGE_SIZE);
+		mem_page_release(*slot);
+		*slot = copy;
+	}
+	return *slot;
+}
 
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
+/***************************************************************/
+/* Drop every cached translation                                                            */
+/***************************************************************/
+static void mem_tlb_flush()
+{
 	int i;
-	for (i = 0; i < num_cycles; i++) {
-		if (RUN_FLAG == FALSE) {
-			printf("Simulation Stopped.\n\n");
-			break;
-		}
-		cycle();
+	for (i = 0; i < MEM_TLB_ENTRIES; i++) {
+		MEM_TLB[i].vpn = MEM_TLB_INVALID;
+		MEM_TLB[i].page = NULL;
+		MEM_WTLB[i].vpn = MEM_TLB_INVALID;
+		MEM_WTLB[i].page = NULL;
 	}
 }
 
 /***************************************************************/
-/* simulate to completion                                                                                               */
+/* Translate an address to its backing page.                                          */
+/* Returns NULL for illegal addresses and for pages never written,      */
+/* unless alloc is set, in which case a legal page is created.              */
 /***************************************************************/
-void runAll() {                                                     
-	if (RUN_FLAG == FALSE) {
-		cycle();
-		printf("Simulation Stopped.\n\n");
-		return;
-	}
+static inline uint8_t *mem_translate(uint32_t address, bool alloc)
+{
+	uint32_t vpn = address >> MEM_PAGE_SHIFT;
+	mem_tlb_entry_t *tlb = &MEM_TLB[vpn & (MEM_TLB_ENTRIES - 1)];
+	uint8_t *page;
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG){
-		cycle();
+	if (tlb->vpn == vpn) {
+		return tlb->page;
 	}
-	printf("Simulation Finished.\n\n");
+	if (!mem_in_region(address)) {
+		return NULL;
+	}
+	page = alloc ? mem_page_alloc(address) : mem_page_lookup(address);
+	if (page != NULL) {
+		tlb->vpn = vpn;
+		tlb->page = page;
+	}
+	return page;
 }
 
-/***************************************************************/ 
-/* Dump a word-aligned region of memory to the terminal                              */
 /***************************************************************/
-void mdump(uint32_t start, uint32_t stop) {          
-	uint32_t address;
+/* mem_translate() for stores: the page returned is never shared, so */
+/* MEM_WTLB only holds pages memory owns outright                              */
+/***************************************************************/
+static inline uint8_t *mem_translate_write(uint32_t address, bool alloc)
+{
+	uint32_t vpn = address >> MEM_PAGE_SHIFT;
+	mem_tlb_entry_t *wtlb = &MEM_WTLB[vpn & (MEM_TLB_ENTRIES - 1)];
+	mem_tlb_entry_t *tlb = &MEM_TLB[vpn & (MEM_TLB_ENTRIES - 1)];
+	uint8_t *page;
 
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
-	for (address = start; address <= stop; address += 4){
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+	if (wtlb->vpn == vpn) {
+		return wtlb->page;
 	}
-	printf("\n");
+	if (!mem_in_region(address)) {
+		return NULL;
+	}
+	page = mem_page_writable(address, alloc);
+	if (page != NULL) {
+		// a copy-on-write fault may have replaced the page the read side cached
+		wtlb->vpn = tlb->vpn = vpn;
+		wtlb->page = tlb->page = page;
+	}
+	return page;
 }
 
 /***************************************************************/
-/* Dump current values of registers to the teminal                                              */   
+/* Byte accessors, used when an access straddles two pages             */
 /***************************************************************/
-void rdump() {                               
-	int i; 
-	printf("-------------------------------------\n");
-	printf("Dumping Register Content\n");
-	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("# Cycles Executed\t: %u\n", CYCLE_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
-	printf("-------------------------------------\n");
-	printf("[Register]\t[Value]\n");
-	printf("-------------------------------------\n");
-	for (i = 0; i < MIPS_REGS; i++){
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+static uint8_t mem_read_byte(uint32_t address)
+{
+	uint8_t *page = mem_translate(address, false);
+	return page == NULL ? 0 : page[address & MEM_PAGE_MASK];
+}
+
+static void mem_write_byte(uint32_t address, uint8_t value)
+{
+	uint8_t *page = mem_translate_write(address, value != 0);
+	if (page != NULL) {
+		page[address & MEM_PAGE_MASK] = value;
 	}
-	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
-	printf("-------------------------------------\n");
 }
 
 /***************************************************************/
-/* Read a command from standard input.                                                               */  
+/* Native little-endian loads/stores of a page offset                          */
 /***************************************************************/
-void handle_command() {                         
-	char buffer[20];
-	uint32_t start, stop, cycles;
-	uint32_t register_no;
-	int register_value;
-	int hi_reg_value, lo_reg_value;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint32_t load_le32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint32_t load_le16(const uint8_t *p) { uint16_t v; memcpy(&v, p, 2); return v; }
+static inline void store_le32(uint8_t *p, uint32_t v) { memcpy(p, &v, 4); }
+static inline void store_le16(uint8_t *p, uint32_t v) { uint16_t h = v; memcpy(p, &h, 2); }
+#else
+static inline uint32_t load_le32(const uint8_t *p) { return (p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0]; }
+static inline uint32_t load_le16(const uint8_t *p) { return (p[1] << 8) | p[0]; }
+static inline void store_le32(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24; }
+static inline void store_le16(uint8_t *p, uint32_t v) { p[0] = v; p[1] = v >> 8; }
+#endif
 
-	printf("MU-MIPS SIM:> ");
+/***************************************************************/
+/* Read a 32-bit word from memory                                                                            */
+/***************************************************************/
+uint32_t mem_read_32(uint32_t address)
+{
+	uint32_t offset = address & MEM_PAGE_MASK;
+	uint8_t *page;
 
-	if (scanf("%s", buffer) == EOF){
-		exit(0);
+	if (offset > MEM_PAGE_SIZE - 4) {
+		return (mem_read_byte(address+3) << 24) |
+				(mem_read_byte(address+2) << 16) |
+				(mem_read_byte(address+1) <<  8) |
+				(mem_read_byte(address+0) <<  0);
 	}
+	page = mem_translate(address, false);
+	return page == NULL ? 0 : load_le32(page + offset);
+}
 
-	switch(buffer[0]) {
-		case 'S':
-		case 's':
-			if (buffer[1] == 'h' || buffer[1] == 'H'){
-				show_pipeline();
-			}else {
-				runAll(); 
-			}
-			break;
-		case 'M':
-		case 'm':
-			if (scanf("%x %x", &start, &stop) != 2){
-				break;
-			}
-			mdump(start, stop);
-			break;
-		case '?':
-			help();
-			break;
-		case 'Q':
-		case 'q':
-			printf("**************************\n");
-			printf("Exiting MU-MIPS! Good Bye...\n");
-			printf("**************************\n");
-			exit(0);
-		case 'R':
-		case 'r':
-			if (buffer[1] == 'd' || buffer[1] == 'D'){
-				rdump();
-			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
-				reset();
-			}
-			else {
-				if (scanf("%d", &cycles) != 1) {
-					break;
-				}
-				run(cycles);
-			}
-			break;
-		case 'I':
-		case 'i':
-			if (scanf("%u %i", &register_no, &register_value) != 2){
-				break;
-			}
-			CURRENT_STATE.REGS[register_no] = register_value;
-			NEXT_STATE.REGS[register_no] = register_value;
-			break;
-		case 'H':
-		case 'h':
-			if (scanf("%i", &hi_reg_value) != 1){
-				break;
-			}
-			CURRENT_STATE.HI = hi_reg_value; 
-			NEXT_STATE.HI = hi_reg_value; 
-			break;
-		case 'L':
-		case 'l':
-			if (scanf("%i", &lo_reg_value) != 1){
-				break;
-			}
-			CURRENT_STATE.LO = lo_reg_value;
-			NEXT_STATE.LO = lo_reg_value;
-			break;
-		case 'P':
-		case 'p':
-			print_program(CURRENT_STATE.PC); 
-			break;
-		case 'F':
-		case 'f':
-			if(scanf("%d", &ENABLE_FORWARDING) != 1)
-				break;
-			ENABLE_FORWARDING == 0 ? printf("Forwarding OFF\n") : printf("Forwarding ON\n");
-			break;
-		default:
-			printf("Invalid Command.\n");
-			break;
+/***************************************************************/
+/* Read a zero-extended 16-bit halfword from memory                           */
+/***************************************************************/
+uint32_t mem_read_16(uint32_t address)
+{
+	uint32_t offset = address & MEM_PAGE_MASK;
+	uint8_t *page;
+
+	if (offset > MEM_PAGE_SIZE - 2) {
+		return (mem_read_byte(address+1) << 8) | mem_read_byte(address);
 	}
+	page = mem_translate(address, false);
+	return page == NULL ? 0 : load_le16(page + offset);
 }
 
 /***************************************************************/
-/* reset registers/memory and reload program                                                    */
+/* Read a zero-extended byte from memory                                             */
 /***************************************************************/
-void reset() {   
-	int i;
-	/*reset registers*/
-	for (i = 0; i < MIPS_REGS; i++){
-		CURRENT_STATE.REGS[i] = 0;
-	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
-	
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
-	
-	/*load program*/
-	load_program();
-	
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC =  MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+uint32_t mem_read_8(uint32_t address)
+{
+	return mem_read_byte(address);
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
+/* Whether a store to address writes the text segment, which the       */
+/* pipelines may already have fetched from                                      */
 /***************************************************************/
-void init_memory() {                                           
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++) {
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
-	}
+static inline bool mem_is_text(uint32_t address)
+{
+	return address >= MEM_TEXT_BEGIN && address <= MEM_TEXT_END;
 }
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program() {                   
-	FILE * fp;
-	int i, word;
-	uint32_t address;
+/***************************************************************/
+/* Write a 32-bit word to memory                                                                                */
+/***************************************************************/
+void mem_write_32(uint32_t address, uint32_t value)
+{
+	uint32_t offset = address & MEM_PAGE_MASK;
+	uint8_t *page;
 
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL) {
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+	if (address >= MEM_TEXT_BEGIN && address <= MEM_TEXT_END) {
+		decode_invalidate(address, 4);
 	}
 
-	/* Read in the program. */
-
-	i = 0;
-	while( fscanf(fp, "%x\n", &word) != EOF ) {
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+	if (offset > MEM_PAGE_SIZE - 4) {
+		mem_write_byte(address+3, (value >> 24) & 0xFF);
+		mem_write_byte(address+2, (value >> 16) & 0xFF);
+		mem_write_byte(address+1, (value >>  8) & 0xFF);
+		mem_write_byte(address+0, (value >>  0) & 0xFF);
+		return;
+	}
+	/* untouched pages already read as zero, so zero stores need no page */
+	page = mem_translate_write(address, value != 0);
+	if (page != NULL) {
+		store_le32(page + offset, value);
 	}
-	PROGRAM_SIZE = i/4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
 }
 
-/************************************************************/
-/* maintain the pipeline                                                                                           */ 
-/************************************************************/
-void handle_pipeline()
+/***************************************************************/
+/* Write the low 16 bits of value to memory                                        */
+/***************************************************************/
+void mem_write_16(uint32_t address, uint32_t value)
 {
-	/*INSTRUCTION_COUNT should be incremented when instruction is done*/
-	/*Since we do not have branch/jump instructions, INSTRUCTION_COUNT should be incremented in WB stage */	
-	printf("|---------------------------------------|\n");
-	printf("|		cycle			|\n");
-	printf("| 		PC: 0x%08X		|\n", CURRENT_STATE.PC);
-	printf("*******************\n");	
-	WB();
-	printf("*******************\n");	
-	MEM();
-	printf("*******************\n");	
-	EX();
-	printf("*******************\n");	
-	ID();
-	printf("*******************\n");	
-	IF();
-	printf("*******************\n");	
-}
+	uint32_t offset = address & MEM_PAGE_MASK;
+	uint8_t *page;
 
-/************************************************************/
-/* writeback (WB) pipeline stage:                                                                          */ 
-/************************************************************/
-void WB()
-{
-	printf("-Write Back- \n");	
-	uint32_t rt, rd, opcode, function;
-	// getting necessary pieces of the instruction for execution
-	opcode = (MEM_WB.IR & 0xFC000000) >> 26;
-	rt = (MEM_WB.IR & 0x001F0000) >> 16;
-	rd = (MEM_WB.IR & 0x0000F800) >> 11;
-	function = MEM_WB.IR & 0x0000003F;
+	if (address >= MEM_TEXT_BEGIN && address <= MEM_TEXT_END) {
+		decode_invalidate(address, 2);
+	}
+
+	if (offset > MEM_PAGE_SIZE - 2) {
+		mem_write_byte(address+1, (value >> 8) & 0xFF);
+		mem_write_byte(address+0, value & 0xFF);
+		return;
+	}
+	page = mem_translate_write(address, (value & 0xFFFF) != 0);
+	if (page != NULL) {
+		store_le16(page + offset, value);
+	}
+}
+
+/***************************************************************/
+/* Write the low byte of value to memory                                               */
+/***************************************************************/
+void mem_write_8(uint32_t address, uint32_t value)
+{
+	if (address >= MEM_TEXT_BEGIN && address <= MEM_TEXT_END) {
+		decode_invalidate(address, 1);
+	}
+	mem_write_byte(address, value & 0xFF);
+}
+
+/***************************************************************/
+/* Copy size bytes into memory a page at a time, false if any of it     */
+/* falls outside the memory regions                                                         */
+/***************************************************************/
+bool mem_write_block(uint32_t address, const uint8_t *src, uint32_t size)
+{
+	uint32_t offset, chunk, start = address, left = size;
+	uint8_t *page;
+
+	while (left > 0) {
+		offset = address & MEM_PAGE_MASK;
+		chunk = MEM_PAGE_SIZE - offset < left ? MEM_PAGE_SIZE - offset : left;
+		page = mem_translate_write(address, true);
+		if (page == NULL) {
+			return false;
+		}
+		memcpy(page + offset, src, chunk);
+		address += chunk;
+		src += chunk;
+		left -= chunk;
+	}
+	if (start <= MEM_TEXT_END && start + size > MEM_TEXT_BEGIN) {
+		decode_invalidate(start, size);
+	}
+	return true;
+}
+
+/***************************************************************/
+/* Seconds on a monotonic clock, for benchmarks                               */
+/***************************************************************/
+static double now_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/***************************************************************/
+/* The original access path, kept for the benchmark baseline: a scan  */
+/* over flat per-region arrays (only the first span of each is backed)  */
+/***************************************************************/
+typedef struct {
+	uint32_t begin, end;
+	uint8_t *mem;
+} flat_region_t;
+
+static SIM_LOCAL flat_region_t FLAT_REGIONS[NUM_MEM_REGION];
+
+static uint32_t flat_mem_read_32(uint32_t address)
+{
+	int i;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if ( (address >= FLAT_REGIONS[i].begin) &&  ( address <= FLAT_REGIONS[i].end) ) {
+			uint32_t offset = address - FLAT_REGIONS[i].begin;
+			return (FLAT_REGIONS[i].mem[offset+3] << 24) |
+					(FLAT_REGIONS[i].mem[offset+2] << 16) |
+					(FLAT_REGIONS[i].mem[offset+1] <<  8) |
+					(FLAT_REGIONS[i].mem[offset+0] <<  0);
+		}
+	}
+	return 0;
+}
+
+static void flat_mem_write_32(uint32_t address, uint32_t value)
+{
+	int i;
+	uint32_t offset;
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		if ( (address >= FLAT_REGIONS[i].begin) && (address <= FLAT_REGIONS[i].end) ) {
+			offset = address - FLAT_REGIONS[i].begin;
+
+			FLAT_REGIONS[i].mem[offset+3] = (value >> 24) & 0xFF;
+			FLAT_REGIONS[i].mem[offset+2] = (value >> 16) & 0xFF;
+			FLAT_REGIONS[i].mem[offset+1] = (value >>  8) & 0xFF;
+			FLAT_REGIONS[i].mem[offset+0] = (value >>  0) & 0xFF;
+		}
+	}
+}
+
+/***************************************************************/
+/* Microbenchmark of the memory access path                                   */
+/***************************************************************/
+void bench_memory(uint32_t iterations)
+{
+	/* a text-fetch-like stream and a data stream across a few pages, */
+	/* the data pages live in kernel data and are put back afterwards */
+	const uint32_t text = MEM_TEXT_BEGIN, data = MEM_KDATA_BEGIN, span = 4 * MEM_PAGE_SIZE;
+	volatile uint32_t sink = 0;
+	double t0, t_flat_load, t_flat_store, t_load, t_store, t_byte;
+	uint32_t i, a;
+
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		FLAT_REGIONS[i].begin = MEM_REGIONS[i].begin;
+		FLAT_REGIONS[i].end = MEM_REGIONS[i].end;
+		FLAT_REGIONS[i].mem = malloc(span);
+		assert(FLAT_REGIONS[i].mem != NULL);
+		for (a = 0; a < span; a += 4) {
+			flat_mem_write_32(FLAT_REGIONS[i].begin + a, mem_read_32(FLAT_REGIONS[i].begin + a));
+		}
+	}
+	snapshot_save(SNAPSHOT_SCRATCH);
+	for (a = 0; a < span; a += 4) {
+		mem_write_32(data + a, a);
+		flat_mem_write_32(data + a, a);
+	}
+
+	t0 = now_seconds();
+	for (i = 0; i < iterations; i++) {
+		sink += flat_mem_read_32(text + ((i * 4) & (span - 1)));
+		sink += flat_mem_read_32(data + ((i * 4) & (span - 1)));
+	}
+	t_flat_load = now_seconds() - t0;
+
+	t0 = now_seconds();
+	for (i = 0; i < iterations; i++) {
+		flat_mem_write_32(data + ((i * 4) & (span - 1)), i | 1);
+		flat_mem_write_32(data + ((i * 8) & (span - 1)), i | 1);
+	}
+	t_flat_store = now_seconds() - t0;
+
+	t0 = now_seconds();
+	for (i = 0; i < iterations; i++) {
+		sink += mem_read_32(text + ((i * 4) & (span - 1)));
+		sink += mem_read_32(data + ((i * 4) & (span - 1)));
+	}
+	t_load = now_seconds() - t0;
+
+	t0 = now_seconds();
+	for (i = 0; i < iterations; i++) {
+		mem_write_32(data + ((i * 4) & (span - 1)), i | 1);
+		mem_write_32(data + ((i * 8) & (span - 1)), i | 1);
+	}
+	t_store = now_seconds() - t0;
+
+	t0 = now_seconds();
+	for (i = 0; i < iterations; i++) {
+		mem_write_8(data + (i & (span - 1)), i | 1);
+		mem_write_16(data + ((i * 2) & (span - 1)), i | 1);
+	}
+	t_byte = now_seconds() - t0;
+	(void)sink;
+	snapshot_restore(SNAPSHOT_SCRATCH);
+	snapshot_drop(SNAPSHOT_SCRATCH);
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		free(FLAT_REGIONS[i].mem);
+		FLAT_REGIONS[i].mem = NULL;
+	}
+
+	printf("Memory benchmark, %u iterations of 2 accesses\n", iterations);
+	printf("region array word loads\t\t: %6.2f ns/access\n", t_flat_load * 1e9 / (2.0 * iterations));
+	printf("region array word stores\t: %6.2f ns/access\n", t_flat_store * 1e9 / (2.0 * iterations));
+	printf("translated word loads\t\t: %6.2f ns/access (%.1fx)\n", t_load * 1e9 / (2.0 * iterations), t_flat_load / t_load);
+	printf("translated word stores\t\t: %6.2f ns/access (%.1fx)\n", t_store * 1e9 / (2.0 * iterations), t_flat_store / t_store);
+	printf("byte/half stores\t\t: %6.2f ns/access\n\n", t_byte * 1e9 / (2.0 * iterations));
+}
+
+/* profile entry of the instruction at pc, NULL unless profiling it */
+static inline profile_entry_t *profile_at(uint32_t pc) {
+	uint32_t index = (pc - MEM_TEXT_BEGIN) >> 2;
+
+	return PROFILE.entries != NULL && index < PROFILE.words ? &PROFILE.entries[index] : NULL;
+}
+
+#define PROFILE_COUNT(pc, field) \
+	do { profile_entry_t *prof_ = profile_at(pc); if (prof_ != NULL) prof_->field++; } while (0)
+
+/***************************************************************/
+/* L1 cache model                                                                                                           */
+/***************************************************************/
+static const char *CACHE_POLICY_NAMES[] = { "lru", "plru", "random" };
+
+/* number with an optional k suffix, false if it is not a power of two */
+static bool cache_parse_size(const char *text, uint32_t *value) {
+	char *end;
+	unsigned long n = strtoul(text, &end, 0);
+
+	if (*end == 'k' || *end == 'K') {
+		n *= 1024;
+		end++;
+	}
+	*value = n;
+	return end != text && *end == '\0' && n != 0 && n <= 0x80000000UL && (n & (n - 1)) == 0;
+}
+
+/***************************************************************/
+/* Configure a cache from "<size>:<assoc>:<line>[:lru|plru|random     */
+/* [:wb|wt[:<miss cycles>]]]", e.g. "16k:4:32:plru:wb:10", or "off".  */
+/* Defaults are LRU, write-back and 10 cycles. The cache starts cold. */
+/***************************************************************/
+bool cache_configure(cache_t *c, const char *spec) {
+	cache_t cfg;
+	char copy[64], *field[7], *save = NULL;
+	int n = 0, p;
+
+	if (strcmp(spec, "off") == 0) {
+		cache_release(c);
+		return true;
+	}
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.policy = CACHE_LRU;
+	cfg.write_back = true;
+	cfg.miss_latency = 10;
+
+	snprintf(copy, sizeof(copy), "%s", spec);
+	for (field[n] = strtok_r(copy, ":", &save); field[n] != NULL && n < 6; field[n] = strtok_r(NULL, ":", &save)) {
+		n++;
+	}
+	if (n < 3 || !cache_parse_size(field[0], &cfg.size) || !cache_parse_size(field[1], &cfg.assoc) ||
+		!cache_parse_size(field[2], &cfg.line_size) || cfg.line_size < 4 || cfg.assoc > CACHE_MAX_ASSOC ||
+		cfg.size < cfg.assoc * cfg.line_size) {
+		printf("Error: bad cache '%s', want power-of-two <size>:<assoc>:<line> with line >= 4 and assoc <= %d\n",
+			spec, CACHE_MAX_ASSOC);
+		return false;
+	}
+	if (n > 3) {
+		for (p = 0; p < 3 && strcmp(field[3], CACHE_POLICY_NAMES[p]) != 0; p++);
+		if (p == 3) {
+			printf("Error: cache replacement is lru, plru or random, not '%s'\n", field[3]);
+			return false;
+		}
+		cfg.policy = p;
+	}
+	if (n > 4) {
+		if (strcmp(field[4], "wb") != 0 && strcmp(field[4], "wt") != 0) {
+			printf("Error: cache write policy is wb or wt, not '%s'\n", field[4]);
+			return false;
+		}
+		cfg.write_back = strcmp(field[4], "wb") == 0;
+	}
+	if (n > 5) {
+		cfg.miss_latency = strtoul(field[5], NULL, 0);
+	}
+
+	cache_release(c);
+	*c = cfg;
+	c->enabled = true;
+	c->sets = c->size / (c->assoc * c->line_size);
+	c->line_shift = __builtin_ctz(c->line_size);
+	c->tags = calloc(c->sets * c->assoc, sizeof(uint32_t));
+	c->lru = calloc(c->sets * c->assoc, sizeof(uint8_t));
+	c->plru = calloc(c->sets, sizeof(uint32_t));
+	assert(c->tags != NULL && c->lru != NULL && c->plru != NULL);
+	cache_reset(c);
+	return true;
+}
+
+/***************************************************************/
+/* Invalidate every line and clear the statistics                               */
+/***************************************************************/
+void cache_reset(cache_t *c) {
+	uint32_t i;
+
+	if (!c->enabled) {
+		return;
+	}
+	c->pending_addr = CACHE_NO_MISS;
+	c->ready = 0;
+	memset(c->tags, 0, c->sets * c->assoc * sizeof(uint32_t));
+	memset(c->plru, 0, c->sets * sizeof(uint32_t));
+	for (i = 0; i < c->sets * c->assoc; i++) {
+		c->lru[i] = i % c->assoc;
+	}
+	c->random = 0x9E3779B9;
+	c->mru = 0;
+	c->reads = c->read_misses = c->writes = c->write_misses = c->writebacks = c->stall_cycles = 0;
+}
+
+void cache_release(cache_t *c) {
+	free(c->tags);
+	free(c->lru);
+	free(c->plru);
+	memset(c, 0, sizeof(*c));
+}
+
+/***************************************************************/
+/* Copy a cache's state into a snapshot, or back out of one. Restoring */
+/* into a cache configured differently since the save just resets it. */
+/***************************************************************/
+static void cache_save(cache_t *saved, const cache_t *c) {
+	cache_release(saved);
+	*saved = *c;
+	if (!c->enabled) {
+		return;
+	}
+	saved->tags = malloc(c->sets * c->assoc * sizeof(uint32_t));
+	saved->lru = malloc(c->sets * c->assoc * sizeof(uint8_t));
+	saved->plru = malloc(c->sets * sizeof(uint32_t));
+	assert(saved->tags != NULL && saved->lru != NULL && saved->plru != NULL);
+	memcpy(saved->tags, c->tags, c->sets * c->assoc * sizeof(uint32_t));
+	memcpy(saved->lru, c->lru, c->sets * c->assoc * sizeof(uint8_t));
+	memcpy(saved->plru, c->plru, c->sets * sizeof(uint32_t));
+}
+
+static void cache_restore(cache_t *c, const cache_t *saved) {
+	uint32_t *tags = c->tags, *plru = c->plru;
+	uint8_t *lru = c->lru;
+
+	if (!c->enabled || !saved->enabled || c->size != saved->size || c->assoc != saved->assoc ||
+		c->line_size != saved->line_size || c->policy != saved->policy ||
+		c->write_back != saved->write_back || c->miss_latency != saved->miss_latency ||
+		c->hit_latency != saved->hit_latency) {
+		cache_reset(c);
+		return;
+	}
+	*c = *saved;
+	c->tags = tags;
+	c->lru = lru;
+	c->plru = plru;
+	memcpy(c->tags, saved->tags, c->sets * c->assoc * sizeof(uint32_t));
+	memcpy(c->lru, saved->lru, c->sets * c->assoc * sizeof(uint8_t));
+	memcpy(c->plru, saved->plru, c->sets * sizeof(uint32_t));
+}
+
+/* make way the most recently used of its set */
+static inline void cache_touch(cache_t *c, uint32_t set, uint32_t way) {
+	uint8_t *rank = &c->lru[set * c->assoc];
+	uint32_t w, node = 1, bit, level, levels;
+
+	if (c->policy == CACHE_LRU) {
+		for (w = 0; w < c->assoc; w++) {
+			rank[w] += rank[w] < rank[way];
+		}
+		rank[way] = 0;
+	}
+	else if (c->policy == CACHE_PLRU) {
+		// every node on the way's path points at the other half
+		levels = __builtin_ctz(c->assoc);
+		for (level = 0; level < levels; level++) {
+			bit = (way >> (levels - 1 - level)) & 1;
+			c->plru[set] = bit ? c->plru[set] & ~(1u << node) : c->plru[set] | (1u << node);
+			node = node * 2 + bit;
+		}
+	}
+}
+
+static inline uint32_t cache_victim(cache_t *c, uint32_t set) {
+	const uint32_t *tags = &c->tags[set * c->assoc];
+	const uint8_t *rank = &c->lru[set * c->assoc];
+	uint32_t way, node = 1;
+
+	for (way = 0; way < c->assoc; way++) {
+		if (!(tags[way] & CACHE_VALID)) {
+			return way;
+		}
+	}
+	switch (c->policy) {
+		case CACHE_LRU:
+			for (way = 0; rank[way] != c->assoc - 1; way++);
+			return way;
+		case CACHE_PLRU:
+			while (node < c->assoc) {
+				node = node * 2 + ((c->plru[set] >> node) & 1);
+			}
+			return node - c->assoc;
+		default:
+			c->random ^= c->random << 13;
+			c->random ^= c->random >> 17;
+			c->random ^= c->random << 5;
+			return c->random & (c->assoc - 1);
+	}
+}
+
+/***************************************************************/
+/* Look up one access, filling the line on a miss. Returns the miss    */
+/* latency, 0 on a hit. Write-through caches do not allocate on a      */
+/* write miss and a write buffer hides the memory write, so only read  */
+/* misses and write-back write misses cost cycles. Dirty victims are  */
+/* counted but written back without a stall.                                         */
+/***************************************************************/
+static inline uint32_t cache_access(cache_t *c, uint32_t addr, bool write) {
+	uint32_t line = (addr & ~(c->line_size - 1)) | CACHE_VALID;
+	uint32_t set = (addr >> c->line_shift) & (c->sets - 1);
+	uint32_t *tags = &c->tags[set * c->assoc];
+	uint32_t dirty = write && c->write_back ? CACHE_DIRTY : 0;
+	uint32_t way;
+
+	write ? c->writes++ : c->reads++;
+
+	// a repeat of the last hit is already most recent in its set
+	if ((c->tags[c->mru] & ~CACHE_DIRTY) == line) {
+		c->tags[c->mru] |= dirty;
+		return 0;
+	}
+	for (way = 0; way < c->assoc; way++) {
+		if ((tags[way] & ~CACHE_DIRTY) == line) {
+			tags[way] |= dirty;
+			cache_touch(c, set, way);
+			c->mru = set * c->assoc + way;
+			return 0;
+		}
+	}
+
+	write ? c->write_misses++ : c->read_misses++;
+	if (write && !c->write_back) {
+		return 0;
+	}
+	way = cache_victim(c, set);
+	if ((tags[way] & (CACHE_VALID | CACHE_DIRTY)) == (CACHE_VALID | CACHE_DIRTY)) {
+		c->writebacks++;
+		c->victim = tags[way] & ~(CACHE_VALID | CACHE_DIRTY);
+	}
+	tags[way] = line | dirty;
+	cache_touch(c, set, way);
+	c->mru = set * c->assoc + way;
+	return c->miss_latency;
+}
+
+/* whether addr's line is in the cache, without touching its state */
+static bool cache_probe(const cache_t *c, uint32_t addr) {
+	uint32_t line = (addr & ~(c->line_size - 1)) | CACHE_VALID;
+	uint32_t set = (addr >> c->line_shift) & (c->sets - 1);
+	uint32_t way;
+
+	for (way = 0; way < c->assoc; way++) {
+		if ((c->tags[set * c->assoc + way] & ~CACHE_DIRTY) == line) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool prefetch_claim(uint32_t addr, uint32_t *latency);
+static void prefetch_train(uint32_t addr, uint32_t pc, bool miss);
+
+/***************************************************************/
+/* Whether the stage accessing addr can complete it this cycle. A miss */
+/* stays outstanding until COUNTERS.cycles reaches its ready cycle, so  */
+/* it keeps counting down while the pipeline is stalled for other      */
+/* reasons. A fetch abandoned by a branch is simply never completed.  */
+/* The miss and its stall cycles are charged to the instruction at pc. */
+/* With a memory hierarchy below, a miss waits for memsys_access()    */
+/* instead of the flat miss latency, and writes go down to it. Loads   */
+/* train the L1D prefetcher and take lines from its buffer.                 */
+/***************************************************************/
+static inline bool cache_ready(cache_t *c, uint32_t addr, bool write, uint32_t pc) {
+	uint32_t latency;
+	uint64_t writebacks = c->writebacks;
+	bool prefetching = c == &L1D && PREFETCH.kind != PF_NONE && !write, miss;
+
+	if (!c->enabled) {
+		return true;
+	}
+	if (addr != c->pending_addr) {
+		latency = cache_access(c, addr, write);
+		miss = latency != 0;
+		if (MEMSYS.enabled) {
+			if (c->writebacks != writebacks) {
+				memsys_access(c->victim, true);
+			}
+			if (write && !c->write_back) {
+				memsys_access(addr, true);
+			}
+		}
+		if (miss && prefetching && prefetch_claim(addr, &latency)) {
+			// the prefetch buffer had the line, latency is what is left of its fill
+		}
+		else if (miss && MEMSYS.enabled) {
+			latency = memsys_access(addr, false);
+		}
+		if (prefetching) {
+			prefetch_train(addr, pc, miss);
+		}
+		if (latency == 0) {
+			return true;
+		}
+		c->pending_addr = addr;
+		c->ready = COUNTERS.cycles + latency;
+		if (c == &L1I) {
+			PROFILE_COUNT(pc, icache_misses);
+		}
+		else {
+			PROFILE_COUNT(pc, dcache_misses);
+		}
+	}
+	if (COUNTERS.cycles < c->ready) {
+		c->stall_cycles++;
+		PROFILE_COUNT(pc, stall_cycles);
+		return false;
+	}
+	c->pending_addr = CACHE_NO_MISS;
+	return true;
+}
+
+void cache_dump(const char *name, const cache_t *c) {
+	uint64_t accesses = c->reads + c->writes, misses = c->read_misses + c->write_misses;
+
+	if (!c->enabled) {
+		printf("%s\t\t\t: off\n", name);
+		return;
+	}
+	printf("%s\t\t\t: %uB, %u-way, %uB lines, %s, %s, %u cycle %s\n", name, c->size, c->assoc,
+		c->line_size, CACHE_POLICY_NAMES[c->policy], c->write_back ? "write-back" : "write-through",
+		c->hit_latency ? c->hit_latency : c->miss_latency, c->hit_latency ? "hits" : "misses");
+	printf("  reads\t\t\t: %llu (%llu misses)\n", (unsigned long long)c->reads, (unsigned long long)c->read_misses);
+	printf("  writes\t\t: %llu (%llu misses, %llu writebacks)\n", (unsigned long long)c->writes,
+		(unsigned long long)c->write_misses, (unsigned long long)c->writebacks);
+	printf("  hit rate\t\t: %.2f%%\n", accesses ? 100.0 * (accesses - misses) / accesses : 0.0);
+	printf("  stall cycles\t\t: %llu\n", (unsigned long long)c->stall_cycles);
+}
+
+/***************************************************************/
+/* Memory hierarchy below the L1s                                                            */
+/***************************************************************/
+
+/* "<banks>:<row bytes>[:<tCAS>[:<tRCD>[:<tRP>]]]" */
+static bool dram_configure(const char *spec) {
+	dram_t cfg;
+	char copy[64], *field[6], *save = NULL;
+	int n = 0;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.t_cas = cfg.t_rcd = cfg.t_rp = 15;
+	snprintf(copy, sizeof(copy), "%s", spec);
+	for (field[n] = strtok_r(copy, ":", &save); field[n] != NULL && n < 5; field[n] = strtok_r(NULL, ":", &save)) {
+		n++;
+	}
+	if (n < 2 || !cache_parse_size(field[0], &cfg.banks) || !cache_parse_size(field[1], &cfg.row_size) ||
+		cfg.banks > DRAM_MAX_BANKS || cfg.row_size < 64) {
+		printf("Error: bad DRAM '%s', want power-of-two <banks>:<row bytes> with banks <= %d and rows >= 64\n",
+			spec, DRAM_MAX_BANKS);
+		return false;
+	}
+	if (n > 2) {
+		cfg.t_cas = strtoul(field[2], NULL, 0);
+	}
+	if (n > 3) {
+		cfg.t_rcd = strtoul(field[3], NULL, 0);
+	}
+	if (n > 4) {
+		cfg.t_rp = strtoul(field[4], NULL, 0);
+	}
+	DRAM = cfg;
+	return true;
+}
+
+/***************************************************************/
+/* Configure one level: "l2" takes a cache spec whose latency is the */
+/* L2 hit latency, "dram" a DRAM spec (default 8:2k:15:15:15), and    */
+/* "mshrs" the number of misses that can be outstanding below the    */
+/* L1s (default 8). Either of the first two turns the hierarchy on,    */
+/* an L2 brings the default DRAM with it. Everything starts cold.        */
+/***************************************************************/
+bool memsys_configure(const char *level, const char *spec) {
+	uint32_t n;
+
+	if (strcmp(level, "l2") == 0) {
+		if (!cache_configure(&L2, spec)) {
+			return false;
+		}
+		L2.hit_latency = L2.miss_latency;
+		L2.miss_latency = 0;
+	}
+	else if (strcmp(level, "dram") == 0) {
+		if (!dram_configure(spec)) {
+			return false;
+		}
+		DRAM.enabled = true;
+	}
+	else if (strcmp(level, "mshrs") == 0) {
+		n = strtoul(spec, NULL, 0);
+		if (n == 0 || n > MSHR_MAX) {
+			printf("Error: MSHRs are 1 to %d, not '%s'\n", MSHR_MAX, spec);
+			return false;
+		}
+		MEMSYS.mshrs = n;
+	}
+	else {
+		printf("Error: the memory hierarchy has l2, dram and mshrs, not '%s'\n", level);
+		return false;
+	}
+	if (DRAM.banks == 0) {
+		dram_configure("8:2k");
+	}
+	if (MEMSYS.mshrs == 0) {
+		MEMSYS.mshrs = 8;
+	}
+	MEMSYS.enabled = L2.enabled || DRAM.enabled;
+	MEMSYS.line_shift = L2.enabled ? L2.line_shift : MEMSYS_LINE_SHIFT;
+	memsys_reset();
+	return true;
+}
+
+/***************************************************************/
+/* Empty the L2, close every row and free every MSHR; the            */
+/* configuration stays                                                                                   */
+/***************************************************************/
+void memsys_reset() {
+	uint32_t i;
+
+	cache_reset(&L2);
+	for (i = 0; i < DRAM_MAX_BANKS; i++) {
+		DRAM.open_row[i] = DRAM_NO_ROW;
+		DRAM.bank_ready[i] = 0;
+	}
+	DRAM.reads = DRAM.writes = DRAM.row_hits = DRAM.row_empty = DRAM.row_conflicts = 0;
+	DRAM.bank_conflicts = DRAM.bank_wait_cycles = 0;
+	memset(MEMSYS.mshr, 0, sizeof(MEMSYS.mshr));
+	MEMSYS.fills = MEMSYS.writes = MEMSYS.merged = MEMSYS.mshr_full = MEMSYS.mshr_wait_cycles = 0;
+	MEMSYS.fill_cycles = 0;
+}
+
+/* one DRAM access starting at cycle start, returns the cycles until its data */
+static uint32_t dram_access(uint32_t addr, uint64_t start, bool write) {
+	uint32_t row = addr / DRAM.row_size;
+	uint32_t bank = row & (DRAM.banks - 1);
+	uint64_t begin = start;
+	uint32_t latency;
+
+	row /= DRAM.banks;
+	write ? DRAM.writes++ : DRAM.reads++;
+	if (DRAM.bank_ready[bank] > start) {
+		DRAM.bank_conflicts++;
+		DRAM.bank_wait_cycles += DRAM.bank_ready[bank] - start;
+		begin = DRAM.bank_ready[bank];
+	}
+	if (DRAM.open_row[bank] == row) {
+		DRAM.row_hits++;
+		latency = DRAM.t_cas;
+	}
+	else if (DRAM.open_row[bank] == DRAM_NO_ROW) {
+		DRAM.row_empty++;
+		latency = DRAM.t_rcd + DRAM.t_cas;
+	}
+	else {
+		DRAM.row_conflicts++;
+		latency = DRAM.t_rp + DRAM.t_rcd + DRAM.t_cas;
+	}
+	// the row stays open for the next access to this bank
+	DRAM.open_row[bank] = row;
+	DRAM.bank_ready[bank] = begin + latency;
+	return begin + latency - start;
+}
+
+/* a posted write into the L2, or straight to DRAM without one */
+static void memsys_write(uint32_t addr) {
+	uint64_t writebacks = L2.writebacks, misses = L2.write_misses;
+
+	MEMSYS.writes++;
+	if (!L2.enabled) {
+		dram_access(addr, COUNTERS.cycles, true);
+		return;
+	}
+	cache_access(&L2, addr, true);
+	if (!L2.write_back) {
+		dram_access(addr, COUNTERS.cycles, true);
+	}
+	else if (L2.write_misses != misses) {
+		// the rest of the allocated line still has to be read
+		dram_access(addr, COUNTERS.cycles, false);
+	}
+	if (L2.writebacks != writebacks) {
+		dram_access(L2.victim, COUNTERS.cycles, true);
+	}
+}
+
+/***************************************************************/
+/* Access the hierarchy below the L1s, returns the cycles until the   */
+/* line is back; writes return 0. A fill to a line already in flight   */
+/* joins its MSHR; otherwise an L2 miss takes a free MSHR, waiting for */
+/* the earliest one to finish when they are all busy, and reads DRAM.  */
+/***************************************************************/
+uint32_t memsys_access(uint32_t addr, bool write) {
+	uint64_t now = COUNTERS.cycles, start = now, writebacks = L2.writebacks, misses = L2.read_misses;
+	uint32_t line = addr >> MEMSYS.line_shift;
+	uint32_t i, free_mshr = 0, latency;
+
+	if (write) {
+		memsys_write(addr);
+		return 0;
+	}
+	MEMSYS.fills++;
+	for (i = 0; i < MEMSYS.mshrs; i++) {
+		if (MEMSYS.mshr[i].ready > now && MEMSYS.mshr[i].line == line) {
+			MEMSYS.merged++;
+			MEMSYS.fill_cycles += MEMSYS.mshr[i].ready - now;
+			return MEMSYS.mshr[i].ready - now;
+		}
+		if (MEMSYS.mshr[i].ready < MEMSYS.mshr[free_mshr].ready) {
+			free_mshr = i;
+		}
+	}
+	if (L2.enabled) {
+		cache_access(&L2, addr, false);
+		if (L2.read_misses == misses) {
+			MEMSYS.fill_cycles += L2.hit_latency;
+			return L2.hit_latency;
+		}
+	}
+	if (L2.writebacks != writebacks) {
+		dram_access(L2.victim, now, true);
+	}
+
+	if (MEMSYS.mshr[free_mshr].ready > now) {
+		MEMSYS.mshr_full++;
+		MEMSYS.mshr_wait_cycles += MEMSYS.mshr[free_mshr].ready - now;
+		start = MEMSYS.mshr[free_mshr].ready;
+	}
+	start += L2.hit_latency;
+	latency = start - now + dram_access(addr, start, false);
+	MEMSYS.mshr[free_mshr].line = line;
+	MEMSYS.mshr[free_mshr].ready = now + latency;
+	MEMSYS.fill_cycles += latency;
+	return latency;
+}
+
+/***************************************************************/
+/* L1D prefetcher                                                                                                           */
+/***************************************************************/
+static const char *PREFETCH_KIND_NAMES[] = { "off", "nextline", "stride", "stream" };
+
+/***************************************************************/
+/* Configure the prefetcher from "<kind>[:<degree>[:<entries>]]",      */
+/* kind being off, nextline, stride or stream. Degree defaults to 1,  */
+/* 2 and 4 lines; entries are the stride table size (default 64) or    */
+/* the number of streams (default 4). It only runs with an L1D.           */
+/***************************************************************/
+bool prefetch_configure(const char *spec) {
+	char copy[64], *kind, *degree, *entries, *save = NULL;
+	int k;
+
+	snprintf(copy, sizeof(copy), "%s", spec);
+	kind = strtok_r(copy, ":", &save);
+	degree = strtok_r(NULL, ":", &save);
+	entries = strtok_r(NULL, ":", &save);
+	for (k = 0; k < 4 && (kind == NULL || strcmp(kind, PREFETCH_KIND_NAMES[k]) != 0); k++);
+	if (k == 4) {
+		printf("Error: prefetcher is off, nextline, stride or stream, not '%s'\n", spec);
+		return false;
+	}
+	PREFETCH.kind = k;
+	PREFETCH.degree = k == PF_NEXT_LINE ? 1 : k == PF_STRIDE ? 2 : 4;
+	PREFETCH.entries = k == PF_STRIDE ? 64 : 4;
+	if (degree != NULL) {
+		PREFETCH.degree = strtoul(degree, NULL, 0);
+	}
+	if (entries != NULL && !cache_parse_size(entries, &PREFETCH.entries)) {
+		PREFETCH.entries = 0;
+	}
+	if (PREFETCH.degree < 1 || PREFETCH.degree > PF_BUFFER_ENTRIES || PREFETCH.entries < 1 ||
+		PREFETCH.entries > PF_MAX_TABLE) {
+		printf("Error: bad prefetcher '%s', want degree 1-%d and a power-of-two table of at most %d entries\n",
+			spec, PF_BUFFER_ENTRIES, PF_MAX_TABLE);
+		PREFETCH.kind = PF_NONE;
+		return false;
+	}
+	prefetch_reset();
+	return true;
+}
+
+/***************************************************************/
+/* Empty the buffer, forget what was learnt and clear the statistics  */
+/***************************************************************/
+void prefetch_reset() {
+	memset(PREFETCH.buffer, 0, sizeof(PREFETCH.buffer));
+	memset(PREFETCH.table, 0, sizeof(PREFETCH.table));
+	memset(PREFETCH.streams, 0, sizeof(PREFETCH.streams));
+	PREFETCH.next_slot = 0;
+	PREFETCH.issued = PREFETCH.redundant = PREFETCH.useful = PREFETCH.late = PREFETCH.late_cycles = 0;
+	PREFETCH.useless = PREFETCH.misses = 0;
+}
+
+// a load missed the L1D: take its line from the buffer if a prefetch brought it
+static bool prefetch_claim(uint32_t addr, uint32_t *latency) {
+	uint32_t line = addr >> L1D.line_shift, i;
+	pf_buffer_entry_t *e;
+
+	for (i = 0; i < PF_BUFFER_ENTRIES; i++) {
+		e = &PREFETCH.buffer[i];
+		if (e->valid && e->line == line) {
+			e->valid = false;
+			PREFETCH.useful++;
+			*latency = 0;
+			if (e->ready > COUNTERS.cycles) {
+				PREFETCH.late++;
+				PREFETCH.late_cycles += e->ready - COUNTERS.cycles;
+				*latency = e->ready - COUNTERS.cycles;
+			}
+			return true;
+		}
+	}
+	PREFETCH.misses++;
+	return false;
+}
+
+// fetch a line into the buffer unless the L1D or the buffer has it already
+static void prefetch_issue(uint32_t line) {
+	uint32_t addr = line << L1D.line_shift, i;
+	pf_buffer_entry_t *e;
+
+	if (cache_probe(&L1D, addr)) {
+		PREFETCH.redundant++;
+		return;
+	}
+	for (i = 0; i < PF_BUFFER_ENTRIES; i++) {
+		if (PREFETCH.buffer[i].valid && PREFETCH.buffer[i].line == line) {
+			return;
+		}
+	}
+	e = &PREFETCH.buffer[PREFETCH.next_slot];
+	PREFETCH.next_slot = (PREFETCH.next_slot + 1) % PF_BUFFER_ENTRIES;
+	if (e->valid) {
+		PREFETCH.useless++;
+	}
+	e->line = line;
+	e->valid = true;
+	e->ready = COUNTERS.cycles + (MEMSYS.enabled ? memsys_access(addr, false) : L1D.miss_latency);
+	PREFETCH.issued++;
+}
+
+// learn from one load, miss is whether it missed the L1D
+static void prefetch_train(uint32_t addr, uint32_t pc, bool miss) {
+	uint32_t line = addr >> L1D.line_shift, target, last = line, i, k;
+	pf_stride_entry_t *entry;
+	pf_stream_t *stream, *victim;
+	int32_t stride;
+
+	switch (PREFETCH.kind) {
+		case PF_NEXT_LINE:
+			for (k = 1; miss && k <= PREFETCH.degree; k++) {
+				prefetch_issue(line + k);
+			}
+			break;
+		case PF_STRIDE:
+			entry = &PREFETCH.table[(pc >> 2) & (PREFETCH.entries - 1)];
+			if (entry->pc != pc) {
+				entry->pc = pc;
+				entry->last_addr = addr;
+				entry->stride = 0;
+				entry->confidence = 0;
+				break;
+			}
+			stride = (int32_t)(addr - entry->last_addr);
+			if (stride == entry->stride) {
+				entry->confidence += entry->confidence < 3;
+			}
+			else if (entry->confidence > 0) {
+				entry->confidence--;
+			}
+			else {
+				entry->stride = stride;
+			}
+			entry->last_addr = addr;
+			for (k = 1; entry->confidence >= 2 && entry->stride != 0 && k <= PREFETCH.degree; k++) {
+				target = (addr + k * entry->stride) >> L1D.line_shift;
+				if (target != last) {
+					prefetch_issue(target);
+					last = target;
+				}
+			}
+			break;
+		case PF_STREAM:
+			if (!miss) {
+				break;
+			}
+			victim = &PREFETCH.streams[0];
+			for (i = 0; i < PREFETCH.entries; i++) {
+				stream = &PREFETCH.streams[i];
+				if (stream->last_use != 0 && (stream->direction != 0 ? line == stream->next_line :
+					line == stream->next_line + 1 || line == stream->next_line - 1)) {
+					// the first adjacent miss confirms the direction
+					if (stream->direction == 0) {
+						stream->direction = line == stream->next_line + 1 ? 1 : -1;
+					}
+					for (k = 1; k <= PREFETCH.degree; k++) {
+						prefetch_issue(line + k * stream->direction);
+					}
+					stream->next_line = line + stream->direction;
+					stream->last_use = COUNTERS.cycles + 1;
+					return;
+				}
+				if (stream->last_use < victim->last_use) {
+					victim = stream;
+				}
+			}
+			victim->next_line = line;
+			victim->direction = 0;
+			victim->last_use = COUNTERS.cycles + 1;
+			break;
+		default:
+			break;
+	}
+}
+
+void prefetch_dump(const prefetcher_t *pf) {
+	if (pf->kind == PF_NONE) {
+		printf("Prefetcher\t\t: off\n");
+		return;
+	}
+	printf("Prefetcher\t\t: %s, degree %u", PREFETCH_KIND_NAMES[pf->kind], pf->degree);
+	if (pf->kind != PF_NEXT_LINE) {
+		printf(", %u %s", pf->entries, pf->kind == PF_STREAM ? "streams" : "table entries");
+	}
+	printf("\n");
+	printf("  issued\t\t: %llu (%llu more were cached already)\n", (unsigned long long)pf->issued,
+		(unsigned long long)pf->redundant);
+	printf("  useful\t\t: %llu (%llu late, %llu cycles still waited)\n", (unsigned long long)pf->useful,
+		(unsigned long long)pf->late, (unsigned long long)pf->late_cycles);
+	printf("  useless\t\t: %llu evicted unused\n", (unsigned long long)pf->useless);
+	printf("  coverage\t\t: %.2f%% of load misses\n",
+		pf->useful + pf->misses ? 100.0 * pf->useful / (pf->useful + pf->misses) : 0.0);
+	printf("  accuracy\t\t: %.2f%% of prefetches used\n", pf->issued ? 100.0 * pf->useful / pf->issued : 0.0);
+	printf("  timeliness\t\t: %.2f%% arrived in time\n",
+		pf->useful ? 100.0 * (pf->useful - pf->late) / pf->useful : 0.0);
+}
+
+void memsys_dump(const cache_t *l2, const dram_t *dram, const memsys_t *memsys) {
+	uint64_t accesses = dram->reads + dram->writes;
+
+	if (!memsys->enabled) {
+		printf("Memory hierarchy\t: off\n");
+		return;
+	}
+	if (l2->enabled) {
+		cache_dump("L2", l2);
+	}
+	printf("MSHRs\t\t\t: %u\n", memsys->mshrs);
+	printf("  fills\t\t\t: %llu (%llu merged, %.1f cycles average)\n", (unsigned long long)memsys->fills,
+		(unsigned long long)memsys->merged, memsys->fills ? (double)memsys->fill_cycles / memsys->fills : 0.0);
+	printf("  posted writes\t\t: %llu\n", (unsigned long long)memsys->writes);
+	printf("  all busy\t\t: %llu (%llu cycles waited)\n", (unsigned long long)memsys->mshr_full,
+		(unsigned long long)memsys->mshr_wait_cycles);
+	printf("DRAM\t\t\t: %u banks, %uB rows, tCAS %u, tRCD %u, tRP %u\n", dram->banks, dram->row_size,
+		dram->t_cas, dram->t_rcd, dram->t_rp);
+	printf("  reads\t\t\t: %llu\n", (unsigned long long)dram->reads);
+	printf("  writes\t\t: %llu\n", (unsigned long long)dram->writes);
+	printf("  row buffer\t\t: %llu hits, %llu empty, %llu conflicts (%.2f%% hits)\n",
+		(unsigned long long)dram->row_hits, (unsigned long long)dram->row_empty,
+		(unsigned long long)dram->row_conflicts, accesses ? 100.0 * dram->row_hits / accesses : 0.0);
+	printf("  bank conflicts\t: %llu (%llu cycles waited)\n", (unsigned long long)dram->bank_conflicts,
+		(unsigned long long)dram->bank_wait_cycles);
+}
+
+/***************************************************************/
+/* Store buffer                                                                                                              */
+/***************************************************************/
+static inline uint32_t mem_access_size(const decoded_inst_t *d) {
+	switch (d->op) {
+		case OP_LB: case OP_SB:
+			return 1;
+		case OP_LH: case OP_SH:
+			return 2;
+		default:
+			return 4;
+	}
+}
+
+/***************************************************************/
+/* Set the depth from "<entries>" or "off" (0). Buffered stores are    */
+/* written to memory first so no data is lost.                               */
+/***************************************************************/
+bool store_buffer_configure(const char *spec) {
+	char *end;
+	unsigned long depth = 0;
+
+	if (strcmp(spec, "off") != 0) {
+		depth = strtoul(spec, &end, 0);
+		if (end == spec || *end != '\0' || depth > STORE_BUFFER_MAX) {
+			printf("Bad store buffer depth '%s' (0..%d or off)\n", spec, STORE_BUFFER_MAX);
+			return false;
+		}
+	}
+	store_buffer_flush();
+	STORE_BUFFER.depth = depth;
+	store_buffer_reset();
+	return true;
+}
+
+/* drop the entries and statistics, keeping the depth */
+void store_buffer_reset() {
+	uint32_t depth = STORE_BUFFER.depth;
+
+	memset(&STORE_BUFFER, 0, sizeof(STORE_BUFFER));
+	STORE_BUFFER.depth = depth;
+}
+
+static void store_buffer_write(const store_buffer_entry_t *e) {
+	uint32_t i;
+
+	if (e->mask == 0xF) {
+		mem_write_32(e->addr, e->data);
+		return;
+	}
+	for (i = 0; i < 4; i++) {
+		if (e->mask & (1 << i)) {
+			mem_write_8(e->addr + i, e->data >> (8 * i));
+		}
+	}
+}
+
+static inline void store_buffer_pop() {
+	STORE_BUFFER.head = (STORE_BUFFER.head + 1) % STORE_BUFFER_MAX;
+	STORE_BUFFER.count--;
+	STORE_BUFFER.drains++;
+}
+
+/* write every buffered store to memory at once, without timing */
+void store_buffer_flush() {
+	while (STORE_BUFFER.count != 0) {
+		store_buffer_write(&STORE_BUFFER.entry[STORE_BUFFER.head]);
+		store_buffer_pop();
+	}
+	STORE_BUFFER.draining = false;
+}
+
+/* the youngest entry holding the word at addr, NULL if there is none */
+static store_buffer_entry_t *store_buffer_find(uint32_t addr) {
+	uint32_t i, word = addr & ~3u;
+	store_buffer_entry_t *e;
+
+	for (i = STORE_BUFFER.count; i-- > 0;) {
+		e = &STORE_BUFFER.entry[(STORE_BUFFER.head + i) % STORE_BUFFER_MAX];
+		if (e->addr == word) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+// a store can combine into any entry but the one being written to the L1D
+static inline bool store_buffer_open(const store_buffer_entry_t *e) {
+	return e != NULL && !(STORE_BUFFER.draining && e == &STORE_BUFFER.entry[STORE_BUFFER.head]);
+}
+
+/* memory's word at addr (aligned) with the buffered bytes laid over it, oldest first */
+static uint32_t store_buffer_read_32(uint32_t addr) {
+	uint32_t value = mem_read_32(addr), i, k;
+	store_buffer_entry_t *e;
+
+	for (k = 0; k < STORE_BUFFER.count; k++) {
+		e = &STORE_BUFFER.entry[(STORE_BUFFER.head + k) % STORE_BUFFER_MAX];
+		if (e->addr != addr) {
+			continue;
+		}
+		for (i = 0; i < 4; i++) {
+			if (e->mask & (1 << i)) {
+				value = (value & ~(0xFFu << (8 * i))) | (e->data & (0xFFu << (8 * i)));
+			}
+		}
+	}
+	return value;
+}
+
+/***************************************************************/
+/* Whether MEM can do its access this cycle. Without a buffer that is  */
+/* the L1D's answer. With one, a store only needs a free entry (or one */
+/* for the same word to combine into) and a load is served from an   */
+/* entry holding all its bytes; a load that only partly overlaps an     */
+/* entry waits for it to drain. Unaligned accesses, which fault later,  */
+/* wait for the buffer to empty and go to the cache.                     */
+/***************************************************************/
+static inline bool store_buffer_ready(uint32_t addr, uint32_t size, bool store, uint32_t pc) {
+	store_buffer_entry_t *e;
+	uint8_t mask = ((1u << size) - 1) << (addr & 3);
+
+	if (STORE_BUFFER.depth == 0) {
+		return cache_ready(&L1D, addr, store, pc);
+	}
+	if (addr & (size - 1)) {
+		if (STORE_BUFFER.count == 0) {
+			return cache_ready(&L1D, addr, store, pc);
+		}
+		STORE_BUFFER.partial_cycles++;
+		PROFILE_COUNT(pc, stall_cycles);
+		return false;
+	}
+	e = store_buffer_find(addr);
+	if (store) {
+		if (store_buffer_open(e) || STORE_BUFFER.count < STORE_BUFFER.depth) {
+			return true;
+		}
+		STORE_BUFFER.full_cycles++;
+		PROFILE_COUNT(pc, stall_cycles);
+		return false;
+	}
+	if (e == NULL) {
+		return cache_ready(&L1D, addr, false, pc);
+	}
+	if ((e->mask & mask) == mask) {
+		return true;
+	}
+	STORE_BUFFER.partial_cycles++;
+	PROFILE_COUNT(pc, stall_cycles);
+	return false;
+}
+
+/* the zero-extended value a load of size bytes reads */
+static inline uint32_t store_buffer_load(uint32_t addr, uint32_t size) {
+	store_buffer_entry_t *e = NULL;
+	uint32_t value;
+
+	if (STORE_BUFFER.count != 0 && !(addr & (size - 1))) {
+		e = store_buffer_find(addr);
+	}
+	if (e != NULL) {
+		// store_buffer_ready() let the load through, so the entry holds every byte
+		STORE_BUFFER.forwards++;
+		value = e->data >> (8 * (addr & 3));
+		return size == 4 ? value : value & ((1u << (8 * size)) - 1);
+	}
+	switch (size) {
+		case 1:
+			return mem_read_8(addr);
+		case 2:
+			return mem_read_16(addr);
+		default:
+			return mem_read_32(addr);
+	}
+}
+
+static inline void store_buffer_store(uint32_t addr, uint32_t size, uint32_t value, uint32_t pc) {
+	store_buffer_entry_t *e;
+	uint32_t shift = 8 * (addr & 3), lane;
+
+	// stores into text go to memory at once, after the older buffered ones, so fetch sees them
+	if (STORE_BUFFER.depth == 0 || (addr & (size - 1)) || mem_is_text(addr)) {
+		store_buffer_flush();
+		switch (size) {
+			case 1:
+				mem_write_8(addr, value);
+				break;
+			case 2:
+				mem_write_16(addr, value);
+				break;
+			default:
+				mem_write_32(addr, value);
+				break;
+		}
+		return;
+	}
+	STORE_BUFFER.stores++;
+	e = store_buffer_find(addr);
+	if (store_buffer_open(e)) {
+		STORE_BUFFER.combined++;
+	}
+	else {
+		e = &STORE_BUFFER.entry[(STORE_BUFFER.head + STORE_BUFFER.count) % STORE_BUFFER_MAX];
+		STORE_BUFFER.count++;
+		e->addr = addr & ~3u;
+		e->data = 0;
+		e->mask = 0;
+		e->pc = pc;
+	}
+	lane = size == 4 ? 0xFFFFFFFFu : ((1u << (8 * size)) - 1) << shift;
+	e->data = (e->data & ~lane) | ((value << shift) & lane);
+	e->mask |= ((1u << size) - 1) << (addr & 3);
+}
+
+/***************************************************************/
+/* Move the oldest entry on to the L1D: finish its write when the     */
+/* cycle comes, then start the next one. A hit completes at once, a   */
+/* miss keeps the entry (and the drains behind it) waiting. Called   */
+/* once a cycle ahead of MEM, so an entry never drains in the cycle */
+/* it was written.                                                                           */
+/***************************************************************/
+static void store_buffer_drain() {
+	store_buffer_entry_t *e = &STORE_BUFFER.entry[STORE_BUFFER.head];
+	uint32_t latency = 0;
+	uint64_t writebacks = L1D.writebacks;
+
+	STORE_BUFFER.occupancy += STORE_BUFFER.count;
+	if (COUNTERS.cycles < STORE_BUFFER.busy_until) {
+		return;
+	}
+	if (STORE_BUFFER.draining) {
+		STORE_BUFFER.draining = false;
+		store_buffer_write(e);
+		store_buffer_pop();
+		e = &STORE_BUFFER.entry[STORE_BUFFER.head];
+	}
+	if (STORE_BUFFER.count == 0) {
+		return;
+	}
+	if (L1D.enabled) {
+		latency = cache_access(&L1D, e->addr, true);
+		if (MEMSYS.enabled) {
+			if (L1D.writebacks != writebacks) {
+				memsys_access(L1D.victim, true);
+			}
+			if (!L1D.write_back) {
+				memsys_access(e->addr, true);
+			}
+			if (latency != 0) {
+				latency = memsys_access(e->addr, false);
+			}
+		}
+	}
+	if (latency == 0) {
+		store_buffer_write(e);
+		store_buffer_pop();
+		return;
+	}
+	STORE_BUFFER.busy_until = COUNTERS.cycles + latency;
+	STORE_BUFFER.draining = true;
+}
+
+void store_buffer_dump(const store_buffer_t *sb, const sim_counters_t *c) {
+	if (sb->depth == 0) {
+		printf("Store buffer\t\t: off\n");
+		return;
+	}
+	printf("Store buffer\t\t: %u entries\n", sb->depth);
+	printf("  stores\t\t: %llu (%llu combined into a buffered word)\n", (unsigned long long)sb->stores,
+		(unsigned long long)sb->combined);
+	printf("  drains\t\t: %llu word writes\n", (unsigned long long)sb->drains);
+	printf("  load forwards\t\t: %llu\n", (unsigned long long)sb->forwards);
+	printf("  full stalls\t\t: %llu cycles\n", (unsigned long long)sb->full_cycles);
+	printf("  partial stalls\t: %llu cycles\n", (unsigned long long)sb->partial_cycles);
+	printf("  occupancy\t\t: %.2f entries average\n", c->cycles ? (double)sb->occupancy / c->cycles : 0.0);
+}
+
+/***************************************************************/
+/* Branch prediction                                                                                                  */
+/***************************************************************/
+static const char *BP_KIND_NAMES[] = { "nottaken", "bimodal", "gshare", "tournament" };
+
+/***************************************************************/
+/* Configure the predictor from "<kind>[:<table bits>[:<btb entries>  */
+/* [:<ras entries>]]]", kind being nottaken, bimodal, gshare or        */
+/* tournament. Defaults are 10 bits, 512 BTB entries and 8 RAS entries */
+/* except for nottaken, which defaults to no BTB and no RAS.            */
+/***************************************************************/
+bool bp_configure(const char *spec) {
+	branch_predictor_t cfg;
+	char copy[64], *field[5], *save = NULL;
+	int n = 0, k;
+
+	memset(&cfg, 0, sizeof(cfg));
+	snprintf(copy, sizeof(copy), "%s", spec);
+	for (field[n] = strtok_r(copy, ":", &save); field[n] != NULL && n < 4; field[n] = strtok_r(NULL, ":", &save)) {
+		n++;
+	}
+	for (k = 0; n > 0 && k < 4 && strcmp(field[0], BP_KIND_NAMES[k]) != 0; k++);
+	if (n == 0 || k == 4) {
+		printf("Error: branch predictor is nottaken, bimodal, gshare or tournament, not '%s'\n", spec);
+		return false;
+	}
+	cfg.kind = k;
+	cfg.table_bits = n > 1 ? strtoul(field[1], NULL, 0) : 10;
+	cfg.btb_entries = n > 2 ? strtoul(field[2], NULL, 0) : (k == BP_NOT_TAKEN ? 0 : 512);
+	cfg.ras_entries = n > 3 ? strtoul(field[3], NULL, 0) : (k == BP_NOT_TAKEN ? 0 : 8);
+	if (cfg.table_bits < 1 || cfg.table_bits > 20 || (cfg.btb_entries & (cfg.btb_entries - 1)) != 0 ||
+		cfg.btb_entries > (1 << 20) || cfg.ras_entries > 1024) {
+		printf("Error: bad branch predictor '%s', want 1-20 table bits, a power-of-two BTB and at most 1024 RAS entries\n", spec);
+		return false;
+	}
+
+	bp_release();
+	BP = cfg;
+	if (BP.kind != BP_NOT_TAKEN) {
+		BP.bimodal = malloc(1 << BP.table_bits);
+		BP.gshare = malloc(1 << BP.table_bits);
+		BP.chooser = malloc(1 << BP.table_bits);
+		assert(BP.bimodal != NULL && BP.gshare != NULL && BP.chooser != NULL);
+	}
+	if (BP.btb_entries != 0) {
+		BP.btb_tags = malloc(BP.btb_entries * sizeof(uint32_t));
+		BP.btb_targets = malloc(BP.btb_entries * sizeof(uint32_t));
+		assert(BP.btb_tags != NULL && BP.btb_targets != NULL);
+	}
+	if (BP.ras_entries != 0) {
+		BP.ras = malloc(BP.ras_entries * sizeof(uint32_t));
+		assert(BP.ras != NULL);
+	}
+	bp_reset();
+	return true;
+}
+
+/***************************************************************/
+/* Forget everything learned: weakly not-taken counters, a chooser    */
+/* leaning to bimodal, empty BTB and RAS, and clear the statistics      */
+/***************************************************************/
+void bp_reset() {
+	uint32_t i;
+
+	if (BP.kind != BP_NOT_TAKEN) {
+		memset(BP.bimodal, 1, 1 << BP.table_bits);
+		memset(BP.gshare, 1, 1 << BP.table_bits);
+		memset(BP.chooser, 1, 1 << BP.table_bits);
+	}
+	for (i = 0; i < BP.btb_entries; i++) {
+		BP.btb_tags[i] = BP_NO_PC;
+	}
+	if (BP.ras_entries != 0) {
+		memset(BP.ras, 0, BP.ras_entries * sizeof(uint32_t));
+	}
+	BP.history = 0;
+	BP.ras_top = 0;
+	BP.conditional = BP.conditional_correct = 0;
+	BP.btb_lookups = BP.btb_hits = BP.returns = BP.returns_correct = 0;
+}
+
+void bp_release() {
+	free(BP.bimodal);
+	free(BP.gshare);
+	free(BP.chooser);
+	free(BP.btb_tags);
+	free(BP.btb_targets);
+	free(BP.ras);
+	memset(&BP, 0, sizeof(BP));
+}
+
+/***************************************************************/
+/* Copy the predictor into a snapshot, or back out of one when the      */
+/* configuration still matches. Otherwise restoring just resets it.    */
+/***************************************************************/
+static void *bp_copy(const void *src, size_t size) {
+	void *dst;
+
+	if (src == NULL) {
+		return NULL;
+	}
+	dst = malloc(size);
+	assert(dst != NULL);
+	return memcpy(dst, src, size);
+}
+
+static void bp_save(branch_predictor_t *saved) {
+	free(saved->bimodal);
+	free(saved->gshare);
+	free(saved->chooser);
+	free(saved->btb_tags);
+	free(saved->btb_targets);
+	free(saved->ras);
+	*saved = BP;
+	saved->bimodal = bp_copy(BP.bimodal, 1 << BP.table_bits);
+	saved->gshare = bp_copy(BP.gshare, 1 << BP.table_bits);
+	saved->chooser = bp_copy(BP.chooser, 1 << BP.table_bits);
+	saved->btb_tags = bp_copy(BP.btb_tags, BP.btb_entries * sizeof(uint32_t));
+	saved->btb_targets = bp_copy(BP.btb_targets, BP.btb_entries * sizeof(uint32_t));
+	saved->ras = bp_copy(BP.ras, BP.ras_entries * sizeof(uint32_t));
+}
+
+static void bp_restore(const branch_predictor_t *saved) {
+	branch_predictor_t tables = BP;
+
+	if (saved->kind != BP.kind || saved->table_bits != BP.table_bits ||
+		saved->btb_entries != BP.btb_entries || saved->ras_entries != BP.ras_entries) {
+		bp_reset();
+		return;
+	}
+	BP = *saved;
+	BP.bimodal = tables.bimodal;
+	BP.gshare = tables.gshare;
+	BP.chooser = tables.chooser;
+	BP.btb_tags = tables.btb_tags;
+	BP.btb_targets = tables.btb_targets;
+	BP.ras = tables.ras;
+	if (BP.kind != BP_NOT_TAKEN) {
+		memcpy(BP.bimodal, saved->bimodal, 1 << BP.table_bits);
+		memcpy(BP.gshare, saved->gshare, 1 << BP.table_bits);
+		memcpy(BP.chooser, saved->chooser, 1 << BP.table_bits);
+	}
+	if (BP.btb_entries != 0) {
+		memcpy(BP.btb_tags, saved->btb_tags, BP.btb_entries * sizeof(uint32_t));
+		memcpy(BP.btb_targets, saved->btb_targets, BP.btb_entries * sizeof(uint32_t));
+	}
+	if (BP.ras_entries != 0) {
+		memcpy(BP.ras, saved->ras, BP.ras_entries * sizeof(uint32_t));
+	}
+}
+
+static inline bool bp_conditional(const decoded_inst_t *d) {
+	return d->op != OP_J && d->op != OP_JAL && d->op != OP_JR && d->op != OP_JALR;
+}
+
+static inline bool bp_is_return(const decoded_inst_t *d) {
+	return d->op == OP_JR && d->rs == 31;
+}
+
+static inline void bp_train(uint8_t *counter, bool taken) {
+	if (taken && *counter < 3) {
+		(*counter)++;
+	}
+	else if (!taken && *counter > 0) {
+		(*counter)--;
+	}
+}
+
+static inline bool bp_direction(uint32_t pc, uint32_t history) {
+	uint32_t mask = (1u << BP.table_bits) - 1;
+	uint32_t local = (pc >> 2) & mask, global = ((pc >> 2) ^ history) & mask;
+
+	switch (BP.kind) {
+		case BP_BIMODAL:
+			return BP.bimodal[local] >= 2;
+		case BP_GSHARE:
+			return BP.gshare[global] >= 2;
+		case BP_TOURNAMENT:
+			return BP.chooser[local] >= 2 ? BP.gshare[global] >= 2 : BP.bimodal[local] >= 2;
+		default:
+			return false;
+	}
+}
+
+/***************************************************************/
+/* The PC a control transfer at pc is relative to: itself, or with     */
+/* ENABLE_DELAY_SLOT the delay slot behind it, as on real MIPS. That    */
+/* also puts JAL/JALR return addresses past the slot, at pc + 8.       */
+/***************************************************************/
+static inline uint32_t delay_slot_base(uint32_t pc) {
+	return ENABLE_DELAY_SLOT ? pc + 4 : pc;
+}
+
+/***************************************************************/
+/* Predict the PC to fetch after the instruction at pc. Jumps are      */
+/* always taken, conditional branches ask the direction predictor, and */
+/* a taken prediction needs a target from the BTB, or from the RAS    */
+/* for JR $31. JAL/JALR push their return address.                             */
+/***************************************************************/
+static inline uint32_t bp_predict(const decoded_inst_t *d, uint32_t pc, bp_prediction_t *pred) {
+	uint32_t slot;
+
+	pred->next_pc = pc + 4;
+	pred->resolved = false;
+	if (!(d->flags & INST_BRANCH)) {
+		return pred->next_pc;
+	}
+	pred->next_pc = delay_slot_base(pc) + 4;
+	pred->history = BP.history;
+	if (bp_is_return(d) && BP.ras_entries != 0) {
+		if (BP.ras[BP.ras_top] != 0) {
+			pred->next_pc = BP.ras[BP.ras_top];
+		}
+		BP.ras_top = (BP.ras_top + BP.ras_entries - 1) % BP.ras_entries;
+	}
+	else if (BP.btb_entries != 0 && (!bp_conditional(d) || bp_direction(pc, BP.history))) {
+		slot = (pc >> 2) & (BP.btb_entries - 1);
+		BP.btb_lookups++;
+		if (BP.btb_tags[slot] == pc) {
+			BP.btb_hits++;
+			pred->next_pc = BP.btb_targets[slot];
+		}
+	}
+	if ((d->op == OP_JAL || d->op == OP_JALR) && BP.ras_entries != 0) {
+		BP.ras_top = (BP.ras_top + 1) % BP.ras_entries;
+		BP.ras[BP.ras_top] = delay_slot_base(pc) + 4;
+	}
+	pred->ras_top = BP.ras_top;
+	return pred->next_pc;
+}
+
+/***************************************************************/
+/* Train on a branch resolved in EX. Returns true on a mispredict,      */
+/* after rewinding the RAS past the squashed wrong-path instructions. */
+/***************************************************************/
+static inline bool bp_resolve(const decoded_inst_t *d, uint32_t pc, bool taken, uint32_t next_pc,
+	const bp_prediction_t *pred) {
+	uint32_t mask = (1u << BP.table_bits) - 1;
+	uint32_t local = (pc >> 2) & mask, global = ((pc >> 2) ^ pred->history) & mask;
+	uint32_t slot;
+
+	if (bp_conditional(d)) {
+		BP.conditional++;
+		BP.conditional_correct += bp_direction(pc, pred->history) == taken;
+		if (BP.kind == BP_TOURNAMENT && (BP.bimodal[local] >= 2) != (BP.gshare[global] >= 2)) {
+			bp_train(&BP.chooser[local], (BP.gshare[global] >= 2) == taken);
+		}
+		if (BP.kind == BP_BIMODAL || BP.kind == BP_TOURNAMENT) {
+			bp_train(&BP.bimodal[local], taken);
+		}
+		if (BP.kind == BP_GSHARE || BP.kind == BP_TOURNAMENT) {
+			bp_train(&BP.gshare[global], taken);
+		}
+		BP.history = ((BP.history << 1) | taken) & mask;
+	}
+	else if (bp_is_return(d) && BP.ras_entries != 0) {
+		BP.returns++;
+		BP.returns_correct += pred->next_pc == next_pc;
+	}
+	if (taken && BP.btb_entries != 0) {
+		slot = (pc >> 2) & (BP.btb_entries - 1);
+		BP.btb_tags[slot] = pc;
+		BP.btb_targets[slot] = next_pc;
+	}
+	if (pred->next_pc == next_pc) {
+		return false;
+	}
+	if (BP.ras_entries != 0) {
+		BP.ras_top = pred->ras_top;
+	}
+	return true;
+}
+
+void bp_dump(const branch_predictor_t *bp, const sim_counters_t *c) {
+	printf("Branch predictor\t: %s", BP_KIND_NAMES[bp->kind]);
+	if (bp->kind != BP_NOT_TAKEN) {
+		printf(", %u-bit tables", bp->table_bits);
+	}
+	printf(", %u BTB entries, %u RAS entries\n", bp->btb_entries, bp->ras_entries);
+	printf("  accuracy\t\t: %.2f%% (%llu mispredicted)\n",
+		c->branches ? 100.0 * (c->branches - c->branch_flushes) / c->branches : 0.0,
+		(unsigned long long)c->branch_flushes);
+	printf("  conditional\t\t: %llu (%llu directions right)\n",
+		(unsigned long long)bp->conditional, (unsigned long long)bp->conditional_correct);
+	printf("  BTB\t\t\t: %llu lookups, %llu hits\n", (unsigned long long)bp->btb_lookups, (unsigned long long)bp->btb_hits);
+	printf("  returns\t\t: %llu (%llu predicted by the RAS)\n",
+		(unsigned long long)bp->returns, (unsigned long long)bp->returns_correct);
+}
+
+/***************************************************************/
+/* Configure the multiply/divide unit from                                      */
+/* "<mult cycles>[:<div cycles>]", a lone number sets both                */
+/***************************************************************/
+bool mdu_configure(const char *spec) {
+	char *end;
+	unsigned long mult = strtoul(spec, &end, 0), div = mult;
+
+	if (*end == ':') {
+		div = strtoul(end + 1, &end, 0);
+	}
+	if (*end != '\0' || mult < 1 || div < 1 || mult > 1024 || div > 1024) {
+		printf("Error: bad multiply/divide unit '%s', want <mult cycles>[:<div cycles>], each 1-1024\n", spec);
+		return false;
+	}
+	MDU.mult_latency = mult;
+	MDU.div_latency = div;
+	mdu_reset();
+	return true;
+}
+
+/***************************************************************/
+/* Idle the unit and clear the statistics, an unconfigured unit is      */
+/* single-cycle                                                                                   */
+/***************************************************************/
+void mdu_reset() {
+	if (MDU.mult_latency == 0) {
+		MDU.mult_latency = 1;
+	}
+	if (MDU.div_latency == 0) {
+		MDU.div_latency = 1;
+	}
+	MDU.ready = 0;
+	MDU.mults = MDU.divs = MDU.busy_cycles = 0;
+}
+
+/***************************************************************/
+/* Start the multiply or divide EX issued this cycle                          */
+/***************************************************************/
+static inline void mdu_issue(const decoded_inst_t *d) {
+	uint32_t latency;
+
+	if (d->op == OP_DIV || d->op == OP_DIVU) {
+		latency = MDU.div_latency;
+		MDU.divs++;
+	}
+	else {
+		latency = MDU.mult_latency;
+		MDU.mults++;
+	}
+	MDU.ready = COUNTERS.cycles + latency;
+	MDU.busy_cycles += latency;
+}
+
+/***************************************************************/
+/* True while HI/LO would still be busy when the instruction in ID      */
+/* reaches EX next cycle                                                                      */
+/***************************************************************/
+static inline bool mdu_busy(const decoded_inst_t *d) {
+	return (d->flags & INST_HILO) && COUNTERS.cycles + 1 < MDU.ready;
+}
+
+void mdu_dump(const mdu_t *mdu) {
+	printf("Multiply/divide unit\t: %u-cycle multiply, %u-cycle divide\n", mdu->mult_latency, mdu->div_latency);
+	printf("  operations\t\t: %llu multiplies, %llu divides, %llu busy cycles\n",
+		(unsigned long long)mdu->mults, (unsigned long long)mdu->divs, (unsigned long long)mdu->busy_cycles);
+}
+
+/***************************************************************/
+/* The out-of-order engine takes over from both in-order pipelines,    */
+/* see ooo_cycle(); neither models delay slots                                     */
+/***************************************************************/
+static inline bool ooo_active() {
+	return OOO.rob_entries != 0 && !ENABLE_DELAY_SLOT;
+}
+
+/***************************************************************/
+/* Wide issue takes over from the scalar pipeline, see ss_pipeline()   */
+/***************************************************************/
+static inline bool superscalar_active() {
+	return SS.width > 1 && !ENABLE_DELAY_SLOT && !ooo_active();
+}
+
+/***************************************************************/
+/* Execute one cycle                                                                                                              */
+/***************************************************************/
+void cycle() {                                                
+	if (ooo_active()) {
+		ooo_cycle();
+	}
+	else if (superscalar_active()) {
+		ss_pipeline();
+	}
+	else {
+		handle_pipeline();
+	}
+	if (PIPETRACE.out != NULL) {
+		pipetrace_cycle();
+	}
+	CURRENT_STATE = NEXT_STATE;
+	CYCLE_COUNT++;
+	COUNTERS.cycles++;
+}
+
+/***************************************************************/
+/* Simulate MIPS for n cycles                                                                                       */
+/***************************************************************/
+void run(int num_cycles) {                                      
+	
+	if (RUN_FLAG == FALSE) {
+		CURRENT_STATE = NEXT_STATE;
+		TRACE(TRACE_INFO, "Simulation Stopped\n\n");
+		return;
+	}
+
+	TRACE(TRACE_INFO, "Running simulator for %d cycles...\n\n", num_cycles);
+	int i;
+	for (i = 0; i < num_cycles; i++) {
+		if (RUN_FLAG == FALSE) {
+			TRACE(TRACE_INFO, "Simulation Stopped.\n\n");
+			break;
+		}
+		cycle();
+	}
+}
+
+/***************************************************************/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll() {                                                     
+	if (RUN_FLAG == FALSE) {
+		cycle();
+		TRACE(TRACE_INFO, "Simulation Stopped.\n\n");
+		return;
+	}
+
+	TRACE(TRACE_INFO, "Simulation Started...\n\n");
+	while (RUN_FLAG){
+		cycle();
+	}
+	TRACE(TRACE_INFO, "Simulation Finished.\n\n");
+}
+
+/***************************************************************/ 
+/* Dump a word-aligned region of memory to the terminal                              */
+/***************************************************************/
+void mdump(uint32_t start, uint32_t stop) {          
+	uint32_t address;
+
+	printf("-------------------------------------------------------------\n");
+	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
+	printf("-------------------------------------------------------------\n");
+	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
+	for (address = start; address <= stop; address += 4){
+		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, store_buffer_read_32(address));
+	}
+	printf("\n");
+}
+
+/***************************************************************/
+/* Dump current values of registers to the teminal                                              */   
+/***************************************************************/
+void rdump() {                               
+	int i; 
+	printf("-------------------------------------\n");
+	printf("Dumping Register Content\n");
+	printf("-------------------------------------\n");
+	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
+	printf("# Cycles Executed\t: %u\n", CYCLE_COUNT);
+	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
+	printf("-------------------------------------\n");
+	printf("[Register]\t[Value]\n");
+	printf("-------------------------------------\n");
+	for (i = 0; i < MIPS_REGS; i++){
+		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+	}
+	printf("-------------------------------------\n");
+	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
+	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Print the pipeline performance counters                                                     */
+/***************************************************************/
+static const char *STALL_CAUSE_NAMES[NUM_STALL_CAUSES] = {
+	"raw_ex_mem", "raw_mem_wb", "load_use", "branch", "mdu"
+};
+
+static double counters_cpi(const sim_counters_t *c) {
+	return c->instructions ? (double)c->cycles / c->instructions : 0.0;
+}
+
+void stats_dump() {
+	uint64_t stalls = 0;
+	int i;
+
+	for (i = 0; i < NUM_STALL_CAUSES; i++) {
+		stalls += COUNTERS.stall_cycles[i];
+	}
+	printf("-------------------------------------\n");
+	printf("Pipeline Counters (forwarding %s, branches resolve in %s%s)\n", ENABLE_FORWARDING ? "on" : "off",
+		ENABLE_EARLY_BRANCH ? "ID" : "EX", ENABLE_DELAY_SLOT ? ", delay slots" : "");
+	printf("-------------------------------------\n");
+	printf("# Cycles\t\t: %llu\n", (unsigned long long)COUNTERS.cycles);
+	printf("# Instructions\t\t: %llu\n", (unsigned long long)COUNTERS.instructions);
+	printf("CPI\t\t\t: %.3f\n", counters_cpi(&COUNTERS));
+	printf("Stall cycles\t\t: %llu\n", (unsigned long long)stalls);
+	for (i = 0; i < NUM_STALL_CAUSES; i++) {
+		printf("  %-12s\t\t: %llu\n", STALL_CAUSE_NAMES[i], (unsigned long long)COUNTERS.stall_cycles[i]);
+	}
+	printf("Forwards EX/MEM\t\t: A %llu, B %llu\n",
+		(unsigned long long)COUNTERS.forward_a_ex_mem, (unsigned long long)COUNTERS.forward_b_ex_mem);
+	printf("Forwards MEM/WB\t\t: A %llu, B %llu\n",
+		(unsigned long long)COUNTERS.forward_a_mem_wb, (unsigned long long)COUNTERS.forward_b_mem_wb);
+	printf("Branches/jumps\t\t: %llu (%llu mispredicted, flushed)\n",
+		(unsigned long long)COUNTERS.branches, (unsigned long long)COUNTERS.branch_flushes);
+	printf("Loads\t\t\t: %llu\n", (unsigned long long)COUNTERS.loads);
+	printf("Stores\t\t\t: %llu\n", (unsigned long long)COUNTERS.stores);
+	printf("Syscalls\t\t: %llu\n", (unsigned long long)COUNTERS.syscalls);
+	bp_dump(&BP, &COUNTERS);
+	mdu_dump(&MDU);
+	if (PIPE.depth[STAGE_IF] > 1 || PIPE.depth[STAGE_EX] > 1 || PIPE.depth[STAGE_MEM] > 1) {
+		pipe_dump();
+	}
+	if (superscalar_active()) {
+		ss_dump(&SS, &COUNTERS);
+	}
+	if (ooo_active()) {
+		ooo_dump(&OOO, &COUNTERS);
+	}
+	if (L1I.enabled || L1D.enabled) {
+		cache_dump("L1I", &L1I);
+		cache_dump("L1D", &L1D);
+	}
+	if (MEMSYS.enabled) {
+		memsys_dump(&L2, &DRAM, &MEMSYS);
+	}
+	if (PREFETCH.kind != PF_NONE) {
+		prefetch_dump(&PREFETCH);
+	}
+	if (STORE_BUFFER.depth != 0) {
+		store_buffer_dump(&STORE_BUFFER, &COUNTERS);
+	}
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Write one set of counters as a JSON object, indent is the          */
+/* prefix of the object's own lines                                                          */
+/***************************************************************/
+static void cache_write_json(FILE *out, const char *name, const cache_t *c, const char *indent) {
+	if (!c->enabled) {
+		return;
+	}
+	fprintf(out, ",\n%s\"%s\": {\"size\": %u, \"assoc\": %u, \"line_size\": %u, \"replacement\": \"%s\", "
+		"\"write_back\": %s, \"%s\": %u,\n%s  \"reads\": %llu, \"read_misses\": %llu, "
+		"\"writes\": %llu, \"write_misses\": %llu, \"writebacks\": %llu, \"stall_cycles\": %llu}",
+		indent, name, c->size, c->assoc, c->line_size, CACHE_POLICY_NAMES[c->policy],
+		c->write_back ? "true" : "false", c->hit_latency ? "hit_latency" : "miss_latency",
+		c->hit_latency ? c->hit_latency : c->miss_latency, indent,
+		(unsigned long long)c->reads, (unsigned long long)c->read_misses, (unsigned long long)c->writes,
+		(unsigned long long)c->write_misses, (unsigned long long)c->writebacks, (unsigned long long)c->stall_cycles);
+}
+
+static void memsys_write_json(FILE *out, const cache_t *l2, const dram_t *dram, const memsys_t *memsys,
+	const char *indent) {
+	if (!memsys->enabled) {
+		return;
+	}
+	cache_write_json(out, "l2", l2, indent);
+	fprintf(out, ",\n%s\"mshrs\": {\"entries\": %u, \"fills\": %llu, \"merged\": %llu, \"fill_cycles\": %llu, "
+		"\"posted_writes\": %llu, \"all_busy\": %llu, \"wait_cycles\": %llu}", indent, memsys->mshrs,
+		(unsigned long long)memsys->fills, (unsigned long long)memsys->merged,
+		(unsigned long long)memsys->fill_cycles, (unsigned long long)memsys->writes,
+		(unsigned long long)memsys->mshr_full, (unsigned long long)memsys->mshr_wait_cycles);
+	fprintf(out, ",\n%s\"dram\": {\"banks\": %u, \"row_size\": %u, \"t_cas\": %u, \"t_rcd\": %u, \"t_rp\": %u,\n"
+		"%s  \"reads\": %llu, \"writes\": %llu, \"row_hits\": %llu, \"row_empty\": %llu, \"row_conflicts\": %llu, "
+		"\"bank_conflicts\": %llu, \"bank_wait_cycles\": %llu}", indent, dram->banks, dram->row_size, dram->t_cas,
+		dram->t_rcd, dram->t_rp, indent, (unsigned long long)dram->reads, (unsigned long long)dram->writes,
+		(unsigned long long)dram->row_hits, (unsigned long long)dram->row_empty,
+		(unsigned long long)dram->row_conflicts, (unsigned long long)dram->bank_conflicts,
+		(unsigned long long)dram->bank_wait_cycles);
+}
+
+static void prefetch_write_json(FILE *out, const prefetcher_t *pf, const char *indent) {
+	if (pf->kind == PF_NONE) {
+		return;
+	}
+	fprintf(out, ",\n%s\"prefetch\": {\"kind\": \"%s\", \"degree\": %u, \"entries\": %u,\n%s  \"issued\": %llu, "
+		"\"redundant\": %llu, \"useful\": %llu, \"late\": %llu, \"late_cycles\": %llu, \"useless\": %llu, "
+		"\"uncovered_misses\": %llu}", indent, PREFETCH_KIND_NAMES[pf->kind], pf->degree, pf->entries, indent,
+		(unsigned long long)pf->issued, (unsigned long long)pf->redundant, (unsigned long long)pf->useful,
+		(unsigned long long)pf->late, (unsigned long long)pf->late_cycles, (unsigned long long)pf->useless,
+		(unsigned long long)pf->misses);
+}
+
+static void store_buffer_write_json(FILE *out, const store_buffer_t *sb, const char *indent) {
+	if (sb->depth == 0) {
+		return;
+	}
+	fprintf(out, ",\n%s\"store_buffer\": {\"depth\": %u, \"stores\": %llu, \"combined\": %llu, \"drains\": %llu, "
+		"\"forwards\": %llu,\n%s  \"full_cycles\": %llu, \"partial_cycles\": %llu, \"occupancy\": %llu}", indent,
+		sb->depth, (unsigned long long)sb->stores, (unsigned long long)sb->combined, (unsigned long long)sb->drains,
+		(unsigned long long)sb->forwards, indent, (unsigned long long)sb->full_cycles,
+		(unsigned long long)sb->partial_cycles, (unsigned long long)sb->occupancy);
+}
+
+static void bp_write_json(FILE *out, const branch_predictor_t *bp, const char *indent) {
+	fprintf(out, ",\n%s\"branch_predictor\": {\"kind\": \"%s\", \"table_bits\": %u, \"btb_entries\": %u, "
+		"\"ras_entries\": %u,\n%s  \"conditional\": %llu, \"conditional_correct\": %llu, \"btb_lookups\": %llu, "
+		"\"btb_hits\": %llu, \"returns\": %llu, \"returns_correct\": %llu}",
+		indent, BP_KIND_NAMES[bp->kind], bp->table_bits, bp->btb_entries, bp->ras_entries, indent,
+		(unsigned long long)bp->conditional, (unsigned long long)bp->conditional_correct,
+		(unsigned long long)bp->btb_lookups, (unsigned long long)bp->btb_hits,
+		(unsigned long long)bp->returns, (unsigned long long)bp->returns_correct);
+}
+
+static void mdu_write_json(FILE *out, const mdu_t *mdu, const char *indent) {
+	fprintf(out, ",\n%s\"mdu\": {\"mult_latency\": %u, \"div_latency\": %u, \"mults\": %llu, \"divs\": %llu, "
+		"\"busy_cycles\": %llu}", indent, mdu->mult_latency, mdu->div_latency, (unsigned long long)mdu->mults,
+		(unsigned long long)mdu->divs, (unsigned long long)mdu->busy_cycles);
+}
+
+static void ss_write_json(FILE *out, const superscalar_t *ss, const char *indent) {
+	uint32_t n;
+
+	fprintf(out, ",\n%s\"issue\": {\"width\": %u, \"cycles_issuing\": [", indent, ss->width);
+	for (n = 0; n <= ss->width; n++) {
+		fprintf(out, "%s%llu", n ? ", " : "", (unsigned long long)ss->issued[n]);
+	}
+	fprintf(out, "], \"dependency_splits\": %llu, \"structural_splits\": %llu}",
+		(unsigned long long)ss->dependency_splits, (unsigned long long)ss->structural_splits);
+}
+
+static void ooo_write_json(FILE *out, const ooo_t *ooo, const char *indent) {
+	uint32_t n;
+
+	if (ooo->rob_entries == 0) {
+		return;
+	}
+	fprintf(out, ",\n%s\"ooo\": {\"rob_entries\": %u, \"rs_entries\": %u, \"lsq_entries\": %u, \"width\": %u, "
+		"\"cycles_issuing\": [", indent, ooo->rob_entries, ooo->rs_entries, ooo->lsq_entries, ooo->width);
+	for (n = 0; n <= ooo->width; n++) {
+		fprintf(out, "%s%llu", n ? ", " : "", (unsigned long long)ooo->issued[n]);
+	}
+	fprintf(out, "],\n%s  \"rob_full\": %llu, \"rs_full\": %llu, \"lsq_full\": %llu, \"occupancy\": %llu, "
+		"\"squashed\": %llu, \"load_forwards\": %llu}", indent, (unsigned long long)ooo->rob_full,
+		(unsigned long long)ooo->rs_full, (unsigned long long)ooo->lsq_full, (unsigned long long)ooo->occupancy,
+		(unsigned long long)ooo->squashed, (unsigned long long)ooo->load_forwards);
+}
+
+static void counters_write_json(FILE *out, const sim_counters_t *c, const cache_t *l1i, const cache_t *l1d,
+	const cache_t *l2, const dram_t *dram, const memsys_t *memsys, const prefetcher_t *pf, const store_buffer_t *sb, const branch_predictor_t *bp, const mdu_t *mdu, const superscalar_t *ss, const ooo_t *ooo, const char *indent) {
+	int i;
+
+	fprintf(out, "%s\"cycles\": %llu,\n", indent, (unsigned long long)c->cycles);
+	fprintf(out, "%s\"instructions\": %llu,\n", indent, (unsigned long long)c->instructions);
+	fprintf(out, "%s\"cpi\": %.6f,\n", indent, counters_cpi(c));
+	fprintf(out, "%s\"stall_cycles\": {", indent);
+	for (i = 0; i < NUM_STALL_CAUSES; i++) {
+		fprintf(out, "%s\"%s\": %llu", i ? ", " : "", STALL_CAUSE_NAMES[i], (unsigned long long)c->stall_cycles[i]);
+	}
+	fprintf(out, "},\n");
+	fprintf(out, "%s\"forwards\": {\"a_ex_mem\": %llu, \"a_mem_wb\": %llu, \"b_ex_mem\": %llu, \"b_mem_wb\": %llu},\n",
+		indent, (unsigned long long)c->forward_a_ex_mem, (unsigned long long)c->forward_a_mem_wb,
+		(unsigned long long)c->forward_b_ex_mem, (unsigned long long)c->forward_b_mem_wb);
+	fprintf(out, "%s\"branches\": %llu,\n", indent, (unsigned long long)c->branches);
+	fprintf(out, "%s\"branch_flushes\": %llu,\n", indent, (unsigned long long)c->branch_flushes);
+	fprintf(out, "%s\"loads\": %llu,\n", indent, (unsigned long long)c->loads);
+	fprintf(out, "%s\"stores\": %llu,\n", indent, (unsigned long long)c->stores);
+	fprintf(out, "%s\"syscalls\": %llu", indent, (unsigned long long)c->syscalls);
+	bp_write_json(out, bp, indent);
+	mdu_write_json(out, mdu, indent);
+	ss_write_json(out, ss, indent);
+	ooo_write_json(out, ooo, indent);
+	cache_write_json(out, "l1i", l1i, indent);
+	cache_write_json(out, "l1d", l1d, indent);
+	memsys_write_json(out, l2, dram, memsys, indent);
+	prefetch_write_json(out, pf, indent);
+	store_buffer_write_json(out, sb, indent);
+	fprintf(out, "\n");
+}
+
+/***************************************************************/
+/* Dump the counters of this run as JSON, "-" writes to stdout          */
+/***************************************************************/
+bool stats_write_json(const char *path) {
+	FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+
+	if (out == NULL) {
+		printf("Error: cannot write stats to %s\n", path);
+		return false;
+	}
+	fprintf(out, "{\n");
+	fprintf(out, "  \"program\": \"%s\",\n", prog_file);
+	fprintf(out, "  \"forwarding\": %d,\n", ENABLE_FORWARDING != 0);
+	fprintf(out, "  \"early_branch\": %d,\n", ENABLE_EARLY_BRANCH != 0);
+	fprintf(out, "  \"delay_slot\": %d,\n", ENABLE_DELAY_SLOT != 0);
+	counters_write_json(out, &COUNTERS, &L1I, &L1D, &L2, &DRAM, &MEMSYS, &PREFETCH, &STORE_BUFFER, &BP, &MDU, &SS, &OOO, "  ");
+	fprintf(out, "}\n");
+	if (out != stdout) {
+		fclose(out);
+	}
+	return true;
+}
+
+/***************************************************************/
+/* Pipeline trace writer, see pipetrace_t                                           */
+/***************************************************************/
+static void pipetrace_flush() {
+	if (PIPETRACE.used != 0) {
+		fwrite(PIPETRACE.buf, 1, PIPETRACE.used, PIPETRACE.out);
+		PIPETRACE.bytes += PIPETRACE.used;
+		PIPETRACE.used = 0;
+	}
+}
+
+static inline void pipetrace_byte(uint8_t v) {
+	if (PIPETRACE.used == PT_BUFFER_SIZE) {
+		pipetrace_flush();
+	}
+	PIPETRACE.buf[PIPETRACE.used++] = v;
+}
+
+static inline void pipetrace_varint(uint64_t v) {
+	while (v >= 0x80) {
+		pipetrace_byte(v | 0x80);
+		v >>= 7;
+	}
+	pipetrace_byte(v);
+}
+
+static void pipetrace_idle() {
+	if (PIPETRACE.idle != 0) {
+		pipetrace_byte(PT_IDLE);
+		pipetrace_varint(PIPETRACE.idle);
+		PIPETRACE.idle = 0;
+	}
+}
+
+/***************************************************************/
+/* Start tracing into path from this cycle on, replacing any trace    */
+/* already being written                                                                          */
+/***************************************************************/
+bool pipetrace_open(const char *path) {
+	uint8_t header[PT_HEADER_SIZE];
+	int i;
+
+	pipetrace_close();
+	PIPETRACE.out = fopen(path, "wb");
+	if (PIPETRACE.out == NULL) {
+		printf("Error: cannot write pipeline trace %s\n", path);
+		return false;
+	}
+	PIPETRACE.buf = malloc(PT_BUFFER_SIZE);
+	assert(PIPETRACE.buf != NULL);
+	PIPETRACE.used = 0;
+	for (i = 0; i < 4; i++) {
+		PIPETRACE.pc[i] = PIPETRACE.ir[i] = 0;
+	}
+	PIPETRACE.last_pc = 0;
+	for (i = 0; i < PT_IR_SLOTS; i++) {
+		PIPETRACE.slot_pc[i] = PT_NO_PC;
+	}
+	PIPETRACE.last = COUNTERS;
+	PIPETRACE.idle = 0;
+	PIPETRACE.cycles = 0;
+	PIPETRACE.bytes = PT_HEADER_SIZE;
+
+	memcpy(header, PT_MAGIC, 4);
+	store_le32(header + 4, PT_VERSION);
+	store_le32(header + 8, CYCLE_COUNT);
+	fwrite(header, 1, sizeof(header), PIPETRACE.out);
+	return true;
+}
+
+void pipetrace_close() {
+	if (PIPETRACE.out == NULL) {
+		return;
+	}
+	pipetrace_idle();
+	pipetrace_flush();
+	fclose(PIPETRACE.out);
+	free(PIPETRACE.buf);
+	PIPETRACE.out = NULL;
+	PIPETRACE.buf = NULL;
+	TRACE(TRACE_INFO, "Pipeline trace: %llu cycles in %llu bytes\n",
+		(unsigned long long)PIPETRACE.cycles, (unsigned long long)PIPETRACE.bytes);
+}
+
+/***************************************************************/
+/* Record the cycle that just ended, called by cycle() while tracing */
+/***************************************************************/
+void pipetrace_cycle() {
+	const CPU_Pipeline_Reg *latch[4] = { &IF_ID, &ID_EX, &EX_MEM, &MEM_WB };
+	const sim_counters_t *last = &PIPETRACE.last;
+	uint32_t pc, ir, slot, delta;
+	uint8_t codes = 0, events = 0;
+	bool with_ir;
+	int i;
+
+	PIPETRACE.cycles++;
+	if (superscalar_active() || ooo_active()) {
+		PIPETRACE.idle++;
+		PIPETRACE.last = COUNTERS;
+		return;
+	}
+
+	for (i = 0; i < 4; i++) {
+		pc = latch[i]->PC;
+		ir = latch[i]->IR;
+		if (ir == 0) {
+			codes |= (PIPETRACE.ir[i] == 0 ? PT_SAME : PT_BUBBLE) << (2 * i);
+		}
+		else if (i > 0 && pc == PIPETRACE.pc[i - 1] && ir == PIPETRACE.ir[i - 1]) {
+			codes |= PT_ADVANCE << (2 * i);
+		}
+		else if (pc == PIPETRACE.pc[i] && ir == PIPETRACE.ir[i]) {
+			codes |= PT_SAME << (2 * i);
+		}
+		else {
+			codes |= PT_NEW << (2 * i);
+		}
+	}
+
+	for (i = 0; i < NUM_STALL_CAUSES; i++) {
+		if (COUNTERS.stall_cycles[i] != last->stall_cycles[i]) {
+			events = i + 1;
+			break;
+		}
+	}
+	if (COUNTERS.branch_flushes != last->branch_flushes) {
+		events |= PT_FLUSH;
+	}
+	events |= (COUNTERS.forward_a_ex_mem != last->forward_a_ex_mem ? 1 : COUNTERS.forward_a_mem_wb != last->forward_a_mem_wb ? 2 : 0) << 4;
+	events |= (COUNTERS.forward_b_ex_mem != last->forward_b_ex_mem ? 1 : COUNTERS.forward_b_mem_wb != last->forward_b_mem_wb ? 2 : 0) << 6;
+	PIPETRACE.last = COUNTERS;
+
+	if (codes == 0 && events == 0) {
+		PIPETRACE.idle++;
+		return;
+	}
+	pipetrace_idle();
+	pipetrace_byte(codes);
+	pipetrace_byte(events);
+	for (i = 0; i < 4; i++) {
+		pc = latch[i]->PC;
+		ir = latch[i]->IR;
+		if (((codes >> (2 * i)) & 3) == PT_NEW) {
+			slot = (pc >> 2) & (PT_IR_SLOTS - 1);
+			with_ir = PIPETRACE.slot_pc[slot] != pc || PIPETRACE.slot_ir[slot] != ir;
+			delta = pc - PIPETRACE.last_pc;
+			pipetrace_varint(((uint64_t)((delta << 1) ^ (uint32_t)((int32_t)delta >> 31)) << 1) | with_ir);
+			if (with_ir) {
+				pipetrace_byte(ir);
+				pipetrace_byte(ir >> 8);
+				pipetrace_byte(ir >> 16);
+				pipetrace_byte(ir >> 24);
+				PIPETRACE.slot_pc[slot] = pc;
+				PIPETRACE.slot_ir[slot] = ir;
+			}
+			PIPETRACE.last_pc = pc;
+		}
+		PIPETRACE.pc[i] = pc;
+		PIPETRACE.ir[i] = ir;
+	}
+}
+
+/***************************************************************/
+/* Trace converter: replays a pipeline trace and writes it as a Kanata */
+/* log for Konata, or as Chrome trace JSON (chrome://tracing, Perfetto) */
+/* when the output ends in .json. An instruction is in IF the cycle it  */
+/* lands in IF_ID and in the next stage for every cycle it spends in a */
+/* latch; it retires the cycle after it leaves MEM_WB and is flushed    */
+/* when it disappears from any other latch.                                         */
+/***************************************************************/
+static const char *PT_STAGE_NAMES[5] = { "IF", "ID", "EX", "MEM", "WB" };
+
+typedef struct {
+	uint64_t id;		/* 0 for a bubble */
+	uint32_t pc, ir;
+	int stage;		/* index into PT_STAGE_NAMES, -1 before IF */
+	uint64_t since;		/* cycle the stage began */
+} pt_inst_t;
+
+typedef struct {
+	FILE *out;
+	bool chrome;
+	uint64_t cycle;		/* Kanata: cycle of the last C line */
+	uint64_t retired;
+	bool first;		/* Chrome: no event written yet */
+} pt_writer_t;
+
+static void pt_goto(pt_writer_t *w, uint64_t cycle) {
+	if (!w->chrome && cycle > w->cycle) {
+		fprintf(w->out, "C\t%llu\n", (unsigned long long)(cycle - w->cycle));
+		w->cycle = cycle;
+	}
+}
+
+static void pt_label(const pt_inst_t *in, char *text, size_t size) {
+	decoded_inst_t d;
+
+	decode_instruction(in->ir, &d);
+	snprintf(text, size, "0x%08x: %s 0x%08x", in->pc, MIPS_OP_NAMES[d.op], in->ir);
+}
+
+// close the instruction's current stage at cycle
+static void pt_end_stage(pt_writer_t *w, const pt_inst_t *in, uint64_t cycle, const char *suffix) {
+	char text[64];
+
+	if (in->stage < 0) {
+		return;
+	}
+	if (w->chrome) {
+		pt_label(in, text, sizeof(text));
+		fprintf(w->out, "%s{\"name\": \"%s%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %llu, \"dur\": %llu, \"pid\": 1, \"tid\": %d}",
+			w->first ? "\n" : ",\n", text, suffix, PT_STAGE_NAMES[in->stage], (unsigned long long)in->since,
+			(unsigned long long)(cycle - in->since), in->stage);
+		w->first = false;
+	}
+	else {
+		fprintf(w->out, "E\t%llu\t0\t%s\n", (unsigned long long)in->id, PT_STAGE_NAMES[in->stage]);
+	}
+}
+
+static void pt_stage(pt_writer_t *w, pt_inst_t *in, int stage, uint64_t cycle) {
+	char text[64];
+
+	pt_goto(w, cycle);
+	if (in->stage < 0 && !w->chrome) {
+		pt_label(in, text, sizeof(text));
+		fprintf(w->out, "I\t%llu\t%llu\t0\n", (unsigned long long)in->id, (unsigned long long)in->id);
+		fprintf(w->out, "L\t%llu\t0\t%s\n", (unsigned long long)in->id, text);
+	}
+	pt_end_stage(w, in, cycle, "");
+	if (!w->chrome) {
+		fprintf(w->out, "S\t%llu\t0\t%s\n", (unsigned long long)in->id, PT_STAGE_NAMES[stage]);
+	}
+	in->stage = stage;
+	in->since = cycle;
+}
+
+static void pt_finish(pt_writer_t *w, const pt_inst_t *in, uint64_t cycle, bool flushed) {
+	pt_goto(w, cycle);
+	pt_end_stage(w, in, cycle, flushed ? " (flushed)" : "");
+	if (!w->chrome) {
+		fprintf(w->out, "R\t%llu\t%llu\t%d\n", (unsigned long long)in->id,
+			(unsigned long long)(flushed ? 0 : w->retired), flushed);
+	}
+	w->retired += !flushed;
+}
+
+// a stall, flush or forward: a Kanata hover label, or a Chrome instant event
+static void pt_event(pt_writer_t *w, const pt_inst_t *in, uint64_t cycle, int stage, const char *text) {
+	if (w->chrome) {
+		fprintf(w->out, "%s{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %llu, \"pid\": 1, \"tid\": %d}",
+			w->first ? "\n" : ",\n", text, (unsigned long long)cycle, stage);
+		w->first = false;
+	}
+	else if (in->id != 0) {
+		pt_goto(w, cycle);
+		fprintf(w->out, "L\t%llu\t1\tcycle %llu: %s\n", (unsigned long long)in->id, (unsigned long long)cycle, text);
+	}
+}
+
+static bool pt_read_varint(FILE *in, uint64_t *v) {
+	int c, shift = 0;
+
+	*v = 0;
+	do {
+		if ((c = getc(in)) == EOF || shift > 63) {
+			return false;
+		}
+		*v |= (uint64_t)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return true;
+}
+
+int pipetrace_convert(const char *in_path, const char *out_path) {
+	static const char *FORWARD_SOURCES[3] = { NULL, "EX/MEM", "MEM/WB" };
+	uint32_t slot_ir[PT_IR_SLOTS] = { 0 }, last_pc = 0, delta, slot;
+	uint8_t header[PT_HEADER_SIZE], raw[4];
+	pt_inst_t old[4], now[4];
+	pt_writer_t w;
+	uint64_t cycle, v, next_id = 1, records = 0;
+	int codes, events, i, j, code;
+	char text[64];
+	bool live;
+	FILE *in = fopen(in_path, "rb");
+	size_t len = strlen(out_path);
+
+	if (in == NULL || fread(header, 1, sizeof(header), in) != sizeof(header) ||
+		memcmp(header, PT_MAGIC, 4) != 0 || load_le32(header + 4) != PT_VERSION) {
+		printf("Error: %s is not a version %d pipeline trace\n", in_path, PT_VERSION);
+		return 1;
+	}
+	memset(&w, 0, sizeof(w));
+	w.chrome = len >= 5 && strcmp(out_path + len - 5, ".json") == 0;
+	w.first = true;
+	w.out = fopen(out_path, "w");
+	if (w.out == NULL) {
+		printf("Error: cannot write %s\n", out_path);
+		fclose(in);
+		return 1;
+	}
+	memset(old, 0, sizeof(old));
+	cycle = load_le32(header + 8);
+	w.cycle = cycle;
+	fprintf(w.out, w.chrome ? "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [" : "Kanata\t0004\nC=\t%llu\n",
+		(unsigned long long)cycle);
+	if (w.chrome) {
+		for (i = 0; i < 5; i++) {
+			fprintf(w.out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+				w.first ? "\n" : ",\n", i, PT_STAGE_NAMES[i]);
+			w.first = false;
+		}
+	}
+
+	while ((codes = getc(in)) != EOF) {
+		if (codes == PT_IDLE) {
+			if (!pt_read_varint(in, &v)) {
+				break;
+			}
+			cycle += v;
+			continue;
+		}
+		if ((events = getc(in)) == EOF) {
+			break;
+		}
+		cycle++;
+		records++;
+
+		// this cycle's latches, from last cycle's
+		for (i = 0; i < 4; i++) {
+			code = (codes >> (2 * i)) & 3;
+			if (code == PT_SAME) {
+				now[i] = old[i];
+			}
+			else if (code == PT_ADVANCE) {
+				now[i] = old[i - 1];
+			}
+			else if (code == PT_BUBBLE) {
+				memset(&now[i], 0, sizeof(now[i]));
+			}
+			else {
+				if (!pt_read_varint(in, &v)) {
+					break;
+				}
+				delta = (uint32_t)(v >> 1);
+				now[i].pc = last_pc + ((delta >> 1) ^ -(delta & 1));
+				slot = (now[i].pc >> 2) & (PT_IR_SLOTS - 1);
+				if (v & 1) {
+					if (fread(raw, 1, 4, in) != 4) {
+						break;
+					}
+					slot_ir[slot] = load_le32(raw);
+				}
+				now[i].ir = slot_ir[slot];
+				now[i].id = next_id++;
+				now[i].stage = -1;
+				last_pc = now[i].pc;
+			}
+		}
+		if (i < 4) {
+			break;
+		}
+
+		// a new instruction was fetched the cycle it appears, events belong to that cycle too
+		if (now[0].id != 0 && now[0].stage < 0) {
+			pt_stage(&w, &now[0], 0, cycle - 1);
+		}
+		if (events & 0x7) {
+			snprintf(text, sizeof(text), "stall %s", STALL_CAUSE_NAMES[((events & 0x7) - 1) % NUM_STALL_CAUSES]);
+			pt_event(&w, &now[0], cycle - 1, 1, text);
+		}
+		if (events & PT_FLUSH) {
+			pt_event(&w, &old[1], cycle - 1, 2, "branch flush");
+		}
+		for (j = 0; j < 2; j++) {
+			code = (events >> (4 + 2 * j)) & 3;
+			if (code != 0 && code < 3) {
+				snprintf(text, sizeof(text), "forward %c from %s", 'A' + j, FORWARD_SOURCES[code]);
+				pt_event(&w, &old[1], cycle - 1, 2, text);
+			}
+		}
+
+		// what left the latches retired out of MEM/WB or was flushed
+		for (j = 0; j < 4; j++) {
+			if (old[j].id == 0) {
+				continue;
+			}
+			live = false;
+			for (i = 0; i < 4; i++) {
+				live |= now[i].id == old[j].id;
+			}
+			if (!live) {
+				pt_finish(&w, &old[j], cycle, j != 3);
+			}
+		}
+
+		// and the stage after its latch for every cycle it sits there
+		for (i = 0; i < 4; i++) {
+			if (now[i].id != 0 && now[i].stage != i + 1) {
+				pt_stage(&w, &now[i], i + 1, cycle);
+			}
+		}
+		memcpy(old, now, sizeof(old));
+	}
+
+	fprintf(w.out, w.chrome ? "\n]}\n" : "");
+	fclose(w.out);
+	fclose(in);
+	printf("Converted %s to %s: %llu cycles, %llu instructions retired, %llu records\n", in_path, out_path,
+		(unsigned long long)(cycle - load_le32(header + 8)), (unsigned long long)w.retired,
+		(unsigned long long)records);
+	return 0;
+}
+
+// the trace is closed however the simulator exits
+static void pipetrace_at_exit() {
+	static bool registered;
+
+	if (!registered) {
+		atexit(pipetrace_close);
+		registered = true;
+	}
+}
+
+/***************************************************************/
+/* Per-instruction profile: turning it on starts from zero counts for   */
+/* the loaded text, the hooks in the engines do the rest.                      */
+/***************************************************************/
+void profile_enable() {
+	free(PROFILE.entries);
+	PROFILE.words = PROGRAM_SIZE;
+	PROFILE.entries = calloc(PROGRAM_SIZE + 1, sizeof(profile_entry_t));
+	assert(PROFILE.entries != NULL);
+}
+
+void profile_disable() {
+	free(PROFILE.entries);
+	PROFILE.entries = NULL;
+	PROFILE.words = 0;
+}
+
+// cycles an instruction or block accounts for: one per execution plus its stalls
+static uint64_t profile_cost(const profile_entry_t *p) {
+	return p->executions + p->stall_cycles;
+}
+
+static void profile_add(profile_entry_t *sum, const profile_entry_t *p) {
+	sum->executions += p->executions;
+	sum->stall_cycles += p->stall_cycles;
+	sum->icache_misses += p->icache_misses;
+	sum->dcache_misses += p->dcache_misses;
+	sum->mispredicts += p->mispredicts;
+}
+
+static SIM_LOCAL const profile_entry_t *profile_sort_entries;
+
+// most expensive first, ties in address order
+static int profile_compare(const void *a, const void *b) {
+	uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+	uint64_t ci = profile_cost(&profile_sort_entries[i]), cj = profile_cost(&profile_sort_entries[j]);
+
+	if (ci != cj) {
+		return ci > cj ? -1 : 1;
+	}
+	return i < j ? -1 : i > j;
+}
+
+static void profile_print(const char *label, const profile_entry_t *p, uint64_t total) {
+	printf("%-23s %10llu %8llu %6llu %6llu %7llu %5.1f%%  ", label, (unsigned long long)p->executions,
+		(unsigned long long)p->stall_cycles, (unsigned long long)p->icache_misses,
+		(unsigned long long)p->dcache_misses, (unsigned long long)p->mispredicts,
+		total ? 100.0 * profile_cost(p) / total : 0.0);
+}
+
+/***************************************************************/
+/* Print the top most expensive instructions, then the same for basic  */
+/* blocks. Blocks are found statically: a block starts at the entry, */
+/* after every branch or jump (and its delay slot) and at every direct */
+/* branch target. JR/JALR targets are only known at run time, so the   */
+/* blocks they return to start at the instruction after a call.         */
+/***************************************************************/
+void profile_report(uint32_t top) {
+	const profile_entry_t *entries = PROFILE.entries;
+	profile_entry_t total = { 0 }, *blocks;
+	uint32_t *order, *first, *length;
+	uint8_t *leader;
+	uint32_t i, n, num_blocks = 0, pc, target, end;
+	const decoded_inst_t *d;
+	char label[32];
+
+	if (entries == NULL) {
+		printf("Profiling is off, turn it on with 'profile on'\n");
+		return;
+	}
+	order = malloc((PROFILE.words + 1) * sizeof(uint32_t));
+	leader = calloc(PROFILE.words + 1, 1);
+	assert(order != NULL && leader != NULL);
+
+	for (i = 0, n = 0; i < PROFILE.words; i++) {
+		profile_add(&total, &entries[i]);
+		if (profile_cost(&entries[i]) != 0 || entries[i].icache_misses != 0) {
+			order[n++] = i;
+		}
+	}
+	profile_sort_entries = entries;
+	qsort(order, n, sizeof(uint32_t), profile_compare);
+
+	printf("Profile of %u text words: %llu executions, %llu stall cycles, %llu/%llu I/D-cache misses, %llu mispredicts\n\n",
+		PROFILE.words, (unsigned long long)total.executions, (unsigned long long)total.stall_cycles,
+		(unsigned long long)total.icache_misses, (unsigned long long)total.dcache_misses,
+		(unsigned long long)total.mispredicts);
+	printf("%-23s %10s %8s %6s %6s %7s %6s\n", "instruction", "executions", "stalls", "I-miss", "D-miss",
+		"mispred", "share");
+	for (i = 0; i < n && i < top; i++) {
+		pc = MEM_TEXT_BEGIN + (order[i] << 2);
+		snprintf(label, sizeof(label), "0x%08X", pc);
+		profile_print(label, &entries[order[i]], profile_cost(&total));
+		print_program(pc);
+	}
+
+	// mark the block leaders
+	leader[0] = 1;
+	for (i = 0; i < PROFILE.words; i++) {
+		pc = MEM_TEXT_BEGIN + (i << 2);
+		d = decode_lookup(pc);
+		if (!(d->flags & INST_BRANCH)) {
+			continue;
+		}
+		end = (delay_slot_base(pc) + 4 - MEM_TEXT_BEGIN) >> 2;
+		if (end < PROFILE.words) {
+			leader[end] = 1;
+		}
+		if (d->op == OP_JR || d->op == OP_JALR) {
+			continue;
+		}
+		if (d->op == OP_J || d->op == OP_JAL) {
+			target = (delay_slot_base(pc) & 0xF0000000) | (d->target << 2);
+		}
+		else {
+			target = delay_slot_base(pc) + (d->simm << 2);
+		}
+		target = (target - MEM_TEXT_BEGIN) >> 2;
+		if (target < PROFILE.words) {
+			leader[target] = 1;
+		}
+	}
+
+	// sum every block, how often it was entered is its first instruction's count
+	blocks = calloc(PROFILE.words + 1, sizeof(profile_entry_t));
+	first = malloc((PROFILE.words + 1) * sizeof(uint32_t));
+	length = malloc((PROFILE.words + 1) * sizeof(uint32_t));
+	assert(blocks != NULL && first != NULL && length != NULL);
+	for (i = 0; i < PROFILE.words; i++) {
+		if (leader[i]) {
+			first[num_blocks] = i;
+			length[num_blocks] = 0;
+			num_blocks++;
+		}
+		profile_add(&blocks[num_blocks - 1], &entries[i]);
+		length[num_blocks - 1]++;
+	}
+	for (i = 0, n = 0; i < num_blocks; i++) {
+		if (profile_cost(&blocks[i]) != 0 || blocks[i].icache_misses != 0) {
+			order[n++] = i;
+		}
+	}
+	profile_sort_entries = blocks;
+	qsort(order, n, sizeof(uint32_t), profile_compare);
+
+	printf("\n%-23s %10s %8s %6s %6s %7s %6s  %s\n", "basic block", "inst execs", "stalls", "I-miss", "D-miss",
+		"mispred", "share", "entries");
+	for (i = 0; i < n && i < top; i++) {
+		pc = MEM_TEXT_BEGIN + (first[order[i]] << 2);
+		snprintf(label, sizeof(label), "0x%08X-0x%08X", pc, pc + (length[order[i]] - 1) * 4);
+		profile_print(label, &blocks[order[i]], profile_cost(&total));
+		printf("%llu\n", (unsigned long long)entries[first[order[i]]].executions);
+	}
+
+	free(order);
+	free(leader);
+	free(blocks);
+	free(first);
+	free(length);
+}
+
+/***************************************************************/
+/* Read a command from standard input.                                                               */  
+/***************************************************************/
+void handle_command() {                         
+	char buffer[20];
+	uint32_t start, stop, cycles;
+	uint32_t register_no;
+	int register_value;
+	int hi_reg_value, lo_reg_value;
+	int slot;
+	char spec[64];
+
+	printf("MU-MIPS SIM:> ");
+
+	if (scanf("%s", buffer) == EOF){
+		exit(0);
+	}
+
+	switch(buffer[0]) {
+		case 'S':
+		case 's':
+			if (strcmp(buffer, "storebuffer") == 0) {
+				if (scanf("%63s", spec) != 1) {
+					break;
+				}
+				if (strcmp(spec, "show") == 0) {
+					store_buffer_dump(&STORE_BUFFER, &COUNTERS);
+				}
+				else {
+					store_buffer_configure(spec);
+				}
+			}else if (strcmp(buffer, "stages") == 0) {
+				if (scanf("%63s", spec) != 1) {
+					break;
+				}
+				if (strcmp(spec, "show") == 0) {
+					pipe_dump();
+				}
+				else {
+					// retire what is in flight at the old depth first
+					pipeline_drain();
+					pipe_configure(spec);
+				}
+			}else if (buffer[1] == 'h' || buffer[1] == 'H'){
+				show_pipeline();
+			}else if (buffer[1] == 't' || buffer[1] == 'T'){
+				stats_dump();
+			}else if (buffer[1] == 'n' || buffer[1] == 'N'){
+				if (scanf("%19s %d", buffer, &slot) != 2) {
+					break;
+				}
+				if (slot < 0 || slot >= NUM_SNAPSHOTS) {
+					printf("Snapshot slots are 0 to %d\n", NUM_SNAPSHOTS - 1);
+				}
+				else if (strcmp(buffer, "save") == 0) {
+					snapshot_save(slot);
+				}
+				else if (strcmp(buffer, "restore") == 0) {
+					if (!snapshot_restore(slot)) {
+						printf("Snapshot %d is empty\n", slot);
+					}
+				}
+				else if (strcmp(buffer, "drop") == 0) {
+					snapshot_drop(slot);
+				}
+				else {
+					printf("Invalid Command.\n");
+				}
+			}else {
+				runAll(); 
+			}
+			break;
+		case 'M':
+		case 'm':
+			if (strcmp(buffer, "mdu") == 0) {
+				if (scanf("%63s", spec) == 1) {
+					mdu_configure(spec);
+				}
+				break;
+			}
+			if (scanf("%x %x", &start, &stop) != 2){
+				break;
+			}
+			mdump(start, stop);
+			break;
+		case '?':
+			help();
+			break;
+		case 'Q':
+		case 'q':
+			printf("**************************\n");
+			printf("Exiting MU-MIPS! Good Bye...\n");
+			printf("**************************\n");
+			exit(0);
+		case 'R':
+		case 'r':
+			if (buffer[1] == 'd' || buffer[1] == 'D'){
+				rdump();
+			}else if(buffer[1] == 'e' || buffer[1] == 'E'){
+				reset();
+			}
+			else {
+				if (scanf("%d", &cycles) != 1) {
+					break;
+				}
+				run(cycles);
+			}
+			break;
+		case 'I':
+		case 'i':
+			if (strcmp(buffer, "issue") == 0) {
+				if (scanf("%63s", spec) == 1) {
+					// retire what is in flight at the old width first
+					pipeline_drain();
+					ss_configure(spec);
+				}
+				break;
+			}
+			if (scanf("%u %i", &register_no, &register_value) != 2){
+				break;
+			}
+			CURRENT_STATE.REGS[register_no] = register_value;
+			NEXT_STATE.REGS[register_no] = register_value;
+			break;
+		case 'O':
+		case 'o':
+			if (strcmp(buffer, "ooo") == 0 && scanf("%63s", spec) == 1) {
+				if (strcmp(spec, "check") == 0) {
+					ooo_check(true);
+				}
+				else {
+					// retire what is in flight on the current engine first
+					pipeline_drain();
+					ooo_configure(spec);
+				}
+			}
+			break;
+		case 'H':
+		case 'h':
+			if (scanf("%i", &hi_reg_value) != 1){
+				break;
+			}
+			CURRENT_STATE.HI = hi_reg_value; 
+			NEXT_STATE.HI = hi_reg_value; 
+			break;
+		case 'L':
+		case 'l':
+			if (scanf("%i", &lo_reg_value) != 1){
+				break;
+			}
+			CURRENT_STATE.LO = lo_reg_value;
+			NEXT_STATE.LO = lo_reg_value;
+			break;
+		case 'P':
+		case 'p':
+			if (strcmp(buffer, "pipetrace") == 0) {
+				if (scanf("%63s", spec) == 1) {
+					if (strcmp(spec, "off") == 0) {
+						pipetrace_close();
+					}
+					else if (pipetrace_open(spec)) {
+						pipetrace_at_exit();
+					}
+				}
+				break;
+			}
+			if (strcmp(buffer, "prefetch") == 0) {
+				if (scanf("%63s", spec) != 1) {
+					break;
+				}
+				if (strcmp(spec, "show") == 0) {
+					prefetch_dump(&PREFETCH);
+				}
+				else {
+					prefetch_configure(spec);
+				}
+				break;
+			}
+			if (strcmp(buffer, "profile") == 0) {
+				if (scanf("%63s", spec) != 1) {
+					break;
+				}
+				if (strcmp(spec, "on") == 0 || strcmp(spec, "reset") == 0) {
+					profile_enable();
+				}
+				else if (strcmp(spec, "off") == 0) {
+					profile_disable();
+				}
+				else {
+					profile_report(strtoul(spec, NULL, 0));
+				}
+				break;
+			}
+			print_program(CURRENT_STATE.PC); 
+			break;
+		case 'B':
+		case 'b':
+			if (buffer[1] == 'p' || buffer[1] == 'P') {
+				if (scanf("%63s", spec) == 1) {
+					bp_configure(spec);
+				}
+				break;
+			}
+			if (scanf("%19s %u", buffer, &cycles) != 2) {
+				break;
+			}
+			if (strcmp(buffer, "mem") == 0) {
+				bench_memory(cycles);
+			}
+			else if (strcmp(buffer, "sim") == 0) {
+				bench_simulation(cycles);
+			}
+			else if (strcmp(buffer, "ff") == 0) {
+				bench_functional(cycles);
+			}
+			else if (strcmp(buffer, "jit") == 0) {
+				bench_jit(cycles);
+			}
+			else if (strcmp(buffer, "reset") == 0) {
+				bench_reset(cycles);
+			}
+			else {
+				printf("Invalid Command.\n");
+			}
+			break;
+		case 'V':
+		case 'v':
+			if (scanf("%d", &TRACE_LEVEL) != 1) {
+				break;
+			}
+			if (TRACE_LEVEL > TRACE_MAX) {
+				printf("Trace level capped at %d in this build\n", TRACE_MAX);
+			}
+			break;
+		case 'J':
+		case 'j':
+			if (scanf("%19s", buffer) != 1) {
+				break;
+			}
+			if (strcmp(buffer, "on") == 0 || strcmp(buffer, "off") == 0) {
+				JIT_ENABLED = strcmp(buffer, "on") == 0;
+				JIT_ENABLED ? printf("Fast-forward through the JIT\n") : printf("Fast-forward through the interpreter\n");
+			}
+			else if (strcmp(buffer, "check") == 0 && scanf("%u", &cycles) == 1) {
+				jit_check(cycles);
+			}
+			else {
+				printf("Invalid Command.\n");
+			}
+			break;
+		case 'C':
+		case 'c':
+			if (scanf("%19s", buffer) != 1) {
+				break;
+			}
+			if (strcmp(buffer, "show") == 0) {
+				cache_dump("L1I", &L1I);
+				cache_dump("L1D", &L1D);
+				memsys_dump(&L2, &DRAM, &MEMSYS);
+			}
+			else if ((strcmp(buffer, "i") == 0 || strcmp(buffer, "d") == 0) && scanf("%63s", spec) == 1) {
+				cache_configure(buffer[0] == 'i' ? &L1I : &L1D, spec);
+			}
+			else if ((strcmp(buffer, "l2") == 0 || strcmp(buffer, "dram") == 0 || strcmp(buffer, "mshrs") == 0) &&
+				scanf("%63s", spec) == 1) {
+				memsys_configure(buffer, spec);
+			}
+			else {
+				printf("Invalid Command.\n");
+			}
+			break;
+		case 'E':
+		case 'e':
+			if(scanf("%d", &ENABLE_EARLY_BRANCH) != 1)
+				break;
+			ENABLE_EARLY_BRANCH == 0 ? printf("Branches resolve in EX\n") : printf("Branches resolve in ID\n");
+			break;
+		case 'D':
+		case 'd':
+			if(scanf("%d", &slot) != 1)
+				break;
+			// delay slots run the five stage pipeline, retire what the split stages hold
+			pipeline_drain();
+			ENABLE_DELAY_SLOT = slot;
+			ENABLE_DELAY_SLOT == 0 ? printf("Branch delay slots off\n") : printf("Branch delay slots on\n");
+			break;
+		case 'F':
+		case 'f':
+			if (buffer[1] == 'f' || buffer[1] == 'F') {
+				if (scanf("%19s", buffer) != 1) {
+					break;
+				}
+				if (strcmp(buffer, "pc") == 0) {
+					if (scanf("%x", &start) == 1) {
+						fast_forward(UINT32_MAX, start);
+					}
+				}
+				else {
+					fast_forward(strtoul(buffer, NULL, 0), UINT32_MAX);
+				}
+				break;
+			}
+			if(scanf("%d", &ENABLE_FORWARDING) != 1)
+				break;
+			ENABLE_FORWARDING == 0 ? printf("Forwarding OFF\n") : printf("Forwarding ON\n");
+			break;
+		default:
+			printf("Invalid Command.\n");
+			break;
+	}
+}
+
+static void reload_program();
+static bool pipe_busy(const pipe_stages_t *pipe);
+
+/***************************************************************/
+/* reset registers/memory and reload program                                                    */
+/***************************************************************/
+void reset() {   
+	/*the snapshot taken after loading makes this a page table copy*/
+	if (snapshot_restore(SNAPSHOT_BOOT)) {
+		return;
+	}
+	reload_program();
+}
+
+/***************************************************************/
+/* reset the slow way: clear registers and parse the program again  */
+/***************************************************************/
+static void reload_program() {
+	int i;
+	/*reset registers*/
+	for (i = 0; i < MIPS_REGS; i++){
+		CURRENT_STATE.REGS[i] = 0;
+	}
+	CURRENT_STATE.HI = 0;
+	CURRENT_STATE.LO = 0;
+	
+	/*release every touched page, untouched memory already reads as zero*/
+	free_memory();
+	
+	/*load program*/
+	if (!load_program()) {
+		exit(-1);
+	}
+	
+	/*reset PC*/
+	INSTRUCTION_COUNT = 0;
+	memset(&COUNTERS, 0, sizeof(COUNTERS));
+	cache_reset(&L1I);
+	cache_reset(&L1D);
+	memsys_reset();
+	prefetch_reset();
+	store_buffer_reset();
+	bp_reset();
+	mdu_reset();
+	ss_reset();
+	ooo_reset();
+	pipe_reset();
+	CURRENT_STATE.PC =  PROGRAM_ENTRY;
+	NEXT_STATE = CURRENT_STATE;
+	RUN_FLAG = TRUE;
+}
+
+/***************************************************************/
+/* Set memory to zero, pages are only allocated when first written      */
+/***************************************************************/
+void init_memory() {                                           
+	int i;
+	uint32_t chunk;
+
+	memset(MEM_PAGE_DIR, 0, sizeof(MEM_PAGE_DIR));
+	MEM_PAGES_ALLOCATED = 0;
+	mem_tlb_flush();
+	decode_flush();
+
+	memset(MEM_CHUNK_LEGAL, 0, sizeof(MEM_CHUNK_LEGAL));
+	for (i = 0; i < NUM_MEM_REGION; i++) {
+		for (chunk = MEM_REGIONS[i].begin >> MEM_CHUNK_SHIFT; chunk <= MEM_REGIONS[i].end >> MEM_CHUNK_SHIFT; chunk++) {
+			MEM_CHUNK_LEGAL[chunk] = 1;
+		}
+	}
+}
+
+/***************************************************************/
+/* Drop a page directory's references to its pages, and its tables     */
+/***************************************************************/
+static void mem_release_pages(uint8_t **dir[])
+{
+	int i, j;
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (dir[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			mem_page_release(dir[i][j]);
+		}
+		free(dir[i]);
+		dir[i] = NULL;
+	}
+}
+
+/***************************************************************/
+/* Make dst share every page of src, dropping what dst held before.    */
+/* Costs O(touched tables), reusing dst's tables where it has them.    */
+/***************************************************************/
+static void mem_assign_pages(uint8_t **dst[], uint8_t **src[])
+{
+	int i, j;
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (src[i] == NULL) {
+			if (dst[i] != NULL) {
+				for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+					mem_page_release(dst[i][j]);
+				}
+				free(dst[i]);
+				dst[i] = NULL;
+			}
+			continue;
+		}
+		if (dst[i] == NULL) {
+			dst[i] = calloc(MEM_TABLE_ENTRIES, sizeof(uint8_t *));
+			assert(dst[i] != NULL);
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			if (src[i][j] != dst[i][j]) {
+				if (src[i][j] != NULL) {
+					(*mem_page_refs(src[i][j]))++;
+				}
+				mem_page_release(dst[i][j]);
+				dst[i][j] = src[i][j];
+			}
+		}
+	}
+}
+
+/***************************************************************/
+/* Whether two page directories hold the same pages for all of text */
+/***************************************************************/
+static bool mem_text_identical(uint8_t **a[], uint8_t **b[])
+{
+	int i;
+	for (i = MEM_TEXT_BEGIN >> MEM_DIR_SHIFT; i <= MEM_TEXT_END >> MEM_DIR_SHIFT; i++) {
+		if (a[i] == b[i]) {
+			continue;
+		}
+		if (a[i] == NULL || b[i] == NULL ||
+			memcmp(a[i], b[i], MEM_TABLE_ENTRIES * sizeof(uint8_t *)) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/***************************************************************/
+/* Release every allocated page, leaving memory all zero                     */
+/***************************************************************/
+void free_memory() {
+	mem_release_pages(MEM_PAGE_DIR);
+	MEM_PAGES_ALLOCATED = 0;
+	mem_tlb_flush();
+	decode_flush();
+}
+
+/***************************************************************/
+/* Copy the out-of-order core into a snapshot, the ROB included, and  */
+/* back, where the sizes still match                                                      */
+/***************************************************************/
+static void ooo_save(ooo_t *saved) {
+	free(saved->rob);
+	*saved = OOO;
+	saved->rob = NULL;
+	if (OOO.rob_entries == 0) {
+		return;
+	}
+	saved->rob = malloc(OOO.rob_entries * sizeof(ooo_entry_t));
+	assert(saved->rob != NULL);
+	memcpy(saved->rob, OOO.rob, OOO.rob_entries * sizeof(ooo_entry_t));
+}
+
+static void ooo_restore(const ooo_t *saved) {
+	ooo_entry_t *rob = OOO.rob;
+
+	if (OOO.rob_entries == 0 || saved->rob == NULL || OOO.rob_entries != saved->rob_entries ||
+		OOO.rs_entries != saved->rs_entries || OOO.lsq_entries != saved->lsq_entries || OOO.width != saved->width) {
+		ooo_reset();
+		return;
+	}
+	OOO = *saved;
+	OOO.rob = rob;
+	memcpy(OOO.rob, saved->rob, OOO.rob_entries * sizeof(ooo_entry_t));
+}
+
+/***************************************************************/
+/* Save the whole simulator state into a snapshot slot                          */
+/***************************************************************/
+void snapshot_save(int slot) {
+	sim_snapshot_t *snap = &SNAPSHOTS[slot];
+
+	snap->current = CURRENT_STATE;
+	snap->next = NEXT_STATE;
+	snap->if_id = IF_ID;
+	snap->id_ex = ID_EX;
+	snap->ex_mem = EX_MEM;
+	snap->mem_wb = MEM_WB;
+	snap->run_flag = RUN_FLAG;
+	snap->instruction_count = INSTRUCTION_COUNT;
+	snap->cycle_count = CYCLE_COUNT;
+	snap->program_size = PROGRAM_SIZE;
+	snap->reg_write_ex_mem = REG_WRITE_EX_MEM;
+	snap->reg_write_mem_wb = REG_WRITE_MEM_WB;
+	snap->stall_counter = stallCounter;
+	snap->write_back_value = writeBackValue;
+	snap->forward_a = ForwardA;
+	snap->forward_b = ForwardB;
+	snap->branch_jump_flag = branch_jump_flag;
+	snap->early_branch_flag = early_branch_flag;
+	snap->delay_slot_pending = delay_slot_pending;
+	snap->delay_slot_target = delay_slot_target;
+	snap->fetch_gated = fetch_gated;
+	snap->stall_cause = stallCause;
+	snap->counters = COUNTERS;
+	cache_save(&snap->l1i, &L1I);
+	cache_save(&snap->l1d, &L1D);
+	cache_save(&snap->l2, &L2);
+	snap->dram = DRAM;
+	snap->memsys = MEMSYS;
+	snap->prefetch = PREFETCH;
+	snap->store_buffer = STORE_BUFFER;
+	bp_save(&snap->bp);
+	snap->mdu = MDU;
+	snap->ss = SS;
+	ooo_save(&snap->ooo);
+	snap->pipe = PIPE;
+
+	// every page is now shared, so the next store to each one must copy it
+	mem_assign_pages(snap->pages, MEM_PAGE_DIR);
+	snap->pages_allocated = MEM_PAGES_ALLOCATED;
+	mem_tlb_flush();
+	snap->valid = true;
+}
+
+/***************************************************************/
+/* Restore a saved snapshot, which stays valid for further restores     */
+/* Returns false if the slot is empty.                                                          */
+/***************************************************************/
+bool snapshot_restore(int slot) {
+	sim_snapshot_t *snap = &SNAPSHOTS[slot];
+	uint32_t depth;
+	bool in_flight;
+
+	if (!snap->valid) {
+		return false;
+	}
+	in_flight = snap->if_id.IR != 0 || snap->id_ex.IR != 0 || snap->ex_mem.IR != 0 || snap->mem_wb.IR != 0 ||
+		snap->ss.if_id.count != 0 || snap->ss.id_ex.count != 0 || snap->ss.ex_mem.count != 0 ||
+		snap->ss.mem_wb.count != 0;
+	CURRENT_STATE = snap->current;
+	NEXT_STATE = snap->next;
+	IF_ID = snap->if_id;
+	ID_EX = snap->id_ex;
+	EX_MEM = snap->ex_mem;
+	MEM_WB = snap->mem_wb;
+	RUN_FLAG = snap->run_flag;
+	INSTRUCTION_COUNT = snap->instruction_count;
+	CYCLE_COUNT = snap->cycle_count;
+	PROGRAM_SIZE = snap->program_size;
+	REG_WRITE_EX_MEM = snap->reg_write_ex_mem;
+	REG_WRITE_MEM_WB = snap->reg_write_mem_wb;
+	stallCounter = snap->stall_counter;
+	writeBackValue = snap->write_back_value;
+	ForwardA = snap->forward_a;
+	ForwardB = snap->forward_b;
+	branch_jump_flag = snap->branch_jump_flag;
+	early_branch_flag = snap->early_branch_flag;
+	delay_slot_pending = snap->delay_slot_pending;
+	delay_slot_target = snap->delay_slot_target;
+	fetch_gated = snap->fetch_gated;
+	stallCause = snap->stall_cause;
+	COUNTERS = snap->counters;
+	cache_restore(&L1I, &snap->l1i);
+	cache_restore(&L1D, &snap->l1d);
+	cache_restore(&L2, &snap->l2);
+	if(MEMSYS.enabled == snap->memsys.enabled && MEMSYS.mshrs == snap->memsys.mshrs &&
+		memcmp(&DRAM, &snap->dram, offsetof(dram_t, open_row)) == 0)
+	{
+		DRAM = snap->dram;
+		MEMSYS = snap->memsys;
+	}
+	else
+		memsys_reset();
+	if(PREFETCH.kind == snap->prefetch.kind && PREFETCH.degree == snap->prefetch.degree &&
+		PREFETCH.entries == snap->prefetch.entries)
+		PREFETCH = snap->prefetch;
+	else
+		prefetch_reset();
+	bp_restore(&snap->bp);
+	if(MDU.mult_latency == snap->mdu.mult_latency && MDU.div_latency == snap->mdu.div_latency)
+		MDU = snap->mdu;
+	else
+		mdu_reset();
+	// the latches only make sense at the width they were saved at, so with
+	// instructions in flight that width comes back too
+	if(SS.width == snap->ss.width)
+		SS = snap->ss;
+	else if(in_flight)
+	{
+		printf("Snapshot %d has instructions in flight, issue width back to %u\n", slot, snap->ss.width);
+		SS = snap->ss;
+	}
+	else
+		ss_reset();
+	ooo_restore(&snap->ooo);
+	// likewise instructions inside split stages bring back the stage list they were saved at
+	if(memcmp(PIPE.depth, snap->pipe.depth, sizeof(PIPE.depth)) == 0)
+		PIPE = snap->pipe;
+	else if(pipe_busy(&snap->pipe))
+	{
+		printf("Snapshot %d has instructions in split stages, stage list back to the saved one\n", slot);
+		PIPE = snap->pipe;
+	}
+	else
+		pipe_reset();
+
+	// decoded (and translated) text stays valid unless a text page changed
+	if (!mem_text_identical(MEM_PAGE_DIR, snap->pages)) {
+		decode_flush();
+	}
+	mem_assign_pages(MEM_PAGE_DIR, snap->pages);
+	MEM_PAGES_ALLOCATED = snap->pages_allocated;
+	mem_tlb_flush();
+
+	// buffered stores are program state: keep them under the current depth, they drain
+	// before new stores get in, or go straight to memory when the buffer is now off
+	depth = STORE_BUFFER.depth;
+	STORE_BUFFER = snap->store_buffer;
+	STORE_BUFFER.depth = depth;
+	if (depth == 0) {
+		store_buffer_flush();
+		store_buffer_reset();
+	}
+	return true;
+}
+
+/***************************************************************/
+/* Empty a snapshot slot, releasing its share of the pages               */
+/***************************************************************/
+void snapshot_drop(int slot) {
+	if (SNAPSHOTS[slot].valid) {
+		mem_release_pages(SNAPSHOTS[slot].pages);
+		cache_release(&SNAPSHOTS[slot].l1i);
+		cache_release(&SNAPSHOTS[slot].l1d);
+		cache_release(&SNAPSHOTS[slot].l2);
+		free(SNAPSHOTS[slot].bp.bimodal);
+		free(SNAPSHOTS[slot].bp.gshare);
+		free(SNAPSHOTS[slot].bp.chooser);
+		free(SNAPSHOTS[slot].bp.btb_tags);
+		free(SNAPSHOTS[slot].bp.btb_targets);
+		free(SNAPSHOTS[slot].bp.ras);
+		memset(&SNAPSHOTS[slot].bp, 0, sizeof(SNAPSHOTS[slot].bp));
+		free(SNAPSHOTS[slot].ooo.rob);
+		SNAPSHOTS[slot].ooo.rob = NULL;
+		SNAPSHOTS[slot].valid = false;
+	}
+}
+
+/***************************************************************/
+/* Time reset() through the boot snapshot against reparsing the file  */
+/***************************************************************/
+void bench_reset(uint32_t iterations) {
+	int saved_trace = TRACE_LEVEL;
+	double t0, reload, restore;
+	uint32_t i;
+
+	TRACE_LEVEL = TRACE_NONE;
+	snapshot_save(SNAPSHOT_SCRATCH);
+	t0 = now_seconds();
+	for (i = 0; i < iterations; i++) {
+		reload_program();
+	}
+	reload = now_seconds() - t0;
+	t0 = now_seconds();
+	for (i = 0; i < iterations; i++) {
+		snapshot_restore(SNAPSHOT_BOOT);
+	}
+	restore = now_seconds() - t0;
+	TRACE_LEVEL = saved_trace;
+	snapshot_restore(SNAPSHOT_SCRATCH);
+	snapshot_drop(SNAPSHOT_SCRATCH);
+
+	printf("reset, %u iterations: reload %.2f us, snapshot restore %.2f us each\n\n",
+		iterations, reload / iterations * 1e6, restore / iterations * 1e6);
+}
+
+/**************************************************************/
+/* load program into memory                                                                                      */
+/**************************************************************/
+/* Map a whole file read-only, false if it cannot be opened.            */
+/* An empty file maps to NULL with a size of zero.                                */
+/**************************************************************/
+static bool map_file(const char *path, const uint8_t **buf, size_t *size) {
+	struct stat st;
+	void *map;
+	int fd;
+
+	*buf = NULL;
+	*size = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return true;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	*buf = map;
+	*size = st.st_size;
+	return true;
+}
+
+/**************************************************************/
+/* Hex .in program: one instruction word per line, loaded at the start */
+/* of text                                                                                                               */
+/**************************************************************/
+static bool load_hex(const uint8_t *buf, size_t size) {
+	size_t pos = 0;
+	uint32_t word, address = MEM_TEXT_BEGIN;
+	int digit, digits;
+
+	while (pos < size) {
+		if (buf[pos] == ' ' || buf[pos] == '\t' || buf[pos] == '\r' || buf[pos] == '\n') {
+			pos++;
+			continue;
+		}
+		if (buf[pos] == '0' && pos + 1 < size && (buf[pos+1] == 'x' || buf[pos+1] == 'X')) {
+			pos += 2;
+		}
+		word = 0;
+		digits = 0;
+		while (pos < size) {
+			digit = buf[pos] >= '0' && buf[pos] <= '9' ? buf[pos] - '0' :
+				buf[pos] >= 'a' && buf[pos] <= 'f' ? buf[pos] - 'a' + 10 :
+				buf[pos] >= 'A' && buf[pos] <= 'F' ? buf[pos] - 'A' + 10 : -1;
+			if (digit < 0) {
+				break;
+			}
+			word = (word << 4) | digit;
+			digits++;
+			pos++;
+		}
+		if (digits == 0) {
+			printf("Error: %s: not a hex word at byte %zu\n", prog_file, pos);
+			return false;
+		}
+		mem_write_32(address, word);
+		TRACE(TRACE_DETAIL, "writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
+		address += 4;
+	}
+	PROGRAM_SIZE = (address - MEM_TEXT_BEGIN) / 4;
+	PROGRAM_ENTRY = MEM_TEXT_BEGIN;
+	return true;
+}
+
+/**************************************************************/
+/* Copy one segment of an image into memory                                       */
+/**************************************************************/
+static bool load_segment(const uint8_t *buf, size_t size, uint32_t offset, uint32_t length, uint32_t address) {
+	if (offset > size || length > size - offset) {
+		printf("Error: %s: segment at 0x%08x runs past the end of the file\n", prog_file, address);
+		return false;
+	}
+	if (!mem_write_block(address, buf + offset, length)) {
+		printf("Error: %s: segment 0x%08x..0x%08x is outside memory\n", prog_file, address, address + length);
+		return false;
+	}
+	TRACE(TRACE_INFO, "loaded %u bytes at 0x%08x\n", length, address);
+	return true;
+}
+
+/**************************************************************/
+/* MUMI image, see mumi_header_t: text then data, raw little-endian   */
+/**************************************************************/
+static bool load_image(const uint8_t *buf, size_t size) {
+	uint32_t entry, text_addr, text_size, data_addr, data_size;
+
+	if (size < MUMI_HEADER_SIZE || load_le32(buf + 4) != MUMI_VERSION) {
+		printf("Error: %s: unsupported image version\n", prog_file);
+		return false;
+	}
+	entry = load_le32(buf + 8);
+	text_addr = load_le32(buf + 12);
+	text_size = load_le32(buf + 16);
+	data_addr = load_le32(buf + 20);
+	data_size = load_le32(buf + 24);
+
+	if (!load_segment(buf, size, MUMI_HEADER_SIZE, text_size, text_addr) ||
+		!load_segment(buf, size, MUMI_HEADER_SIZE + text_size, data_size, data_addr)) {
+		return false;
+	}
+	PROGRAM_SIZE = text_size / 4;
+	PROGRAM_ENTRY = entry;
+	return true;
+}
+
+/**************************************************************/
+/* Minimal ELF32 little-endian MIPS executable: every PT_LOAD segment */
+/* is copied to its virtual address, bss is already zero                        */
+/**************************************************************/
+static bool load_elf(const uint8_t *buf, size_t size) {
+	uint32_t phoff, phentsize, phnum, i;
+	const uint8_t *ph;
+
+	if (size < ELF32_EHDR_SIZE || buf[4] != 1 || buf[5] != 1) {
+		printf("Error: %s: only 32-bit little-endian ELF is supported\n", prog_file);
+		return false;
+	}
+	if (load_le16(buf + 18) != ELF_MACHINE_MIPS) {
+		printf("Error: %s: not a MIPS executable\n", prog_file);
+		return false;
+	}
+	phoff = load_le32(buf + 28);
+	phentsize = load_le16(buf + 42);
+	phnum = load_le16(buf + 44);
+	if (phentsize < ELF32_PHDR_SIZE || phoff > size || (uint64_t)phnum * phentsize > size - phoff) {
+		printf("Error: %s: bad program header table\n", prog_file);
+		return false;
+	}
+
+	PROGRAM_SIZE = 0;
+	for (i = 0; i < phnum; i++) {
+		ph = buf + phoff + i * phentsize;
+		if (load_le32(ph) != ELF_PT_LOAD) {
+			continue;
+		}
+		// p_offset, p_vaddr, p_filesz
+		if (!load_segment(buf, size, load_le32(ph + 4), load_le32(ph + 16), load_le32(ph + 8))) {
+			return false;
+		}
+		if (load_le32(ph + 8) == MEM_TEXT_BEGIN) {
+			PROGRAM_SIZE = load_le32(ph + 16) / 4;
+		}
+	}
+	PROGRAM_ENTRY = load_le32(buf + 24);
+	return true;
+}
+
+/**************************************************************/
+/* load program into memory: a MUMI image, an ELF32 executable or a    */
+/* hex .in file, told apart by their first bytes.                                  */
+/* Returns false, having said why, if the program cannot be loaded.   */
+/**************************************************************/
+bool load_program() {                   
+	const uint8_t *buf;
+	size_t size;
+	uint32_t i, warm;
+	bool ok;
+
+	/* Map the program file. */
+	if (!map_file(prog_file, &buf, &size)) {
+		printf("Error: Can't open program file %s\n", prog_file);
+		return false;
+	}
+
+	/* Read in the program. */
+	if (size >= 4 && memcmp(buf, MUMI_MAGIC, 4) == 0) {
+		ok = load_image(buf, size);
+	}
+	else if (size >= 4 && memcmp(buf, "\x7f" "ELF", 4) == 0) {
+		ok = load_elf(buf, size);
+	}
+	else {
+		ok = load_hex(buf, size);
+	}
+	if (buf != NULL) {
+		munmap((void *)buf, size);
+	}
+	if (!ok) {
+		return false;
+	}
+
+	/* decode the program up front so fetch rarely has to, the cache holds */
+	/* only DECODE_CACHE_ENTRIES words so there is no point going further */
+	warm = PROGRAM_SIZE < DECODE_CACHE_ENTRIES ? PROGRAM_SIZE : DECODE_CACHE_ENTRIES;
+	for (i = 0; i < warm; i++) {
+		decode_lookup(PROGRAM_ENTRY + 4*i);
+	}
+	CURRENT_STATE.PC = PROGRAM_ENTRY;
+	NEXT_STATE.PC = PROGRAM_ENTRY;
+	TRACE(TRACE_INFO, "Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
+	return true;
+}
+
+/**************************************************************/
+/* Save the loaded program as a MUMI image: PROGRAM_SIZE words of text */
+/* and the data region up to the last page that was written                 */
+/**************************************************************/
+int write_image(const char *path) {
+	uint8_t header[MUMI_HEADER_SIZE];
+	uint32_t address, data_end = MEM_DATA_BEGIN, word, i, j;
+	FILE *fp;
+
+	for (i = MEM_DATA_BEGIN >> MEM_DIR_SHIFT; i <= MEM_DATA_END >> MEM_DIR_SHIFT; i++) {
+		if (MEM_PAGE_DIR[i] == NULL) {
+			continue;
+		}
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			address = (i << MEM_DIR_SHIFT) | (j << MEM_PAGE_SHIFT);
+			if (MEM_PAGE_DIR[i][j] != NULL && address >= MEM_DATA_BEGIN) {
+				data_end = address + MEM_PAGE_SIZE;
+			}
+		}
+	}
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("Error: Can't create image file %s\n", path);
+		return 1;
+	}
+	memcpy(header, MUMI_MAGIC, 4);
+	store_le32(header + 4, MUMI_VERSION);
+	store_le32(header + 8, PROGRAM_ENTRY);
+	store_le32(header + 12, MEM_TEXT_BEGIN);
+	store_le32(header + 16, PROGRAM_SIZE * 4);
+	store_le32(header + 20, MEM_DATA_BEGIN);
+	store_le32(header + 24, data_end - MEM_DATA_BEGIN);
+	fwrite(header, 1, sizeof(header), fp);
+	for (address = MEM_TEXT_BEGIN; address < MEM_TEXT_BEGIN + PROGRAM_SIZE * 4; address += 4) {
+		store_le32((uint8_t *)&word, mem_read_32(address));
+		fwrite(&word, 1, 4, fp);
+	}
+	for (address = MEM_DATA_BEGIN; address < data_end; address += 4) {
+		store_le32((uint8_t *)&word, store_buffer_read_32(address));
+		fwrite(&word, 1, 4, fp);
+	}
+	fclose(fp);
+	printf("Wrote %s: %u text words, %u data bytes\n", path, PROGRAM_SIZE, data_end - MEM_DATA_BEGIN);
+	return 0;
+}
+
+/************************************************************/
+/* Names of the decoded operations, indexed by mips_op_t                    */ 
+/************************************************************/
+const char *MIPS_OP_NAMES[NUM_MIPS_OPS] = {
+#define MIPS_OP_NAME(name) #name,
+	MIPS_OPS(MIPS_OP_NAME)
+#undef MIPS_OP_NAME
+};
+
+/************************************************************/
+/* Decode an instruction word into its fields and op class                   */ 
+/************************************************************/
+void decode_instruction(uint32_t instruction, decoded_inst_t *d)
+{
+	d->IR = instruction;
+	d->opcode = (instruction & 0xFC000000) >> 26;
+	d->rs = (instruction & 0x03E00000) >> 21;
+	d->rt = (instruction & 0x001F0000) >> 16;
+	d->rd = (instruction & 0x0000F800) >> 11;
+	d->sa = (instruction & 0x000007C0) >> 6;
+	d->function = instruction & 0x0000003F;
+	d->imm = instruction & 0x0000FFFF;
+	d->simm = (d->imm & 0x8000) ? (d->imm | 0xFFFF0000) : d->imm;
+	d->target = instruction & 0x03FFFFFF;
+	d->op = OP_INVALID;
+	d->dest = 0;
+	d->flags = 0;
+
+	if(d->opcode == 0x00)
+	{
+		switch(d->function)
+		{
+			case 0x00: d->op = OP_SLL; break;
+			case 0x02: d->op = OP_SRL; break;
+			case 0x03: d->op = OP_SRA; break;
+			case 0x08: d->op = OP_JR; break;
+			case 0x09: d->op = OP_JALR; break;
+			case 0x0C: d->op = OP_SYSCALL; break;
+			case 0x10: d->op = OP_MFHI; break;
+			case 0x11: d->op = OP_MTHI; break;
+			case 0x12: d->op = OP_MFLO; break;
+			case 0x13: d->op = OP_MTLO; break;
+			case 0x18: d->op = OP_MULT; break;
+			case 0x19: d->op = OP_MULTU; break;
+			case 0x1A: d->op = OP_DIV; break;
+			case 0x1B: d->op = OP_DIVU; break;
+			case 0x20: d->op = OP_ADD; break;
+			case 0x21: d->op = OP_ADDU; break;
+			case 0x22: d->op = OP_SUB; break;
+			case 0x23: d->op = OP_SUBU; break;
+			case 0x24: d->op = OP_AND; break;
+			case 0x25: d->op = OP_OR; break;
+			case 0x26: d->op = OP_XOR; break;
+			case 0x27: d->op = OP_NOR; break;
+			case 0x2A: d->op = OP_SLT; break;
+		}
+		// for mult -> divu, MTHI & MTLO, JR and SYSCALL nothing is written back
+		switch(d->op)
+		{
+			case OP_INVALID: case OP_SYSCALL: case OP_JR:
+			case OP_MTHI: case OP_MTLO:
+			case OP_MULT: case OP_MULTU: case OP_DIV: case OP_DIVU:
+				break;
+			default:
+				d->flags |= INST_WRITES_REG;
+				d->dest = d->rd;
+				break;
+		}
+	}
+	else
+	{
+		switch(d->opcode)
+		{
+			case 0x01:
+				if(d->rt == 0x00) d->op = OP_BLTZ;
+				else if(d->rt == 0x01) d->op = OP_BGEZ;
+				break;
+			case 0x02: d->op = OP_J; break;
+			case 0x03: d->op = OP_JAL; break;
+			case 0x04: d->op = OP_BEQ; break;
+			case 0x05: d->op = OP_BNE; break;
+			case 0x06: d->op = OP_BLEZ; break;
+			case 0x07: d->op = OP_BGTZ; break;
+			case 0x08: d->op = OP_ADDI; break;
+			case 0x09: d->op = OP_ADDIU; break;
+			case 0x0A: d->op = OP_SLTI; break;
+			case 0x0C: d->op = OP_ANDI; break;
+			case 0x0D: d->op = OP_ORI; break;
+			case 0x0E: d->op = OP_XORI; break;
+			case 0x0F: d->op = OP_LUI; break;
+			case 0x20: d->op = OP_LB; break;
+			case 0x21: d->op = OP_LH; break;
+			case 0x23: d->op = OP_LW; break;
+			case 0x28: d->op = OP_SB; break;
+			case 0x29: d->op = OP_SH; break;
+			case 0x2B: d->op = OP_SW; break;
+		}
+		// immediate instructions write back to rt
+		switch(d->op)
+		{
+			case OP_ADDI: case OP_ADDIU: case OP_SLTI: case OP_ANDI:
+			case OP_ORI: case OP_XORI: case OP_LUI:
+			case OP_LB: case OP_LH: case OP_LW:
+				d->flags |= INST_WRITES_REG;
+				d->dest = d->rt;
+				break;
+			default:
+				break;
+		}
+	}
+
+	switch(d->op)
+	{
+		case OP_LB: case OP_LH: case OP_LW:
+			d->flags |= INST_LOAD;
+			break;
+		case OP_SB: case OP_SH: case OP_SW:
+			d->flags |= INST_STORE;
+			break;
+		case OP_JR: case OP_JALR: case OP_J: case OP_JAL:
+		case OP_BLTZ: case OP_BGEZ: case OP_BEQ: case OP_BNE: case OP_BLEZ: case OP_BGTZ:
+			d->flags |= INST_BRANCH;
+			break;
+		case OP_MFHI: case OP_MTHI: case OP_MFLO: case OP_MTLO:
+		case OP_MULT: case OP_MULTU: case OP_DIV: case OP_DIVU:
+			d->flags |= INST_HILO;
+			break;
+		default:
+			break;
+	}
+}
+
+/************************************************************/
+/* Decoded form of the instruction at pc, decoding it on a miss            */ 
+/************************************************************/
+const decoded_inst_t *decode_lookup(uint32_t pc)
+{
+	uint32_t index = (pc >> 2) & (DECODE_CACHE_ENTRIES - 1);
+
+	if(DECODE_TAGS[index] != pc)
+	{
+		decode_instruction(mem_read_32(pc), &DECODE_CACHE[index]);
+		DECODE_TAGS[index] = pc;
+	}
+	return &DECODE_CACHE[index];
+}
+
+/************************************************************/
+/* Drop decoded entries covering [address, address + size)                      */ 
+/************************************************************/
+void decode_invalidate(uint32_t address, uint32_t size)
+{
+	uint32_t word, index;
+
+	for(word = address & ~3u; word < address + size; word += 4)
+	{
+		index = (word >> 2) & (DECODE_CACHE_ENTRIES - 1);
+		if(DECODE_TAGS[index] == word)
+		{
+			DECODE_TAGS[index] = DECODE_TAG_INVALID;
+		}
+	}
+	jit_invalidate(address, size);
+}
+
+/************************************************************/
+/* Drop every decoded entry                                                                            */ 
+/************************************************************/
+void decode_flush()
+{
+	memset(DECODE_TAGS, 0xFF, sizeof(DECODE_TAGS));
+	jit_flush();
+}
+
+/************************************************************/
+/* Turn a pipeline register into a bubble                                                   */ 
+/************************************************************/
+static void bubble_latch(CPU_Pipeline_Reg *reg)
+{
+	static SIM_LOCAL decoded_inst_t nop;
+	static SIM_LOCAL bool nop_decoded = false;
+
+	if(!nop_decoded)
+	{
+		decode_instruction(0, &nop);
+		nop_decoded = true;
+	}
+	reg->PC = 0;
+	reg->IR = 0;
+	reg->D = nop;
+	reg->A = 0;
+	reg->B = 0;
+	reg->imm = 0;
+}
+
+/************************************************************/
+/* Pipeline depth, the split stages of pipe_stage_t in PIPE */
+/************************************************************/
+static const char *PIPE_STAGE_NAMES[] = { "IF", "ID", "EX", "MEM", "WB" };
+
+static inline uint32_t pipe_depth(pipe_stage_t s)
+{
+	return PIPE.depth[s] > 1 ? PIPE.depth[s] : 1;
+}
+
+// inner latches the scalar pipeline uses, delay slots keep it at five stages
+static inline uint32_t pipe_inner(pipe_stage_t s)
+{
+	return ENABLE_DELAY_SLOT ? 0 : pipe_depth(s) - 1;
+}
+
+/************************************************************/
+/* Configure from a stage list such as "IF1,IF2,ID,EX,MEM1,MEM2,WB": */
+/* IF, ID, EX, MEM and WB in this order, sub-stage numbers optional.   */
+/* IF, EX and MEM may repeat up to PIPE_MAX_SPLIT times.                 */
+/************************************************************/
+bool pipe_configure(const char *spec)
+{
+	uint32_t depth[NUM_STAGES] = { 0 };
+	char copy[128], *name, *save, *p;
+	int s, last = STAGE_IF;
+	size_t len;
+
+	snprintf(copy, sizeof(copy), "%s", spec);
+	for(p = copy; *p != '\0'; p++)
+		if(*p >= 'a' && *p <= 'z')
+			*p -= 'a' - 'A';
+	for(name = strtok_r(copy, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save))
+	{
+		for(s = NUM_STAGES - 1; s >= 0; s--)
+		{
+			len = strlen(PIPE_STAGE_NAMES[s]);
+			if(strncmp(name, PIPE_STAGE_NAMES[s], len) == 0 && strspn(name + len, "0123456789") == strlen(name + len))
+				break;
+		}
+		if(s < last)
+			break;
+		depth[s]++;
+		last = s;
+	}
+	if(name != NULL || depth[STAGE_ID] != 1 || depth[STAGE_WB] != 1 || depth[STAGE_IF] < 1 || depth[STAGE_EX] < 1 ||
+		depth[STAGE_MEM] < 1 || depth[STAGE_IF] > PIPE_MAX_SPLIT || depth[STAGE_EX] > PIPE_MAX_SPLIT ||
+		depth[STAGE_MEM] > PIPE_MAX_SPLIT)
+	{
+		printf("Error: bad stage list '%s', want IF, ID, EX, MEM, WB in order with IF, EX and MEM split at most %d ways\n",
+			spec, PIPE_MAX_SPLIT);
+		return false;
+	}
+	memcpy(PIPE.depth, depth, sizeof(depth));
+	pipe_reset();
+	return true;
+}
+
+/************************************************************/
+/* Empty the inner latches                                                                     */
+/************************************************************/
+void pipe_reset()
+{
+	uint32_t s, k;
+
+	for(s = 0; s < NUM_STAGES; s++)
+		for(k = 0; k < PIPE_MAX_SPLIT - 1; k++)
+			bubble_latch(&PIPE.inner[s][k]);
+	PIPE.fetch_hold = 0;
+}
+
+void pipe_dump()
+{
+	uint32_t s, k, stages = 0;
+
+	printf("Pipeline stages\t\t:");
+	for(s = 0; s < NUM_STAGES; s++)
+	{
+		for(k = 1; k <= pipe_depth(s); k++)
+		{
+			if(pipe_depth(s) > 1)
+				printf(" %s%u", PIPE_STAGE_NAMES[s], k);
+			else
+				printf(" %s", PIPE_STAGE_NAMES[s]);
+			stages++;
+		}
+	}
+	printf(" (%u)%s\n", stages, ENABLE_DELAY_SLOT && stages > 5 ? ", 5 while delay slots are on" : "");
+}
+
+// whether the inner latches still hold an instruction, the unused ones are always bubbles
+static bool pipe_busy(const pipe_stages_t *pipe)
+{
+	uint32_t s, k;
+
+	for(s = 0; s < NUM_STAGES; s++)
+		for(k = 0; k < PIPE_MAX_SPLIT - 1; k++)
+			if(pipe->inner[s][k].IR != 0)
+				return true;
+	return false;
+}
+
+// the stage put its instruction in *out this cycle: move it into the first inner
+// latch and hand *out the one leaving the last
+static void pipe_advance(pipe_stage_t s, CPU_Pipeline_Reg *out)
+{
+	CPU_Pipeline_Reg entering;
+	uint32_t n = pipe_inner(s);
+
+	if(n == 0)
+		return;
+	entering = *out;
+	*out = PIPE.inner[s][n - 1];
+	memmove(&PIPE.inner[s][1], &PIPE.inner[s][0], (n - 1) * sizeof(CPU_Pipeline_Reg));
+	PIPE.inner[s][0] = entering;
+}
+
+static void pipe_flush(pipe_stage_t s)
+{
+	uint32_t k;
+
+	for(k = 0; k < pipe_inner(s); k++)
+		bubble_latch(&PIPE.inner[s][k]);
+}
+
+// a store in EX writes text: whatever IF fetched behind it may be stale, so
+// it is dropped and fetched again, from the oldest of it, once the store has
+// passed the EX sub-stages and written memory in MEM
+static void pipe_refetch_after_store()
+{
+	uint32_t pc = CURRENT_STATE.PC, k;
+
+	for(k = 0; k < pipe_inner(STAGE_IF); k++)
+		if(PIPE.inner[STAGE_IF][k].PC != 0)
+			pc = PIPE.inner[STAGE_IF][k].PC;
+	if(IF_ID.PC != 0)
+		pc = IF_ID.PC;
+	TRACE(TRACE_DETAIL, "Store into text, refetching from 0x%08X \n", pc);
+	bubble_latch(&IF_ID);
+	pipe_flush(STAGE_IF);
+	NEXT_STATE.PC = pc;
+	delay_slot_pending = false;
+	if(PIPE.fetch_hold < pipe_inner(STAGE_EX) + 1)
+		PIPE.fetch_hold = pipe_inner(STAGE_EX) + 1;
+}
+
+// SYSCALL stops the run from EX: the older instructions still in the split MEM
+// and EX stages complete at once, oldest first. MEM skips store_buffer_ready()
+// here, so the buffer goes to memory before each access instead.
+static void pipe_retire_older()
+{
+	CPU_Pipeline_Reg syscall = EX_MEM;
+	uint32_t k;
+
+	for(k = pipe_inner(STAGE_MEM); k-- > 0;)
+	{
+		MEM_WB = PIPE.inner[STAGE_MEM][k];
+		WB();
+	}
+	for(k = pipe_inner(STAGE_EX); k-- > 0;)
+	{
+		EX_MEM = PIPE.inner[STAGE_EX][k];
+		store_buffer_flush();
+		MEM();
+		WB();
+	}
+	EX_MEM = syscall;
+	pipe_reset();
+}
+
+/************************************************************/
+/* maintain the pipeline                                                                                           */ 
+/************************************************************/
+void handle_pipeline()
+{
+	/*INSTRUCTION_COUNT should be incremented when instruction is done*/
+	/*Since we do not have branch/jump instructions, INSTRUCTION_COUNT should be incremented in WB stage */	
+	TRACE(TRACE_STAGE, "|---------------------------------------|\n");
+	TRACE(TRACE_STAGE, "|		cycle			|\n");
+	TRACE(TRACE_STAGE, "| 		PC: 0x%08X		|\n", CURRENT_STATE.PC);
+	TRACE(TRACE_STAGE, "*******************\n");	
+	WB();
+	if(STORE_BUFFER.count != 0)
+		store_buffer_drain();
+	TRACE(TRACE_STAGE, "*******************\n");	
+	if((EX_MEM.loadFlag || EX_MEM.storeFlag) &&
+		!store_buffer_ready(EX_MEM.ALUOutput, mem_access_size(&EX_MEM.D), EX_MEM.storeFlag, EX_MEM.PC))
+	{
+		// MEM waits on the D-cache or the store buffer: it hands WB a bubble and the stages behind it freeze
+		TRACE(TRACE_DETAIL, "D-cache miss 0x%08X, pipeline frozen \n", EX_MEM.ALUOutput);
+		bubble_latch(&MEM_WB);
+		REG_WRITE_MEM_WB = 0;
+		// later MEM sub-stages keep draining
+		pipe_advance(STAGE_MEM, &MEM_WB);
+		return;
+	}
+	MEM();
+	pipe_advance(STAGE_MEM, &MEM_WB);
+	TRACE(TRACE_STAGE, "*******************\n");	
+	EX();
+	if(RUN_FLAG)
+		pipe_advance(STAGE_EX, &EX_MEM);
+	TRACE(TRACE_STAGE, "*******************\n");	
+	ID();
+	TRACE(TRACE_STAGE, "*******************\n");	
+	IF();
+	// a stalled ID keeps IF/ID, and with it everything in front of IF
+	if(stallCounter == 0)
+		pipe_advance(STAGE_IF, &IF_ID);
+	TRACE(TRACE_STAGE, "*******************\n");	
+}
+
+/************************************************************/
+/* writeback (WB) pipeline stage:                                                                          */ 
+/************************************************************/
+void WB()
+{
+	TRACE(TRACE_STAGE, "-Write Back- \n");	
+	const decoded_inst_t *d = &MEM_WB.D;
 
 	//simulating same cycle writeback capability 
 	writeBackValue = MEM_WB.ALUOutput;
 
-	if(MEM_WB.IR != 0)
+	// the instruction is done once it leaves WB
+	if(MEM_WB.IR != 0)
+	{
+		INSTRUCTION_COUNT++;
+		COUNTERS.instructions++;
+		PROFILE_COUNT(MEM_WB.PC, executions);
+	}
+
+	if(MEM_WB.IR != 0 && (d->flags & INST_WRITES_REG))
+	{
+		if(d->flags & INST_LOAD)
+		{
+			// sign extend the narrow loads in place, ID forwards MEM_WB.LMD
+			if(d->op == OP_LB)
+				MEM_WB.LMD = ((MEM_WB.LMD & 0x000000FF) & 0x80) > 0 ? (MEM_WB.LMD | 0xFFFFFF00) : (MEM_WB.LMD & 0x000000FF);
+			else if(d->op == OP_LH)
+				MEM_WB.LMD = ((MEM_WB.LMD & 0x0000FFFF) & 0x8000) > 0 ? (MEM_WB.LMD | 0xFFFF0000) : (MEM_WB.LMD & 0x0000FFFF);
+			writeBackValue = MEM_WB.LMD; //simulating same cycle writeback capability with loads
+		}
+		NEXT_STATE.REGS[d->dest] = writeBackValue;
+
+		if(d->opcode == 0x0)
+			TRACE(TRACE_DETAIL, "register to register writeback \n");
+		else
+			TRACE(TRACE_DETAIL, "%s WRITEBACK 0x%08x \n", MIPS_OP_NAMES[d->op], writeBackValue);
+	}
+
+}
+
+/************************************************************/
+/* memory access (MEM) pipeline stage:                                                          */ 
+/************************************************************/
+void MEM()
+{
+	/*IMPLEMENT THIS*/
+	TRACE(TRACE_STAGE, "-Memory Access- \n");
+
+	// Retrieve the incomming instruction's REG_WRITE status
+	// 	before it is set back to true by defaultin EX() stage	
+	REG_WRITE_MEM_WB = REG_WRITE_EX_MEM;
+
+	// pass along pipeline reg info
+	MEM_WB.PC = EX_MEM.PC;
+	MEM_WB.IR = EX_MEM.IR;
+	MEM_WB.D = EX_MEM.D;
+	MEM_WB.A = EX_MEM.A;
+	MEM_WB.B = EX_MEM.B;
+	MEM_WB.ALUOutput = EX_MEM.ALUOutput;
+
+	// check if the loadflag or the store flag is set to see if we need to access memory
+	// byte and halfword accesses use their native width, WB does the sign extension
+	if(EX_MEM.loadFlag)
+	{
+		TRACE(TRACE_DETAIL, "Memory Load \n");
+		COUNTERS.loads++;
+		MEM_WB.LMD = store_buffer_load(EX_MEM.ALUOutput, mem_access_size(&EX_MEM.D));
+		TRACE(TRACE_DETAIL, "MEM_WB.LMD: 0x%08X \n", MEM_WB.LMD);
+	}
+	else if(EX_MEM.storeFlag)
+	{
+		TRACE(TRACE_DETAIL, "Memory Store \n");
+		COUNTERS.stores++;
+		store_buffer_store(EX_MEM.ALUOutput, mem_access_size(&EX_MEM.D), EX_MEM.B, EX_MEM.PC);
+	}
+	
+
+}
+
+/************************************************************/
+/* ISA semantics, one handler per decoded op.                                      */
+/* r->HI/LO hold the current values on entry, r->ALUOutput the value   */
+/* to leave in place for operations that produce none. Every engine    */
+/* (EX(), the functional interpreter) executes through these.              */
+/************************************************************/
+#define SEM(name) static inline __attribute__((always_inline)) \
+	void sem_##name(const decoded_inst_t *d, uint32_t pc, uint32_t a, uint32_t b, exec_result_t *r)
+
+SEM(INVALID) { }
+SEM(SLL) { r->ALUOutput = a << d->sa; }
+SEM(SRL) { r->ALUOutput = b >> d->sa; }
+SEM(SRA) { r->ALUOutput = (uint32_t)((int32_t)b >> d->sa); }
+SEM(JR) { r->next_pc = a; r->taken = true; }
+SEM(JALR) { r->ALUOutput = pc + 4; r->next_pc = a; r->taken = true; }
+SEM(SYSCALL) { }
+SEM(MFHI) { r->ALUOutput = r->HI; }
+SEM(MTHI) { r->HI = a; r->hilo = EXEC_WRITES_HI; }
+SEM(MFLO) { r->ALUOutput = r->LO; }
+SEM(MTLO) { r->LO = a; r->hilo = EXEC_WRITES_LO; }
+SEM(MULT)
+{
+	int64_t sproduct = (int64_t)(int32_t)a * (int64_t)(int32_t)b;
+	r->LO = ((uint64_t)sproduct & 0X00000000FFFFFFFF);
+	r->HI = ((uint64_t)sproduct & 0XFFFFFFFF00000000)>>32;
+	r->hilo = EXEC_WRITES_HI | EXEC_WRITES_LO;
+}
+SEM(MULTU)
+{
+	uint64_t product = (uint64_t)a * (uint64_t)b;
+	r->LO = (product & 0X00000000FFFFFFFF);
+	r->HI = (product & 0XFFFFFFFF00000000)>>32;
+	r->hilo = EXEC_WRITES_HI | EXEC_WRITES_LO;
+}
+SEM(DIV)
+{
+	if(b != 0)
+	{
+		r->LO = (int32_t)a / (int32_t)b;
+		r->HI = (int32_t)a % (int32_t)b;
+		r->hilo = EXEC_WRITES_HI | EXEC_WRITES_LO;
+	}
+}
+SEM(DIVU)
+{
+	if(b != 0)
+	{
+		r->LO = a / b;
+		r->HI = a % b;
+		r->hilo = EXEC_WRITES_HI | EXEC_WRITES_LO;
+	}
+}
+SEM(ADD) { r->ALUOutput = a + b; }
+SEM(ADDU) { r->ALUOutput = a + b; }
+SEM(SUB) { r->ALUOutput = a - b; }
+SEM(SUBU) { r->ALUOutput = a - b; }
+SEM(AND) { r->ALUOutput = a & b; }
+SEM(OR) { r->ALUOutput = a | b; }
+SEM(XOR) { r->ALUOutput = a ^ b; }
+SEM(NOR) { r->ALUOutput = ~(a | b); }
+SEM(SLT) { r->ALUOutput = a < b ? 0x1 : 0x0; }
+SEM(BLTZ) { if((a & 0x80000000) > 0) { r->next_pc = pc + (d->simm << 2); r->taken = true; } }
+SEM(BGEZ) { if((a & 0x80000000) == 0x0) { r->next_pc = pc + (d->simm << 2); r->taken = true; } }
+SEM(J) { r->next_pc = (pc & 0xF0000000) | (d->target << 2); r->taken = true; }
+SEM(JAL) { r->next_pc = (pc & 0xF0000000) | (d->target << 2); r->taken = true; }
+SEM(BEQ) { if(a == b) { r->next_pc = pc + (d->simm << 2); r->taken = true; } }
+SEM(BNE) { if(a != b) { r->next_pc = pc + (d->simm << 2); r->taken = true; } }
+SEM(BLEZ) { if((a & 0x80000000) > 0 || a == 0) { r->next_pc = pc + (d->simm << 2); r->taken = true; } }
+SEM(BGTZ) { if((a & 0x80000000) == 0x0 || a != 0) { r->next_pc = pc + (d->simm << 2); r->taken = true; } }
+SEM(ADDI) { r->ALUOutput = a + d->simm; }
+SEM(ADDIU) { r->ALUOutput = a + d->simm; }
+SEM(SLTI) { r->ALUOutput = ((int32_t)a - (int32_t)d->simm) < 0 ? 0x1 : 0x0; }
+SEM(ANDI) { r->ALUOutput = a & d->imm; }
+SEM(ORI) { r->ALUOutput = a | d->imm; }
+SEM(XORI) { r->ALUOutput = a ^ d->imm; }
+SEM(LUI) { r->ALUOutput = d->imm << 16; }
+SEM(LB) { r->ALUOutput = a + d->simm; }
+SEM(LH) { r->ALUOutput = a + d->simm; }
+SEM(LW) { r->ALUOutput = a + d->simm; }
+SEM(SB) { r->ALUOutput = a + d->simm; }
+SEM(SH) { r->ALUOutput = a + d->simm; }
+SEM(SW) { r->ALUOutput = a + d->simm; }
+
+/************************************************************/
+/* Execute one decoded instruction through the build's dispatch engine */
+/************************************************************/
+void alu_execute(const decoded_inst_t *d, uint32_t pc, uint32_t a, uint32_t b, exec_result_t *r)
+{
+	r->taken = false;
+	r->hilo = 0;
+
+#ifdef EX_DISPATCH_THREADED
+	/* every op jumps straight to its handler, the op index picked at decode time */
+#define EX_LABEL(name) &&ex_##name,
+#define EX_HANDLER(name) ex_##name: sem_##name(d, pc, a, b, r); return;
+	static void *const handlers[NUM_MIPS_OPS] = { MIPS_OPS(EX_LABEL) };
+	goto *handlers[d->op];
+	MIPS_OPS(EX_HANDLER)
+#undef EX_LABEL
+#undef EX_HANDLER
+#else
+#define EX_HANDLER(name) case OP_##name: sem_##name(d, pc, a, b, r); break;
+	switch(d->op)
+	{
+		MIPS_OPS(EX_HANDLER)
+	}
+#undef EX_HANDLER
+#endif
+}
+
+/************************************************************/
+/* Redirect fetch to a mispredicted branch's real successor without    */
+/* squashing its delay slot: while IF has yet to fetch the slot only   */
+/* the PC it moves on to afterwards changes, otherwise the fetch       */
+/* behind the slot this cycle is dropped.                                           */
+/************************************************************/
+static void delay_slot_redirect(uint32_t next_pc)
+{
+	if(delay_slot_pending)
+		delay_slot_target = next_pc;
+	else
+	{
+		NEXT_STATE.PC = next_pc;
+		early_branch_flag = true;
+	}
+}
+
+/************************************************************/
+/* execution (EX) pipeline stage:                                                                          */ 
+/************************************************************/
+void EX()
+{
+	TRACE(TRACE_STAGE, "-Execution- \n");
+
+	// only retreive new instruction if we aren't stalling
+	EX_MEM.PC = ID_EX.PC;
+	EX_MEM.IR = ID_EX.IR;
+	EX_MEM.D = ID_EX.D;
+		
+	// retrieve from pipeline regs	
+	EX_MEM.A = ID_EX.A;
+	EX_MEM.B = ID_EX.B;
+
+	const decoded_inst_t *d = &ID_EX.D;
+	uint32_t base = delay_slot_base(ID_EX.PC), next_pc;
+	exec_result_t result;
+
+	// set by default
+	EX_MEM.loadFlag = (d->flags & INST_LOAD) != 0;
+	EX_MEM.storeFlag = (d->flags & INST_STORE) != 0;
+	REG_WRITE_EX_MEM = d->op != OP_SW && d->op != OP_SYSCALL;
+
+	// ALU logic 
+	result.ALUOutput = EX_MEM.ALUOutput;
+	result.HI = CURRENT_STATE.HI;
+	result.LO = CURRENT_STATE.LO;
+	alu_execute(d, base, ID_EX.A, ID_EX.B, &result);
+	EX_MEM.ALUOutput = result.ALUOutput;
+	TRACE(TRACE_DETAIL, "%s Result: 0x%08X \n", MIPS_OP_NAMES[d->op], EX_MEM.ALUOutput);
+
+	if(result.hilo & EXEC_WRITES_HI)
+		NEXT_STATE.HI = result.HI;
+	if(result.hilo & EXEC_WRITES_LO)
+		NEXT_STATE.LO = result.LO;
+	// HI/LO hold the result now, ID keeps their readers back until the unit is done
+	if(d->op == OP_MULT || d->op == OP_MULTU || d->op == OP_DIV || d->op == OP_DIVU)
+		mdu_issue(d);
+	if(d->op == OP_JAL)
+		NEXT_STATE.REGS[31] = base + 4;
+	if(d->op == OP_SYSCALL)
+	{
+		// finish the final instruction thats in WB() stage
+		WB();
+		pipe_retire_older();
+		store_buffer_flush();
+		RUN_FLAG = false;
+		INSTRUCTION_COUNT++;
+		COUNTERS.instructions++;
+		COUNTERS.syscalls++;
+		PROFILE_COUNT(ID_EX.PC, executions);
+	}
+
+	// IF already followed the prediction, only a wrong one flushes IF/ID
+	next_pc = result.taken ? result.next_pc : base + 4;
+	if((d->flags & INST_BRANCH) && !ID_EX.pred.resolved)
+		COUNTERS.branches++;
+	if((d->flags & INST_BRANCH) && !ID_EX.pred.resolved &&
+		bp_resolve(d, ID_EX.PC, result.taken, next_pc, &ID_EX.pred))
+	{
+		COUNTERS.branch_flushes++;
+		PROFILE_COUNT(ID_EX.PC, mispredicts);
+		TRACE(TRACE_DETAIL, "Mispredicted, Calculated Jump Addr: 0x%08X \n", next_pc);
+		// the delay slot in ID is not on the wrong path
+		if(ENABLE_DELAY_SLOT)
+			delay_slot_redirect(next_pc);
+		else
+		{
+			NEXT_STATE.PC = next_pc;
+			branch_jump_flag = true;
+			bubble_latch(&ID_EX);
+			// the branch really resolves in the last EX sub-stage
+			PIPE.fetch_hold = pipe_inner(STAGE_EX);
+		}
+	}
+	if((d->flags & INST_STORE) && mem_is_text(EX_MEM.ALUOutput))
+		pipe_refetch_after_store();
+	
+
+}
+
+/************************************************************/
+/* instruction decode (ID) pipeline stage:                                                         */ 
+/************************************************************/
+/************************************************************/
+/* Early branch resolution (ENABLE_EARLY_BRANCH): ID compares the       */
+/* operands and computes the target itself, so a mispredicted branch   */
+/* only loses the fetch slot behind it instead of two.                        */
+/************************************************************/
+
+// Does the instruction held in latch r write reg?
+static inline bool latch_writes(const CPU_Pipeline_Reg *r, uint8_t reg)
+{
+	return r->IR != 0 && (r->D.flags & INST_WRITES_REG) && r->D.dest == reg;
+}
+
+// Value of reg as seen by a branch in ID, false while it is still in flight:
+// an instruction EX just executed is a cycle too late, and a load in MEM/WB
+// (or anything there without forwarding) only reaches the register file in WB.
+static bool id_branch_operand(uint8_t reg, uint32_t *value)
+{
+	const CPU_Pipeline_Reg *r;
+	uint32_t k;
+
+	*value = NEXT_STATE.REGS[reg];
+	if(reg == 0)
+		return true;
+	for(k = 0; k < pipe_inner(STAGE_EX); k++)
+		if(latch_writes(&PIPE.inner[STAGE_EX][k], reg))
+			return false;
+	if(latch_writes(&EX_MEM, reg))
+		return false;
+	// youngest first through the MEM sub-stages, MEM/WB last
+	for(k = 0; k <= pipe_inner(STAGE_MEM); k++)
+	{
+		r = k < pipe_inner(STAGE_MEM) ? &PIPE.inner[STAGE_MEM][k] : &MEM_WB;
+		if(!latch_writes(r, reg))
+			continue;
+		if(!ENABLE_FORWARDING || (r->D.flags & INST_LOAD))
+			return false;
+		*value = r->ALUOutput;
+		return true;
+	}
+	return true;
+}
+
+static void id_resolve_branch()
+{
+	const decoded_inst_t *d = &IF_ID.D;
+	bool reads_rs = d->op != OP_J && d->op != OP_JAL;
+	bool reads_rt = d->op == OP_BEQ || d->op == OP_BNE;
+	exec_result_t result;
+	uint32_t a = 0, b = 0, base = delay_slot_base(IF_ID.PC), next_pc;
+
+	// a bubble, a stalled ID, or a wrong-path instruction EX is flushing
+	if(IF_ID.IR == 0 || !(d->flags & INST_BRANCH) || stallCounter != 0 || branch_jump_flag)
+		return;
+
+	if((reads_rs && !id_branch_operand(d->rs, &a)) || (reads_rt && !id_branch_operand(d->rt, &b)))
+	{
+		TRACE(TRACE_DETAIL, "Branch operand in flight, stalling ID \n");
+		stallCounter = 1;
+		stallCause = STALL_BRANCH;
+		bubble_latch(&ID_EX);
+		return;
+	}
+
+	alu_execute(d, base, a, b, &result);
+	next_pc = result.taken ? result.next_pc : base + 4;
+	COUNTERS.branches++;
+	ID_EX.pred.resolved = true;
+	if(bp_resolve(d, IF_ID.PC, result.taken, next_pc, &IF_ID.pred))
+	{
+		COUNTERS.branch_flushes++;
+		PROFILE_COUNT(IF_ID.PC, mispredicts);
+		TRACE(TRACE_DETAIL, "Mispredicted, resolved in ID: 0x%08X \n", next_pc);
+		// IF has yet to fetch the delay slot, so nothing is lost
+		if(ENABLE_DELAY_SLOT)
+			delay_slot_redirect(next_pc);
+		else
+		{
+			NEXT_STATE.PC = next_pc;
+			early_branch_flag = true;
+		}
+	}
+}
+
+// register-register instructions read both fields, immediates only rs
+static inline bool reads_rs(const decoded_inst_t *d)
+{
+	return d->op != OP_J && d->op != OP_JAL && d->op != OP_LUI && d->op != OP_SYSCALL &&
+		d->op != OP_MFHI && d->op != OP_MFLO;
+}
+
+static inline bool reads_rt(const decoded_inst_t *d)
+{
+	if(d->opcode == 0x0)
+		return d->op != OP_JR && d->op != OP_JALR && d->op != OP_SYSCALL && d->op != OP_MTHI &&
+			d->op != OP_MTLO && d->op != OP_MFHI && d->op != OP_MFLO;
+	return d->op == OP_BEQ || d->op == OP_BNE || (d->flags & INST_STORE);
+}
+
+// what a load returns from the raw memory or store data, sign extended for LB/LH
+static inline uint32_t load_extend(const decoded_inst_t *d, uint32_t raw)
+{
+	if(d->op == OP_LB)
+		return (raw & 0x80) ? (raw | 0xFFFFFF00) : (raw & 0xFF);
+	if(d->op == OP_LH)
+		return (raw & 0x8000) ? (raw | 0xFFFF0000) : (raw & 0xFFFF);
+	return raw;
+}
+
+/************************************************************/
+/* Hazard detection unit. The destination registers still in flight   */
+/* are the scoreboard: EX and MEM have already moved this cycle, so    */
+/* EX/MEM holds the instruction one ahead of ID and MEM/WB the one two */
+/* ahead (plus the inner latches of split stages, see pipe_stages_t),  */
+/* and WB has written the register file. Returns the value of reg for */
+/* the instruction in ID, or the stall cause while it is not           */
+/* available; the youngest producer wins and *source is set like          */
+/* ForwardA/ForwardB.                                                                       */
+/*   with forwarding: ALU results come from any latch past EX, and a  */
+/*   load one ahead costs exactly one bubble (one more per extra MEM  */
+/*   sub-stage), after which its data is in MEM/WB and forwards like   */
+/*   any other result.                                                                          */
+/*   without forwarding: one ahead costs two bubbles, two ahead one. */
+/************************************************************/
+static int hazard_operand(uint8_t reg, uint32_t *value, uint32_t *source)
+{
+	const decoded_inst_t *ex = &EX_MEM.D;
+	const CPU_Pipeline_Reg *r;
+	uint32_t k;
+
+	*value = NEXT_STATE.REGS[reg];
+	*source = 0x00;
+	if(reg == 0)
+		return -1;
+	// still inside a split EX, the result is not out yet
+	for(k = 0; k < pipe_inner(STAGE_EX); k++)
+		if(latch_writes(&PIPE.inner[STAGE_EX][k], reg))
+			return STALL_RAW_EX_MEM;
+	if(latch_writes(&EX_MEM, reg))
+	{
+		if(!ENABLE_FORWARDING)
+			return STALL_RAW_EX_MEM;
+		if(ex->flags & INST_LOAD)
+			return STALL_LOAD_USE;
+		*value = EX_MEM.ALUOutput;
+		*source = 0x10;
+		return -1;
+	}
+	for(k = 0; k <= pipe_inner(STAGE_MEM); k++)
+	{
+		r = k < pipe_inner(STAGE_MEM) ? &PIPE.inner[STAGE_MEM][k] : &MEM_WB;
+		if(!latch_writes(r, reg))
+			continue;
+		if(!ENABLE_FORWARDING)
+			return STALL_RAW_MEM_WB;
+		if(r->D.flags & INST_LOAD)
+		{
+			// the data leaves the last MEM sub-stage, WB sign extends LMD only next cycle
+			if(r != &MEM_WB)
+				return STALL_LOAD_USE;
+			*value = load_extend(&r->D, r->LMD);
+		}
+		else
+			*value = r->ALUOutput;
+		*source = 0x01;
+		return -1;
+	}
+	return -1;
+}
+
+void ID()
+{
+	TRACE(TRACE_STAGE, "-Instruction Decode- \n");
+
+	const decoded_inst_t *d = &IF_ID.D;
+	uint32_t a = 0, b = 0;
+	int cause = -1;
+
+	// Pass PC along for Control instructions
+	ID_EX.PC = IF_ID.PC;
+	ForwardA = ForwardB = 0x00;
+
+	// decrease stall counter if it is set
+	if(stallCounter != 0)
+		stallCounter--;
+
+	// HI/LO are still busy in the multiply/divide unit
+	if(stallCounter == 0 && IF_ID.IR != 0 && mdu_busy(d))
+	{
+		TRACE(TRACE_DETAIL, "Multiply/divide unit busy, stalling ID \n");
+		stallCounter = 1;
+		stallCause = STALL_MDU;
+	}
+
+	// operands come from the register file or are forwarded, otherwise ID holds for a cycle
+	if(stallCounter == 0 && IF_ID.IR != 0)
+	{
+		TRACE(TRACE_DETAIL, "ID Instruction: 0x%08X \n", IF_ID.IR);
+		if(reads_rs(d))
+			cause = hazard_operand(d->rs, &a, &ForwardA);
+		if(cause < 0 && reads_rt(d))
+			cause = hazard_operand(d->rt, &b, &ForwardB);
+		if(cause >= 0)
+		{
+			stallCounter = 1;
+			stallCause = cause;
+		}
+	}
+
+	if(stallCounter != 0)
+	{
+		TRACE(TRACE_DETAIL, "Hazard Detected \n");
+		bubble_latch(&ID_EX);
+	}
+	else
+	{
+		ID_EX.IR = IF_ID.IR;
+		ID_EX.D = IF_ID.D;
+		ID_EX.pred = IF_ID.pred;
+		ID_EX.A = a;
+		ID_EX.B = b;
+		// sign extended immediate comes from the decoder
+		ID_EX.imm = d->simm;
+		if(ForwardA != 0x00 || ForwardB != 0x00)
+		{
+			TRACE(TRACE_DETAIL, "Forwarding... \n");
+			COUNTERS.forward_a_ex_mem += ForwardA == 0x10;
+			COUNTERS.forward_a_mem_wb += ForwardA == 0x01;
+			COUNTERS.forward_b_ex_mem += ForwardB == 0x10;
+			COUNTERS.forward_b_mem_wb += ForwardB == 0x01;
+		}
+	}
+
+	if(ENABLE_EARLY_BRANCH)
+		id_resolve_branch();
+
+	// IF holds the fetch for every cycle the counter is still running
+	if(stallCounter != 0)
+	{
+		COUNTERS.stall_cycles[stallCause]++;
+		PROFILE_COUNT(IF_ID.PC, stall_cycles);
+	}
+
+	/* Branch & Jump Detection Section*/
+	// branches and jumps resolve in EX(), which sets branch_jump_flag
+	if(IF_ID.D.flags & INST_BRANCH) 
+	{
+		TRACE(TRACE_DETAIL, "Branch or Jump Instruction detected: 0x%08X \n", IF_ID.IR);
+	}
+
+
+}
+
+/************************************************************/
+/* instruction fetch (IF) pipeline stage:                                                              */ 
+/************************************************************/
+void IF()
+{
+	// a branch redirected fetch this cycle without a flush, the fetch behind
+	// it is lost (a stalled ID still holds a delay slot in IF/ID)
+	if(early_branch_flag)
+	{
+		early_branch_flag = false;
+		if(stallCounter == 0)
+		{
+			bubble_latch(&IF_ID);
+			IF_ID.PC = 0;
+			pipe_flush(STAGE_IF);
+		}
+		return;
+	}
+	// while draining, hand ID bubbles once it has taken the last instruction
+	// (and the delay slot of the last branch)
+	if(fetch_gated && !delay_slot_pending && stallCounter == 0 && !branch_jump_flag)
+	{
+		bubble_latch(&IF_ID);
+		IF_ID.PC = 0;
+		return;
+	}
+	// a deeper EX resolves a mispredict later, the correct path waits for it
+	if(PIPE.fetch_hold != 0 && stallCounter == 0 && !branch_jump_flag)
+	{
+		PIPE.fetch_hold--;
+		bubble_latch(&IF_ID);
+		IF_ID.PC = 0;
+		return;
+	}
+	if(stallCounter == 0 && !branch_jump_flag)
+	{
+		// an I-cache miss hands ID bubbles and keeps the PC until the line arrives
+		if(!cache_ready(&L1I, CURRENT_STATE.PC, false, CURRENT_STATE.PC))
+		{
+			TRACE(TRACE_DETAIL, "I-cache miss 0x%08X \n", CURRENT_STATE.PC);
+			bubble_latch(&IF_ID);
+			IF_ID.PC = 0;
+			return;
+		}
+		IF_ID.D = *decode_lookup(CURRENT_STATE.PC);
+		IF_ID.IR = IF_ID.D.IR;
+		IF_ID.PC = CURRENT_STATE.PC;
+		TRACE(TRACE_DETAIL, "Current Instruction: 0x%08X \n", IF_ID.IR);
+
+		// increment PC, or follow a predicted branch
+		NEXT_STATE.PC = bp_predict(&IF_ID.D, CURRENT_STATE.PC, &IF_ID.pred);
+
+		// with delay slots the branch's successor waits until its slot is fetched
+		if(delay_slot_pending)
+		{
+			NEXT_STATE.PC = delay_slot_target;
+			delay_slot_pending = false;
+		}
+		else if(ENABLE_DELAY_SLOT && (IF_ID.D.flags & INST_BRANCH))
+		{
+			delay_slot_target = NEXT_STATE.PC;
+			delay_slot_pending = true;
+			NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+		}
+	}
+	// effectively stalling IF there is a branch to be taken
+	if(branch_jump_flag == true)
+	{
+		branch_jump_flag = false;
+		bubble_latch(&IF_ID);
+		IF_ID.PC = 0;
+		pipe_flush(STAGE_IF);
+
+		bubble_latch(&ID_EX);
+	}
+	
+}
+
+
+/************************************************************/
+/* Superscalar pipeline (SS.width > 1), see superscalar_t. Stages run  */
+/* back to front like handle_pipeline(), each moving a whole group.   */
+/************************************************************/
+static ss_class_t ss_class(const decoded_inst_t *d)
+{
+	if(d->flags & (INST_LOAD | INST_STORE))
+		return SS_CLASS_MEM;
+	if(d->flags & INST_BRANCH)
+		return SS_CLASS_BRANCH;
+	if(d->flags & INST_HILO)
+		return SS_CLASS_MDU;
+	if(d->op == OP_SYSCALL)
+		return SS_CLASS_SYSCALL;
+	return SS_CLASS_ALU;
+}
+
+static inline void ss_clear(ss_group_t *g)
+{
+	g->count = 0;
+}
+
+/************************************************************/
+/* Configure the issue width, 1 goes back to the scalar pipeline         */
+/************************************************************/
+bool ss_configure(const char *spec)
+{
+	char *end;
+	unsigned long width = strtoul(spec, &end, 0);
+
+	if(*end != '\0' || width < 1 || width > SS_MAX_WIDTH)
+	{
+		printf("Error: issue width is 1-%d, not '%s'\n", SS_MAX_WIDTH, spec);
+		return false;
+	}
+	SS.width = width;
+	// one ALU per slot, one D-cache port, one branch unit, one multiply/divide unit
+	SS.limit[SS_CLASS_ALU] = width;
+	SS.limit[SS_CLASS_MEM] = 1;
+	SS.limit[SS_CLASS_BRANCH] = 1;
+	SS.limit[SS_CLASS_MDU] = 1;
+	SS.limit[SS_CLASS_SYSCALL] = 1;
+	ss_reset();
+	return true;
+}
+
+/************************************************************/
+/* Empty the group latches and clear the statistics                             */
+/************************************************************/
+void ss_reset()
+{
+	if(SS.width == 0)
+		SS.width = 1;
+	ss_clear(&SS.if_id);
+	ss_clear(&SS.id_ex);
+	ss_clear(&SS.ex_mem);
+	ss_clear(&SS.mem_wb);
+	SS.redirect = false;
+	memset(SS.issued, 0, sizeof(SS.issued));
+	SS.dependency_splits = SS.structural_splits = 0;
+}
+
+static void ss_writeback(ss_slot_t *s)
+{
+	if(s->dest != 0)
+		NEXT_STATE.REGS[s->dest] = s->value;
+	INSTRUCTION_COUNT++;
+	COUNTERS.instructions++;
+	PROFILE_COUNT(s->pc, executions);
+}
+
+static void ss_memory(ss_slot_t *s)
+{
+	uint32_t address = s->value;
+
+	switch(s->d.op)
+	{
+		case OP_LB:
+			s->value = store_buffer_load(address, 1);
+			s->value = (s->value & 0x80) ? (s->value | 0xFFFFFF00) : s->value;
+			break;
+		case OP_LH:
+			s->value = store_buffer_load(address, 2);
+			s->value = (s->value & 0x8000) ? (s->value | 0xFFFF0000) : s->value;
+			break;
+		case OP_LW:
+			s->value = store_buffer_load(address, 4);
+			break;
+		case OP_SB: case OP_SH: case OP_SW:
+			store_buffer_store(address, mem_access_size(&s->d), s->b, s->pc);
+			break;
+		default:
+			return;
+	}
+	if(s->d.flags & INST_LOAD)
+		COUNTERS.loads++;
+	else
+		COUNTERS.stores++;
+}
+
+static void ss_wb()
+{
+	uint32_t k;
+
+	for(k = 0; k < SS.mem_wb.count; k++)
+		ss_writeback(&SS.mem_wb.slot[k]);
+	ss_clear(&SS.mem_wb);
+}
+
+// false while the group's memory access waits on the D-cache or the store buffer
+static bool ss_mem()
+{
+	ss_slot_t *s;
+	uint32_t k;
+
+	for(k = 0; k < SS.ex_mem.count; k++)
+	{
+		s = &SS.ex_mem.slot[k];
+		if((s->d.flags & (INST_LOAD | INST_STORE)) &&
+			!store_buffer_ready(s->value, mem_access_size(&s->d), (s->d.flags & INST_STORE) != 0, s->pc))
+			return false;
+	}
+	for(k = 0; k < SS.ex_mem.count; k++)
+		ss_memory(&SS.ex_mem.slot[k]);
+	SS.mem_wb = SS.ex_mem;
+	ss_clear(&SS.ex_mem);
+	return true;
+}
+
+static void ss_ex()
+{
+	ss_slot_t *s;
+	exec_result_t result;
+	uint32_t k, next_pc;
+
+	for(k = 0; k < SS.id_ex.count; k++)
 	{
-		// If opcode = 0, its a register register writeback scenario
-		if(opcode == 0x0)
+		s = &SS.ex_mem.slot[SS.ex_mem.count++];
+		*s = SS.id_ex.slot[k];
+
+		result.ALUOutput = 0;
+		result.HI = NEXT_STATE.HI;
+		result.LO = NEXT_STATE.LO;
+		alu_execute(&s->d, s->pc, s->a, s->b, &result);
+		s->value = s->d.op == OP_JAL ? s->pc + 4 : result.ALUOutput;
+		if(result.hilo & EXEC_WRITES_HI)
+			NEXT_STATE.HI = result.HI;
+		if(result.hilo & EXEC_WRITES_LO)
+			NEXT_STATE.LO = result.LO;
+		if(s->d.op == OP_MULT || s->d.op == OP_MULTU || s->d.op == OP_DIV || s->d.op == OP_DIVU)
+			mdu_issue(&s->d);
+
+		if(s->d.op == OP_SYSCALL)
 		{
-			// for mult -> divu, MTHI & MTLO, or JR DONT write back to register files!
-			if(!(0x18 <= function && function <= 0x1B) && !(function == 0x11 || function == 0x13 || function == 0x08 ))
+			// finish everything older, like the scalar pipeline does
+			ss_wb();
+			for(k = 0; k + 1 < SS.ex_mem.count; k++)
 			{
-				printf("register to register writeback \n");
-				NEXT_STATE.REGS[rd] = MEM_WB.ALUOutput;
+				ss_memory(&SS.ex_mem.slot[k]);
+				ss_writeback(&SS.ex_mem.slot[k]);
 			}
-			
+			store_buffer_flush();
+			ss_clear(&SS.ex_mem);
+			ss_clear(&SS.id_ex);
+			ss_clear(&SS.if_id);
+			RUN_FLAG = false;
+			INSTRUCTION_COUNT++;
+			COUNTERS.instructions++;
+			COUNTERS.syscalls++;
+			PROFILE_COUNT(s->pc, executions);
+			return;
 		}
-		else // non-reg-reg writeback scenario
+
+		if(s->d.flags & INST_BRANCH)
 		{
-			switch (opcode)
+			next_pc = result.taken ? result.next_pc : s->pc + 4;
+			COUNTERS.branches++;
+			if(bp_resolve(&s->d, s->pc, result.taken, next_pc, &s->pred))
 			{
-				case 0x08:  // ADDI
-					NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-					printf("ADDI WRITEBACK \n");
-					break;
-				case 0x09: //ADDIU
-					NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-					printf("ADDIU WRITEBACK \n");
-					break;
-				case 0x0E: //XORI
-					NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-					printf("XORI WRITEBACK \n");
-					break;
-				case 0x0F: //LUI 
-					NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-					printf("LUI WRITEBACK \n");
-					break;
-				case 0x23: //LW
-					NEXT_STATE.REGS[rt] = MEM_WB.LMD;
-					writeBackValue = MEM_WB.LMD; //simulating same cycle writeback capability with LW
-					printf("LW WRITEBACK \n");
-					break;
-				case 0x0D: //ORI
-					NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-					printf("ORI WRITEBACK \n");
-					break;
-				case 0x0C: //ANDI
-					NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-					printf("ANDI WRITEBACK \n");
-					break;
-				case 0x20: //LB
-					MEM_WB.LMD = ((MEM_WB.LMD & 0x000000FF) & 0x80) > 0 ? (MEM_WB.LMD | 0xFFFFFF00) : (MEM_WB.LMD & 0x000000FF);
-					NEXT_STATE.REGS[rt] = MEM_WB.LMD;
-					writeBackValue = MEM_WB.LMD;
-					printf("LB WRITEBACK \n");
-					printf("LB = 0x%08x \n", writeBackValue);
-					break;
-				case 0x21: //LH
-					MEM_WB.LMD = ((MEM_WB.LMD & 0x0000FFFF) & 0x8000) > 0 ? (MEM_WB.LMD | 0xFFFF0000) : (MEM_WB.LMD & 0x0000FFFF);
-					NEXT_STATE.REGS[rt] = MEM_WB.LMD;
-					writeBackValue = MEM_WB.LMD;
-					printf("LH WRITEBACK \n");
-					break;
+				// younger slots of this group and everything fetched behind it are wrong-path
+				TRACE(TRACE_DETAIL, "Mispredicted, Calculated Jump Addr: 0x%08X \n", next_pc);
+				COUNTERS.branch_flushes++;
+				PROFILE_COUNT(s->pc, mispredicts);
+				NEXT_STATE.PC = next_pc;
+				ss_clear(&SS.if_id);
+				SS.redirect = true;
+				break;
+			}
+		}
 
-				case 0x0A: //SLTI
-					NEXT_STATE.REGS[rt] = MEM_WB.ALUOutput;
-					printf("SLTI WRITEBACK \n");
-					break;
+		// a store into text: the slots behind it may hold the old words, fetch
+		// them again from the oldest once MEM has written the store next cycle
+		if((s->d.flags & INST_STORE) && mem_is_text(s->value))
+		{
+			TRACE(TRACE_DETAIL, "Store into text, refetching \n");
+			NEXT_STATE.PC = k + 1 < SS.id_ex.count ? SS.id_ex.slot[k + 1].pc :
+				SS.if_id.count != 0 ? SS.if_id.slot[0].pc : CURRENT_STATE.PC;
+			ss_clear(&SS.if_id);
+			SS.redirect = true;
+			break;
+		}
+	}
+	ss_clear(&SS.id_ex);
+}
+
+// Value of reg for an instruction leaving ID, or the stall cause while it is
+// still in flight. The youngest producer wins, forwarding sets *source like
+// ForwardA/ForwardB.
+static int ss_operand(uint8_t reg, uint32_t *value, uint32_t *source)
+{
+	const ss_slot_t *s;
+	int k;
+
+	*value = NEXT_STATE.REGS[reg];
+	*source = 0x00;
+	if(reg == 0)
+		return -1;
+	for(k = SS.ex_mem.count - 1; k >= 0; k--)
+	{
+		s = &SS.ex_mem.slot[k];
+		if(s->dest != reg)
+			continue;
+		if(!ENABLE_FORWARDING)
+			return STALL_RAW_EX_MEM;
+		if(s->d.flags & INST_LOAD)
+			return STALL_LOAD_USE;
+		*value = s->value;
+		*source = 0x10;
+		return -1;
+	}
+	for(k = SS.mem_wb.count - 1; k >= 0; k--)
+	{
+		s = &SS.mem_wb.slot[k];
+		if(s->dest != reg)
+			continue;
+		if(!ENABLE_FORWARDING)
+			return STALL_RAW_MEM_WB;
+		*value = s->value;
+		*source = 0x01;
+		return -1;
+	}
+	return -1;
+}
+
+static void ss_id()
+{
+	uint32_t used[NUM_SS_CLASSES] = { 0 };
+	uint32_t written = 0, issued = 0, source_a, source_b, a, b;
+	int cause = -1;
+	ss_slot_t *s;
+	ss_class_t cls;
+
+	while(issued < SS.if_id.count)
+	{
+		s = &SS.if_id.slot[issued];
+		cls = ss_class(&s->d);
+		if((reads_rs(&s->d) && (written & (1u << s->d.rs))) ||
+		   (reads_rt(&s->d) && (written & (1u << s->d.rt))))
+		{
+			SS.dependency_splits++;
+			break;
+		}
+		if(used[cls] == SS.limit[cls])
+		{
+			SS.structural_splits++;
+			break;
+		}
+		if(mdu_busy(&s->d))
+		{
+			cause = STALL_MDU;
+			break;
+		}
+		a = b = 0;
+		source_a = source_b = 0x00;
+		if(reads_rs(&s->d) && (cause = ss_operand(s->d.rs, &a, &source_a)) >= 0)
+			break;
+		if(reads_rt(&s->d) && (cause = ss_operand(s->d.rt, &b, &source_b)) >= 0)
+			break;
+
+		s->a = a;
+		s->b = b;
+		s->dest = (s->d.flags & INST_WRITES_REG) ? s->d.dest : (s->d.op == OP_JAL ? 31 : 0);
+		COUNTERS.forward_a_ex_mem += source_a == 0x10;
+		COUNTERS.forward_a_mem_wb += source_a == 0x01;
+		COUNTERS.forward_b_ex_mem += source_b == 0x10;
+		COUNTERS.forward_b_mem_wb += source_b == 0x01;
+		SS.id_ex.slot[SS.id_ex.count++] = *s;
+		if(s->dest != 0)
+			written |= 1u << s->dest;
+		used[cls]++;
+		issued++;
+	}
+
+	// what did not issue moves to the front and waits for the next cycle
+	memmove(SS.if_id.slot, SS.if_id.slot + issued, (SS.if_id.count - issued) * sizeof(ss_slot_t));
+	SS.if_id.count -= issued;
+	SS.issued[issued]++;
+	if(issued == 0 && cause >= 0)
+	{
+		COUNTERS.stall_cycles[cause]++;
+		PROFILE_COUNT(SS.if_id.slot[0].pc, stall_cycles);
+	}
+}
+
+static void ss_if()
+{
+	uint32_t pc = CURRENT_STATE.PC, next_pc;
+	ss_slot_t *s;
+
+	// a redirect costs this cycle's fetch, and ID takes a new group only once
+	// the last one has fully issued
+	if(SS.redirect)
+	{
+		SS.redirect = false;
+		return;
+	}
+	if(fetch_gated || SS.if_id.count != 0 || !cache_ready(&L1I, pc, false, pc))
+		return;
+
+	while(SS.if_id.count < SS.width)
+	{
+		// a group never spans two I-cache lines
+		if(SS.if_id.count != 0 && L1I.enabled && (pc >> L1I.line_shift) != (CURRENT_STATE.PC >> L1I.line_shift))
+			break;
+		s = &SS.if_id.slot[SS.if_id.count++];
+		s->pc = pc;
+		s->d = *decode_lookup(pc);
+		TRACE(TRACE_DETAIL, "Fetch slot %u: 0x%08X \n", SS.if_id.count - 1, s->d.IR);
+		next_pc = bp_predict(&s->d, pc, &s->pred);
+		pc = next_pc;
+		if(next_pc != s->pc + 4)
+			break;
+	}
+	NEXT_STATE.PC = pc;
+}
+
+void ss_pipeline()
+{
+	TRACE(TRACE_STAGE, "| 		PC: 0x%08X (%u-wide)	|\n", CURRENT_STATE.PC, SS.width);
+	ss_wb();
+	if(STORE_BUFFER.count != 0)
+		store_buffer_drain();
+	if(!ss_mem())
+	{
+		// the D-cache freezes MEM and every stage behind it
+		TRACE(TRACE_DETAIL, "D-cache miss, pipeline frozen \n");
+		return;
+	}
+	ss_ex();
+	if(RUN_FLAG == FALSE)
+		return;
+	ss_id();
+	ss_if();
+}
+
+void ss_dump(const superscalar_t *ss, const sim_counters_t *c)
+{
+	uint32_t n;
+
+	printf("Issue width\t\t: %u (IPC %.3f)\n", ss->width, c->cycles ? (double)c->instructions / c->cycles : 0.0);
+	printf("  cycles issuing\t:");
+	for(n = 0; n <= ss->width; n++)
+		printf(" %u: %llu", n, (unsigned long long)ss->issued[n]);
+	printf("\n");
+	printf("  groups split\t\t: %llu by dependences, %llu by pairing\n",
+		(unsigned long long)ss->dependency_splits, (unsigned long long)ss->structural_splits);
+}
+
+/************************************************************/
+/* Out-of-order engine (OOO.rob_entries != 0), see ooo_t. Each cycle  */
+/* retires, runs the load port, issues, renames and fetches, in that  */
+/* order, so a result is used at the earliest the cycle after.           */
+/************************************************************/
+static inline uint16_t ooo_index(uint32_t n)
+{
+	return (OOO.head + n) % OOO.rob_entries;
+}
+
+// the n-th oldest entry in flight
+static inline ooo_entry_t *ooo_entry(uint32_t n)
+{
+	return &OOO.rob[ooo_index(n)];
+}
+
+static inline bool ooo_is_mdu(const decoded_inst_t *d)
+{
+	return d->op == OP_MULT || d->op == OP_MULTU || d->op == OP_DIV || d->op == OP_DIVU;
+}
+
+static inline uint32_t ooo_size(const decoded_inst_t *d)
+{
+	return (d->op == OP_LB || d->op == OP_SB) ? 1 : (d->op == OP_LH || d->op == OP_SH) ? 2 : 4;
+}
+
+static inline bool ooo_done(const ooo_entry_t *e)
+{
+	return e->issued && COUNTERS.cycles >= e->ready && (e->loaded || !(e->d.flags & INST_LOAD));
+}
+
+/************************************************************/
+/* Configure from "<rob>[:<rs>[:<lsq>[:<width>]]]", or "off" to go back  */
+/* to the in-order pipelines. The stations and the queue default to     */
+/* half the ROB and the width to 4.                                                          */
+/************************************************************/
+bool ooo_configure(const char *spec)
+{
+	char *end;
+	unsigned long rob, rs, lsq, width = 4;
+
+	if(strcmp(spec, "off") == 0)
+	{
+		ooo_release();
+		OOO.rob_entries = 0;
+		return true;
+	}
+	rob = strtoul(spec, &end, 0);
+	rs = lsq = rob / 2;
+	if(*end == ':')
+		rs = strtoul(end + 1, &end, 0);
+	if(*end == ':')
+		lsq = strtoul(end + 1, &end, 0);
+	if(*end == ':')
+		width = strtoul(end + 1, &end, 0);
+	if(*end != '\0' || rob < 2 || rob > OOO_MAX_ENTRIES || rs < 1 || rs > rob || lsq < 1 || lsq > rob ||
+	   width < 1 || width > SS_MAX_WIDTH)
+	{
+		printf("Error: bad out-of-order core '%s', want <rob>[:<rs>[:<lsq>[:<width>]]] or off, "
+			"a ROB of 2-%d entries, stations and queue no larger, width 1-%d\n", spec, OOO_MAX_ENTRIES, SS_MAX_WIDTH);
+		return false;
+	}
+	ooo_release();
+	OOO.rob = calloc(rob, sizeof(ooo_entry_t));
+	if(OOO.rob == NULL)
+	{
+		printf("Error: out of memory for a %lu-entry ROB\n", rob);
+		OOO.rob_entries = 0;
+		return false;
+	}
+	OOO.rob_entries = rob;
+	OOO.rs_entries = rs;
+	OOO.lsq_entries = lsq;
+	OOO.width = width;
+	ooo_reset();
+	return true;
+}
+
+/************************************************************/
+/* Empty the core, fetch restarts at CURRENT_STATE.PC, and clear the */
+/* statistics                                                                                       */
+/************************************************************/
+void ooo_reset()
+{
+	uint32_t k;
+
+	OOO.head = OOO.count = 0;
+	OOO.rs_used = OOO.lsq_used = 0;
+	for(k = 0; k < OOO_NUM_REGS; k++)
+		OOO.rat[k] = OOO_NO_ENTRY;
+	for(k = 0; k < OOO.rob_entries; k++)
+		OOO.rob[k].seq = 0;
+	OOO.next_seq = 1;
+	ss_clear(&OOO.fetched);
+	OOO.resync = true;
+	OOO.redirect = false;
+	memset(OOO.issued, 0, sizeof(OOO.issued));
+	OOO.rob_full = OOO.rs_full = OOO.lsq_full = 0;
+	OOO.occupancy = OOO.load_forwards = OOO.squashed = 0;
+}
+
+void ooo_release()
+{
+	free(OOO.rob);
+	OOO.rob = NULL;
+}
+
+// point the rename table at entry idx for everything it writes
+static void ooo_rename_dest(uint16_t idx)
+{
+	const ooo_entry_t *e = &OOO.rob[idx];
+
+	if(e->dest != 0)
+		OOO.rat[e->dest] = idx;
+	if(e->hilo & EXEC_WRITES_HI)
+		OOO.rat[OOO_HI] = idx;
+	if(e->hilo & EXEC_WRITES_LO)
+		OOO.rat[OOO_LO] = idx;
+}
+
+// drop every entry younger than the keep oldest and rebuild the rename table
+static void ooo_squash(uint32_t keep)
+{
+	ooo_entry_t *e;
+	uint32_t k;
+
+	while(OOO.count > keep)
+	{
+		e = ooo_entry(OOO.count - 1);
+		if(e->in_rs)
+			OOO.rs_used--;
+		if(e->d.flags & (INST_LOAD | INST_STORE))
+			OOO.lsq_used--;
+		e->seq = 0;
+		OOO.count--;
+		OOO.squashed++;
+	}
+	for(k = 0; k < OOO_NUM_REGS; k++)
+		OOO.rat[k] = OOO_NO_ENTRY;
+	for(k = 0; k < OOO.count; k++)
+		ooo_rename_dest(ooo_index(k));
+}
+
+// Source k of e, false while its producer is still executing. A producer
+// that has retired left the value in the register file.
+static bool ooo_operand(const ooo_entry_t *e, int k, uint32_t *value)
+{
+	const ooo_entry_t *p;
+	uint8_t reg = e->src[k];
+
+	if(e->producer[k] != OOO_NO_ENTRY)
+	{
+		p = &OOO.rob[e->producer[k]];
+		if(p->seq == e->producer_seq[k])
+		{
+			if(!ooo_done(p))
+				return false;
+			*value = reg == OOO_HI ? p->hi : (reg == OOO_LO ? p->lo : p->value);
+			return true;
+		}
+	}
+	*value = reg == OOO_HI ? NEXT_STATE.HI : (reg == OOO_LO ? NEXT_STATE.LO : NEXT_STATE.REGS[reg]);
+	return true;
+}
+
+// Retire in order into NEXT_STATE and memory, true when a store used
+// the D-cache port this cycle.
+static bool ooo_retire()
+{
+	ooo_entry_t *e;
+	uint32_t n;
+	bool port = false;
+
+	for(n = 0; n < OOO.width && OOO.count != 0; n++)
+	{
+		e = &OOO.rob[OOO.head];
+		if(!ooo_done(e))
+			break;
+		if(e->d.flags & INST_STORE)
+		{
+			port = true;
+			if(!cache_ready(&L1D, e->address, true, e->pc))
+				break;
+			if(e->d.op == OP_SB)
+				mem_write_8(e->address, e->b);
+			else if(e->d.op == OP_SH)
+				mem_write_16(e->address, e->b);
+			else
+				mem_write_32(e->address, e->b);
+			COUNTERS.stores++;
+			// a store into text: everything younger may have been fetched from the old words
+			if(mem_is_text(e->address))
+			{
+				TRACE(TRACE_DETAIL, "Store into text, refetching from 0x%08X \n", e->pc + 4);
+				ooo_squash(1);
+				ss_clear(&OOO.fetched);
+				OOO.fetch_pc = e->pc + 4;
+				OOO.redirect = true;
+			}
+		}
+		else if(e->d.flags & INST_LOAD)
+			COUNTERS.loads++;
+		TRACE(TRACE_DETAIL, "Retire 0x%08X: 0x%08X \n", e->pc, e->d.IR);
+		INSTRUCTION_COUNT++;
+		COUNTERS.instructions++;
+		PROFILE_COUNT(e->pc, executions);
+
+		if(e->d.op == OP_SYSCALL)
+		{
+			// stop where the functional model stops, on the SYSCALL
+			NEXT_STATE.PC = e->pc;
+			COUNTERS.syscalls++;
+			ooo_squash(1);
+			e->seq = 0;
+			OOO.head = (OOO.head + 1) % OOO.rob_entries;
+			OOO.count = 0;
+			ss_clear(&OOO.fetched);
+			RUN_FLAG = false;
+			return port;
+		}
+
+		if(e->dest != 0)
+			NEXT_STATE.REGS[e->dest] = e->value;
+		if(e->hilo & EXEC_WRITES_HI)
+			NEXT_STATE.HI = e->hi;
+		if(e->hilo & EXEC_WRITES_LO)
+			NEXT_STATE.LO = e->lo;
+		NEXT_STATE.PC = e->next_pc;
+		if(e->d.flags & INST_BRANCH)
+		{
+			COUNTERS.branches++;
+			COUNTERS.branch_flushes += e->mispredicted;
+			if(e->mispredicted)
+				PROFILE_COUNT(e->pc, mispredicts);
+		}
+
+		if(e->dest != 0 && OOO.rat[e->dest] == OOO.head)
+			OOO.rat[e->dest] = OOO_NO_ENTRY;
+		if(OOO.rat[OOO_HI] == OOO.head)
+			OOO.rat[OOO_HI] = OOO_NO_ENTRY;
+		if(OOO.rat[OOO_LO] == OOO.head)
+			OOO.rat[OOO_LO] = OOO_NO_ENTRY;
+		if(e->d.flags & (INST_LOAD | INST_STORE))
+			OOO.lsq_used--;
+		e->seq = 0;
+		OOO.head = (OOO.head + 1) % OOO.rob_entries;
+		OOO.count--;
+	}
+	return port;
+}
+
+// The load port: the oldest load that may go reads memory or takes the
+// data of the youngest older store to the same address and size. No load
+// passes a store whose address is still unknown, and one that partly
+// overlaps an older store waits for it to retire.
+static void ooo_load()
+{
+	const ooo_entry_t *s;
+	ooo_entry_t *e;
+	uint32_t n, k, size;
+	bool blocked;
+
+	for(n = 0; n < OOO.count; n++)
+	{
+		e = ooo_entry(n);
+		if((e->d.flags & INST_STORE) && !e->issued)
+			return;
+		if(!(e->d.flags & INST_LOAD) || !e->issued || e->loaded || COUNTERS.cycles < e->ready)
+			continue;
+
+		size = ooo_size(&e->d);
+		blocked = false;
+		for(k = n; k-- > 0; )
+		{
+			s = ooo_entry(k);
+			if(!(s->d.flags & INST_STORE) || s->address >= e->address + size || e->address >= s->address + ooo_size(&s->d))
+				continue;
+			if(s->address == e->address && ooo_size(&s->d) == size)
+			{
+				e->value = load_extend(&e->d, s->b);
+				e->loaded = true;
+				e->ready = COUNTERS.cycles + 1;
+				OOO.load_forwards++;
+				TRACE(TRACE_DETAIL, "Forward store 0x%08X to load 0x%08X \n", s->pc, e->pc);
+				return;
+			}
+			blocked = true;
+			break;
+		}
+		if(blocked)
+			continue;
+
+		if(!cache_ready(&L1D, e->address, false, e->pc))
+			return;
+		if(e->d.op == OP_LB)
+			e->value = load_extend(&e->d, mem_read_8(e->address));
+		else if(e->d.op == OP_LH)
+			e->value = load_extend(&e->d, mem_read_16(e->address));
+		else
+			e->value = mem_read_32(e->address);
+		e->loaded = true;
+		e->ready = COUNTERS.cycles + 1;
+		return;
+	}
+}
+
+// Issue up to width of the oldest instructions whose operands are ready.
+// Branches resolve here and a mispredict squashes everything younger.
+static void ooo_issue()
+{
+	ooo_entry_t *e;
+	exec_result_t result;
+	uint32_t n, issued = 0, a, b, hi, lo;
 
+	for(n = 0; n < OOO.count && issued < OOO.width; n++)
+	{
+		e = ooo_entry(n);
+		if(!e->in_rs || !ooo_operand(e, 0, &a) || !ooo_operand(e, 1, &b) ||
+			!ooo_operand(e, 2, &hi) || !ooo_operand(e, 3, &lo))
+			continue;
+		// the multiply/divide unit is not pipelined
+		if(ooo_is_mdu(&e->d) && COUNTERS.cycles < MDU.ready)
+			continue;
+
+		e->in_rs = false;
+		OOO.rs_used--;
+		e->issued = true;
+		issued++;
+
+		result.ALUOutput = 0;
+		// MFHI/MFLO read their renamed source, a divide by zero passes the old HI/LO on
+		result.HI = e->src[2] != 0 ? hi : a;
+		result.LO = e->src[3] != 0 ? lo : a;
+		alu_execute(&e->d, e->pc, a, b, &result);
+		e->a = a;
+		e->b = b;
+		e->value = e->d.op == OP_JAL ? e->pc + 4 : result.ALUOutput;
+		e->address = result.ALUOutput;
+		e->hi = result.HI;
+		e->lo = result.LO;
+		e->ready = COUNTERS.cycles + 1;
+		if(ooo_is_mdu(&e->d))
+		{
+			mdu_issue(&e->d);
+			e->ready = MDU.ready;
+		}
+		e->next_pc = e->pc + 4;
+		TRACE(TRACE_DETAIL, "Issue 0x%08X: 0x%08X \n", e->pc, e->d.IR);
+
+		if(e->d.flags & INST_BRANCH)
+		{
+			e->next_pc = result.taken ? result.next_pc : e->pc + 4;
+			if(bp_resolve(&e->d, e->pc, result.taken, e->next_pc, &e->pred))
+			{
+				TRACE(TRACE_DETAIL, "Mispredicted, Calculated Jump Addr: 0x%08X \n", e->next_pc);
+				e->mispredicted = true;
+				ooo_squash(n + 1);
+				ss_clear(&OOO.fetched);
+				OOO.fetch_pc = e->next_pc;
+				OOO.redirect = true;
 			}
 		}
 	}
+	OOO.issued[issued]++;
+}
+
+// Rename fetched instructions into the ROB, a station each and a queue
+// entry for loads and stores, stopping at the first that does not fit.
+static void ooo_rename()
+{
+	const ss_slot_t *s;
+	ooo_entry_t *e;
+	uint32_t n = 0, k;
+	uint16_t idx;
+	bool mem;
+
+	while(n < OOO.fetched.count && n < OOO.width)
+	{
+		s = &OOO.fetched.slot[n];
+		mem = (s->d.flags & (INST_LOAD | INST_STORE)) != 0;
+		if(OOO.count == OOO.rob_entries)
+		{
+			OOO.rob_full++;
+			break;
+		}
+		if(OOO.rs_used == OOO.rs_entries)
+		{
+			OOO.rs_full++;
+			break;
+		}
+		if(mem && OOO.lsq_used == OOO.lsq_entries)
+		{
+			OOO.lsq_full++;
+			break;
+		}
+
+		idx = ooo_index(OOO.count);
+		e = &OOO.rob[idx];
+		memset(e, 0, sizeof(*e));
+		e->seq = OOO.next_seq++;
+		e->pc = s->pc;
+		e->d = s->d;
+		e->pred = s->pred;
+		e->src[0] = s->d.op == OP_MFHI ? OOO_HI : (s->d.op == OP_MFLO ? OOO_LO : (reads_rs(&s->d) ? s->d.rs : 0));
+		e->src[1] = reads_rt(&s->d) ? s->d.rt : 0;
+		e->src[2] = (s->d.op == OP_DIV || s->d.op == OP_DIVU) ? OOO_HI : 0;
+		e->src[3] = (s->d.op == OP_DIV || s->d.op == OP_DIVU) ? OOO_LO : 0;
+		for(k = 0; k < OOO_SOURCES; k++)
+		{
+			e->producer[k] = e->src[k] == 0 ? OOO_NO_ENTRY : OOO.rat[e->src[k]];
+			if(e->producer[k] != OOO_NO_ENTRY)
+				e->producer_seq[k] = OOO.rob[e->producer[k]].seq;
+		}
+		e->dest = (s->d.flags & INST_WRITES_REG) ? s->d.dest : (s->d.op == OP_JAL ? 31 : 0);
+		e->hilo = ooo_is_mdu(&s->d) ? (EXEC_WRITES_HI | EXEC_WRITES_LO) :
+			(s->d.op == OP_MTHI ? EXEC_WRITES_HI : (s->d.op == OP_MTLO ? EXEC_WRITES_LO : 0));
+		e->in_rs = true;
+		OOO.rs_used++;
+		if(mem)
+			OOO.lsq_used++;
+		OOO.count++;
+		ooo_rename_dest(idx);
+		n++;
+	}
+
+	memmove(OOO.fetched.slot, OOO.fetched.slot + n, (OOO.fetched.count - n) * sizeof(ss_slot_t));
+	OOO.fetched.count -= n;
+}
+
+// fetch like ss_if(), from the engine's own speculative PC
+static void ooo_fetch()
+{
+	uint32_t pc, next_pc;
+	ss_slot_t *s;
+
+	if(OOO.resync)
+	{
+		OOO.fetch_pc = CURRENT_STATE.PC;
+		OOO.resync = false;
+	}
+	if(OOO.redirect)
+	{
+		OOO.redirect = false;
+		return;
+	}
+	pc = OOO.fetch_pc;
+	if(fetch_gated || OOO.fetched.count != 0 || !cache_ready(&L1I, pc, false, pc))
+		return;
+
+	while(OOO.fetched.count < OOO.width)
+	{
+		if(OOO.fetched.count != 0 && L1I.enabled && (pc >> L1I.line_shift) != (OOO.fetch_pc >> L1I.line_shift))
+			break;
+		s = &OOO.fetched.slot[OOO.fetched.count++];
+		s->pc = pc;
+		s->d = *decode_lookup(pc);
+		TRACE(TRACE_DETAIL, "Fetch slot %u: 0x%08X \n", OOO.fetched.count - 1, s->d.IR);
+		next_pc = bp_predict(&s->d, pc, &s->pred);
+		pc = next_pc;
+		if(next_pc != s->pc + 4)
+			break;
+	}
+	OOO.fetch_pc = pc;
+}
+
+void ooo_cycle()
+{
+	TRACE(TRACE_STAGE, "| 		PC: 0x%08X (ROB %u/%u)	|\n", CURRENT_STATE.PC, OOO.count, OOO.rob_entries);
+	OOO.occupancy += OOO.count;
+	if(!ooo_retire())
+		ooo_load();
+	if(RUN_FLAG == FALSE)
+		return;
+	ooo_issue();
+	ooo_rename();
+	ooo_fetch();
+}
+
+void ooo_dump(const ooo_t *ooo, const sim_counters_t *c)
+{
+	uint32_t n;
+
+	printf("Out-of-order core\t: %u ROB, %u RS, %u LSQ entries, %u-wide (IPC %.3f)\n", ooo->rob_entries,
+		ooo->rs_entries, ooo->lsq_entries, ooo->width, c->cycles ? (double)c->instructions / c->cycles : 0.0);
+	printf("  cycles issuing\t:");
+	for(n = 0; n <= ooo->width; n++)
+		printf(" %u: %llu", n, (unsigned long long)ooo->issued[n]);
+	printf("\n");
+	printf("  rename stalls\t\t: %llu ROB full, %llu RS full, %llu LSQ full\n", (unsigned long long)ooo->rob_full,
+		(unsigned long long)ooo->rs_full, (unsigned long long)ooo->lsq_full);
+	printf("  ROB occupancy\t\t: %.2f average\n", c->cycles ? (double)ooo->occupancy / c->cycles : 0.0);
+	printf("  squashed\t\t: %llu wrong-path instructions\n", (unsigned long long)ooo->squashed);
+	printf("  load forwards\t\t: %llu\n", (unsigned long long)ooo->load_forwards);
+}
+
+/************************************************************/
+/* Functional simulation: retire one instruction the way the pipeline */
+/* would, straight into CURRENT_STATE and memory                                */ 
+/************************************************************/
+static inline __attribute__((always_inline))
+void func_retire(int op, const decoded_inst_t *d, uint32_t pc, uint32_t b, const exec_result_t *r)
+{
+	uint32_t value = r->ALUOutput;
+
+	if(op == OP_LB)
+	{
+		value = mem_read_8(r->ALUOutput);
+		value = (value & 0x80) ? (value | 0xFFFFFF00) : value;
+	}
+	else if(op == OP_LH)
+	{
+		value = mem_read_16(r->ALUOutput);
+		value = (value & 0x8000) ? (value | 0xFFFF0000) : value;
+	}
+	else if(op == OP_LW)
+		value = mem_read_32(r->ALUOutput);
+	else if(op == OP_SB)
+		mem_write_8(r->ALUOutput, b);
+	else if(op == OP_SH)
+		mem_write_16(r->ALUOutput, b);
+	else if(op == OP_SW)
+		mem_write_32(r->ALUOutput, b);
+
+	if(d->flags & INST_WRITES_REG)
+		CURRENT_STATE.REGS[d->dest] = value;
+	if(op == OP_JAL)
+		CURRENT_STATE.REGS[31] = pc + 4;
+	if(r->hilo & EXEC_WRITES_HI)
+		CURRENT_STATE.HI = r->HI;
+	if(r->hilo & EXEC_WRITES_LO)
+		CURRENT_STATE.LO = r->LO;
+}
+
+/************************************************************/
+/* func_run() under ENABLE_DELAY_SLOT: a taken branch moves the PC */
+/* only after the instruction behind it. A branch and its slot always   */
+/* retire together, so CURRENT_STATE.PC stays a clean restart point. */
+/************************************************************/
+static uint32_t func_run_delay_slot(uint32_t max_instructions, uint32_t stop_pc)
+{
+	uint32_t pc = CURRENT_STATE.PC, next_pc = pc + 4, executed = 0;
+	uint32_t a, b;
+	bool in_slot = false;
+	const decoded_inst_t *d;
+	exec_result_t r;
+
+	while(in_slot || (executed < max_instructions && pc != stop_pc))
+	{
+		d = decode_lookup(pc);
+		a = CURRENT_STATE.REGS[d->rs];
+		b = CURRENT_STATE.REGS[d->rt];
+		r.ALUOutput = 0;
+		r.HI = CURRENT_STATE.HI;
+		r.LO = CURRENT_STATE.LO;
+		alu_execute(d, pc + 4, a, b, &r);
+		executed++;
+		if(d->op == OP_SYSCALL)
+		{
+			RUN_FLAG = false;
+			break;
+		}
+		func_retire(d->op, d, pc + 4, b, &r);
+
+		in_slot = (d->flags & INST_BRANCH) != 0;
+		pc = next_pc;
+		next_pc = r.taken ? r.next_pc : next_pc + 4;
+	}
 
+	CURRENT_STATE.PC = pc;
+	INSTRUCTION_COUNT += executed;
+	return executed;
 }
 
 /************************************************************/
-/* memory access (MEM) pipeline stage:                                                          */ 
+/* Functional simulation: execute up to max_instructions from              */
+/* CURRENT_STATE.PC with the same semantics as the pipeline but no   */
+/* timing, stopping early at stop_pc or a SYSCALL (which clears          */
+/* RUN_FLAG). Every handler dispatches the next instruction itself so */
+/* the host predicts each transition separately.                                 */
+/* Returns the number of instructions executed.                                    */ 
 /************************************************************/
-void MEM()
+uint32_t func_run(uint32_t max_instructions, uint32_t stop_pc)
 {
-	/*IMPLEMENT THIS*/
-	printf("-Memory Access- \n");
-
-	// Retrieve the incomming instruction's REG_WRITE status
-	// 	before it is set back to true by defaultin EX() stage	
-	REG_WRITE_MEM_WB = REG_WRITE_EX_MEM;
-
-	// pass along pipeline reg info
-	MEM_WB.IR = EX_MEM.IR;
-	MEM_WB.A = EX_MEM.A;
-	MEM_WB.B = EX_MEM.B;
-	MEM_WB.ALUOutput = EX_MEM.ALUOutput;
+	uint32_t pc = CURRENT_STATE.PC, executed = 0;
+	uint32_t a = 0, b = 0;
+	const decoded_inst_t *d;
+	exec_result_t r;
 
-	uint32_t data, opcode;
+	if(ENABLE_DELAY_SLOT)
+		return func_run_delay_slot(max_instructions, stop_pc);
 
-	opcode = (EX_MEM.IR & 0xFC000000) >> 26;
+#define FUNC_FETCH() \
+	do { \
+		if(executed == max_instructions || pc == stop_pc) goto func_out; \
+		d = decode_lookup(pc); \
+		a = CURRENT_STATE.REGS[d->rs]; \
+		b = CURRENT_STATE.REGS[d->rt]; \
+	} while(0)
+#define FUNC_EXECUTE(name) \
+	r.ALUOutput = 0; \
+	r.HI = CURRENT_STATE.HI; \
+	r.LO = CURRENT_STATE.LO; \
+	r.taken = false; \
+	r.hilo = 0; \
+	sem_##name(d, pc, a, b, &r); \
+	executed++; \
+	if(OP_##name == OP_SYSCALL) { RUN_FLAG = false; goto func_out; } \
+	func_retire(OP_##name, d, pc, b, &r); \
+	pc = r.taken ? r.next_pc : pc + 4;
 
+#ifdef __GNUC__
+#define FUNC_LABEL(name) &&func_##name,
+#define FUNC_HANDLER(name) func_##name: FUNC_EXECUTE(name) FUNC_FETCH(); goto *handlers[d->op];
+	static void *const handlers[NUM_MIPS_OPS] = { MIPS_OPS(FUNC_LABEL) };
 
-	// check if the loadflag or the store flag is set to see if we need to access memory
-	if(EX_MEM.loadFlag)
-	{
-		printf("Memory Load \n");
-		MEM_WB.LMD = mem_read_32(EX_MEM.ALUOutput);
-		printf("MEMREAD(): 0x%08X \n", mem_read_32(EX_MEM.ALUOutput));
-		printf("MEM_WB.LMD: 0x%08X \n", MEM_WB.LMD);
-	}
-	else if(EX_MEM.storeFlag)
+	FUNC_FETCH();
+	goto *handlers[d->op];
+	MIPS_OPS(FUNC_HANDLER)
+#undef FUNC_LABEL
+#undef FUNC_HANDLER
+#else
+#define FUNC_HANDLER(name) case OP_##name: FUNC_EXECUTE(name) break;
+	for(;;)
 	{
-		printf("Memory Store \n");
-
-		if (opcode == 0x29) //SH
-		{
-			data = mem_read_32(EX_MEM.ALUOutput);
-			data = (data & 0xFFFF0000) | (EX_MEM.B & 0x0000FFFF);
-			mem_write_32(EX_MEM.ALUOutput, data);		
-
-		}
-		if (opcode == 0x28) //SB
+		FUNC_FETCH();
+		switch(d->op)
 		{
-			data = mem_read_32(EX_MEM.ALUOutput);
-			data = (data & 0xFFFFFF00) | (EX_MEM.B & 0x000000FF);
-			mem_write_32(EX_MEM.ALUOutput, data);		
+			MIPS_OPS(FUNC_HANDLER)
 		}
-		else 
-			mem_write_32(EX_MEM.ALUOutput, EX_MEM.B);
 	}
-	
+#undef FUNC_HANDLER
+#endif
+#undef FUNC_FETCH
+#undef FUNC_EXECUTE
 
+func_out:
+	CURRENT_STATE.PC = pc;
+	INSTRUCTION_COUNT += executed;
+	return executed;
 }
 
 /************************************************************/
-/* execution (EX) pipeline stage:                                                                          */ 
+/* Functional simulation of a single instruction                                   */ 
 /************************************************************/
-void EX()
+bool func_step()
 {
-	printf("-Execution- \n");
+	func_run(1, UINT32_MAX);
+	return RUN_FLAG;
+}
 
-	// only retreive new instruction if we aren't stalling
-	EX_MEM.IR = ID_EX.IR;
-		
-	// retrieve from pipeline regs	
-	EX_MEM.A = ID_EX.A;
-	EX_MEM.B = ID_EX.B;
+/************************************************************/
+/* Restart the loaded program without reloading memory                    */ 
+/************************************************************/
+static void restart_program()
+{
+	memset(&CURRENT_STATE, 0, sizeof(CURRENT_STATE));
+	CURRENT_STATE.PC = PROGRAM_ENTRY;
+	NEXT_STATE = CURRENT_STATE;
+	bubble_latch(&IF_ID);
+	bubble_latch(&ID_EX);
+	bubble_latch(&EX_MEM);
+	bubble_latch(&MEM_WB);
+	pipe_reset();
+	stallCounter = 0;
+	branch_jump_flag = false;
+	early_branch_flag = false;
+	delay_slot_pending = false;
+	fetch_gated = false;
+	REG_WRITE_EX_MEM = REG_WRITE_MEM_WB = 0;
+	memset(&COUNTERS, 0, sizeof(COUNTERS));
+	cache_reset(&L1I);
+	cache_reset(&L1D);
+	memsys_reset();
+	prefetch_reset();
+	store_buffer_reset();
+	bp_reset();
+	mdu_reset();
+	ss_reset();
+	ooo_reset();
+	RUN_FLAG = TRUE;
+}
 
-	uint32_t opcode, function, target, rt, sa;
-//	uint32_t addr, data;
-	uint64_t product;
+/************************************************************/
+/* Basic-block JIT: straight-line MIPS code up to and including the   */
+/* first branch is translated into x86-64 that works on CURRENT_STATE */
+/* in place (rbx points at it) and calls the mem_* accessors for         */
+/* loads and stores. Every block starts by charging its length against */
+/* the instruction budget kept in r12d, and each direct exit is a stub */
+/* that is patched into a jump to the successor once it exists, so hot */
+/* loops run without returning to C. SYSCALL is left to func_run().      */
+/************************************************************/
+#ifdef MIPS_JIT
+#define JIT_REG(r) ((uint32_t)(offsetof(CPU_State, REGS) + 4 * (r)))
+#define JIT_HI ((uint32_t)offsetof(CPU_State, HI))
+#define JIT_LO ((uint32_t)offsetof(CPU_State, LO))
 
-	// rs = (ID_EX.IR & 0x03E00000) >> 21;
-	rt = (ID_EX.IR & 0x001F0000) >> 16;
-	// rd = (ID_EX.IR & 0x0000F800) >> 11;
-	sa = (ID_EX.IR & 0x000007C0) >> 6;
+enum { JIT_EAX = 0, JIT_ECX = 1, JIT_EDX = 2, JIT_ESI = 6, JIT_EDI = 7 };
 
-	// set to false by default 
-	EX_MEM.loadFlag = false;
-	EX_MEM.storeFlag = false;
+static SIM_LOCAL uint8_t *jit_p;		/* emit position */
+static SIM_LOCAL uint8_t *jit_exit;		/* trampoline exit, see jit_init() */
+static SIM_LOCAL jit_entry_t jit_enter;
+static SIM_LOCAL uint32_t jit_trampoline_size;
+static SIM_LOCAL uint8_t *jit_refund_at[JIT_BLOCK_INSTS];	/* budget refunds of the block being translated */
+static SIM_LOCAL uint32_t jit_refund_pc[JIT_BLOCK_INSTS];	/* and the stores they follow */
+static SIM_LOCAL uint32_t jit_num_refunds;
 
-	// set true by default
-	REG_WRITE_EX_MEM = true;
+static void jit_emit8(uint8_t v) { *jit_p++ = v; }
+static void jit_emit32(uint32_t v) { memcpy(jit_p, &v, 4); jit_p += 4; }
+static void jit_emit64(uint64_t v) { memcpy(jit_p, &v, 8); jit_p += 8; }
+static void jit_patch32(uint8_t *at, uint32_t v) { memcpy(at, &v, 4); }
+static void jit_rel32(uint8_t *at, const uint8_t *target) { jit_patch32(at, (uint32_t)(target - (at + 4))); }
 
-	// getting necessary pieces of the instruction for execution
-	opcode = (ID_EX.IR & 0xFC000000) >> 26;
-	function = ID_EX.IR & 0x0000003F;
-	target = ID_EX.IR & 0x03FFFFFF;
+/* mov reg, [rbx + disp] */
+static void jit_load(int reg, uint32_t disp) { jit_emit8(0x8B); jit_emit8(0x83 | reg << 3); jit_emit32(disp); }
+/* mov [rbx + disp], reg */
+static void jit_store(int reg, uint32_t disp) { jit_emit8(0x89); jit_emit8(0x83 | reg << 3); jit_emit32(disp); }
+/* mov dword [rbx + disp], imm */
+static void jit_store_imm(uint32_t disp, uint32_t imm) { jit_emit8(0xC7); jit_emit8(0x83); jit_emit32(disp); jit_emit32(imm); }
+/* mov reg, imm */
+static void jit_mov_imm(int reg, uint32_t imm) { jit_emit8(0xB8 + reg); jit_emit32(imm); }
+/* <op> eax, [rbx + disp]: 03 add, 0B or, 23 and, 2B sub, 33 xor, 3B cmp */
+static void jit_alu_mem(uint8_t opcode, uint32_t disp) { jit_emit8(opcode); jit_emit8(0x83); jit_emit32(disp); }
+/* <op> eax, imm: 05 add, 0D or, 25 and, 35 xor, 3D cmp */
+static void jit_alu_imm(uint8_t opcode, uint32_t imm) { jit_emit8(opcode); jit_emit32(imm); }
+/* call a C helper, arguments already in edi/esi */
+static void jit_call(void *fn) { jit_emit8(0x48); jit_emit8(0xB8); jit_emit64((uint64_t)(uintptr_t)fn); jit_emit8(0xFF); jit_emit8(0xD0); }
+/* movzx eax, set<cc> al */
+static void jit_setcc(uint8_t cc) { jit_emit8(0x0F); jit_emit8(cc); jit_emit8(0xC0); jit_emit8(0x0F); jit_emit8(0xB6); jit_emit8(0xC0); }
 
+/************************************************************/
+/* Map the code buffer and emit the entry/exit trampoline                  */ 
+/************************************************************/
+static bool jit_init()
+{
+	void *code;
 
-	// ALU logic 
-	if(opcode == 0x00)
+	if(JIT_CODE != NULL)
+		return true;
+	code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(code == MAP_FAILED)
 	{
-		printf("Function Code: 0x%08X \n", function);
-		switch(function)
-		{
-			case 0x00: //SLL 
-				EX_MEM.ALUOutput = ID_EX.A << sa;
-				break;
-			case 0x02: //SRL 
-				EX_MEM.ALUOutput = ID_EX.B >> sa;
-				break;
-			case 0x03:  //SRA  ---->this always evaluates to true
-				if ((ID_EX.B & 0x80000000) == 0x1)
-				{
-					EX_MEM.ALUOutput =  ~(~ID_EX.B >> sa );
-				}
-				else{
-					EX_MEM.ALUOutput = ID_EX.B >> sa;
-				}
-				break;
-			case 0x08: //JR **NEW/COMPLETE**
-				NEXT_STATE.PC = ID_EX.A; 
-				branch_jump_flag = true;
-				break;
-			case 0x09: //JALR **NEW/COMPLETE**
-				EX_MEM.ALUOutput = ID_EX.PC + 4;
-				NEXT_STATE.PC = ID_EX.A; 
-				branch_jump_flag = true;
-				break;
-			case 0x20: // ADD
-				EX_MEM.ALUOutput = ID_EX.A + ID_EX.B;
-				printf("ADD Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;
-			case 0x24: // AND
-				EX_MEM.ALUOutput = ID_EX.A & ID_EX.B;
-				printf("AND Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;
-			case 0x25: //OR
-				EX_MEM.ALUOutput = ID_EX.A | ID_EX.B;
-				printf("OR Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;
-			case 0x26: // XOR
-				EX_MEM.ALUOutput = ID_EX.A ^ ID_EX.B;
-				printf("XOR Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;	
-			case 0x22: //SUB 
-				EX_MEM.ALUOutput = ID_EX.A - ID_EX.B;
-				break;
-			case 0x1B: //DIVU
-				if(ID_EX.B != 0)
-				{
-					NEXT_STATE.LO = ID_EX.A / ID_EX.B;
-					NEXT_STATE.HI = ID_EX.A % ID_EX.B;
-				}
-				break;
-			case 0x10: //MFHI 
-				EX_MEM.ALUOutput = CURRENT_STATE.HI;
-				break;
-			case 0x12: //MFLO  
-				EX_MEM.ALUOutput = CURRENT_STATE.LO;
-				break;
-			case 0x19: //MULTU
-				product = (uint64_t)ID_EX.A * (uint64_t)ID_EX.B;
-				NEXT_STATE.LO = (product & 0X00000000FFFFFFFF);
-				NEXT_STATE.HI = (product & 0XFFFFFFFF00000000)>>32;
-				break;
-			case 0x11: //MTHI 
-				NEXT_STATE.HI = ID_EX.A;
-				break;
-			case 0x13: //MTLO 
-				NEXT_STATE.LO = ID_EX.A;
-				break;
-			case 0x2A: //SLT 
-				if(ID_EX.A < ID_EX.B){
-					EX_MEM.ALUOutput = 0x1;
-				}
-				else{
-					EX_MEM.ALUOutput = 0x0;
-				}
-				break;
-			case 0x27: //NOR 
-				EX_MEM.ALUOutput = ~(ID_EX.A | ID_EX.B);
-				break;
-			case 0x0C: // SYSCALL
-				printf("SYSCALL \n");
-				// finish the final instruction thats in WB() stage
-				WB();
-				RUN_FLAG = false;
-				REG_WRITE_EX_MEM = false;
-				break;
-		}
+		printf("JIT unavailable (cannot map executable memory), using the interpreter\n");
+		JIT_ENABLED = false;
+		return false;
 	}
-	else
+	JIT_CODE = code;
+	jit_p = JIT_CODE;
+
+	// entry: push rbx/r12/r13, rbx = state, r12d = budget, r13 = out, jmp code
+	jit_emit8(0x53); jit_emit8(0x41); jit_emit8(0x54); jit_emit8(0x41); jit_emit8(0x55);
+	jit_emit8(0x48); jit_emit8(0x89); jit_emit8(0xFB);
+	jit_emit8(0x41); jit_emit8(0x89); jit_emit8(0xF4);
+	jit_emit8(0x49); jit_emit8(0x89); jit_emit8(0xCD);
+	jit_emit8(0xFF); jit_emit8(0xE2);
+	// exit: eax = next PC, edx = link; out[0] = r12d, out[1] = edx
+	jit_exit = jit_p;
+	jit_emit8(0x45); jit_emit8(0x89); jit_emit8(0x65); jit_emit8(0x00);
+	jit_emit8(0x41); jit_emit8(0x89); jit_emit8(0x55); jit_emit8(0x04);
+	jit_emit8(0x41); jit_emit8(0x5D); jit_emit8(0x41); jit_emit8(0x5C); jit_emit8(0x5B);
+	jit_emit8(0xC3);
+
+	jit_enter = (jit_entry_t)(void *)JIT_CODE;
+	jit_trampoline_size = jit_p - JIT_CODE;
+	JIT_CODE_USED = jit_trampoline_size;
+	JIT_NUM_BLOCKS = 0;
+	memset(JIT_LOOKUP, 0xFF, sizeof(JIT_LOOKUP));
+	memset(JIT_HEAT_PC, 0xFF, sizeof(JIT_HEAT_PC));
+	memset(JIT_HEAT, 0, sizeof(JIT_HEAT));
+	JIT_TEXT_LO = UINT32_MAX;
+	JIT_TEXT_HI = 0;
+	return true;
+}
+
+/************************************************************/
+/* Drop every translation, unchaining the old code first so a block  */
+/* still running (a store into text) returns to C at its exit             */ 
+/************************************************************/
+void jit_flush()
+{
+	uint32_t i;
+	int slot;
+
+	if(JIT_CODE == NULL)
+		return;
+	for(i = 0; i < JIT_NUM_BLOCKS; i++)
 	{
-		switch(opcode)
+		for(slot = 0; slot < 2; slot++)
 		{
-			case 0x01:
-				if(rt == 0x00000)  //BLTZ 
-				{ 
-					if((ID_EX.A & 0x80000000) > 0)
-					{
-						printf("BLTZ \n");
-						NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-						// printf("Calculated Jump Addr: 0x%08X \n", NEXT_STATE.PC);
-						branch_jump_flag = true;
-					}
-				}
-				else if(rt == 0x00001)   //BGEZ 
-				{ 
-					if((ID_EX.A & 0x80000000) == 0x0)
-					{
-						printf("BGEZ \n");
-						NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-						branch_jump_flag = true;
-					}
-				}
-				break;
-			
-			case 0x02: //J
-                NEXT_STATE.PC = (ID_EX.PC & 0xF0000000) | (target << 2);
-				// printf("Calculated Jump Addr: 0x%08X \n", NEXT_STATE.PC);
-				branch_jump_flag = true;
-				break;
-			case 0x03: //JAL 
-				NEXT_STATE.PC = (ID_EX.PC & 0xF0000000) | (target << 2);
-				NEXT_STATE.REGS[31] = ID_EX.PC + 4;
-				branch_jump_flag = true;
-				break;
-			case 0x04: //BEQ 
-				if(ID_EX.A == ID_EX.B)
-				{
-					printf("BEQ \n");
-					NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-					// printf("Calculated Jump Addr: 0x%08X \n", NEXT_STATE.PC);
-					branch_jump_flag = true;
-
-				}
-				break;
-			case 0x05: //BNE 
-				if(ID_EX.A != ID_EX.B)
-				{
-					printf("BNE \n");
-					NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-					branch_jump_flag = true;
-				}
-				break;
-			case 0x06: //BLEZ 
-				if((ID_EX.A & 0x80000000) > 0 || ID_EX.A == 0)
-				{
-					printf("BLE \n");
-					NEXT_STATE.PC = ID_EX.PC + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-					branch_jump_flag = true;
-				}
-				break;
-			case 0x07: //BGTZ  
-				if((ID_EX.A & 0x80000000) == 0x0 || ID_EX.A != 0)
-				{
-					NEXT_STATE.PC = ID_EX.PC +  ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000)<<2 : (ID_EX.imm & 0x0000FFFF)<<2);
-					printf("Calculated Jump Addr: 0x%08X \n", NEXT_STATE.PC);
-					branch_jump_flag = true;
-				}
-				break;
-			case 0x08:  // ADDI
-				EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
-				printf("Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;
-			case 0x09: //ADDIU
-				EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
-				printf("Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;
-			case 0x0A: //SLTI 
-				if ( (  (int32_t)ID_EX.A - (int32_t)( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF))) < 0){
-					EX_MEM.ALUOutput = 0x1;
-				}else{
-					EX_MEM.ALUOutput = 0x0;
-				}
-				break;
-			case 0x0D: //ORI 
-				EX_MEM.ALUOutput = ID_EX.A | (ID_EX.imm & 0x0000FFFF);
-				break;
-			case 0x0C: //ANDI 
-				EX_MEM.ALUOutput = ID_EX.A & (ID_EX.imm & 0x0000FFFF);
-				break;
-			case 0x0E: //XORI
-				EX_MEM.ALUOutput = ID_EX.A ^ (ID_EX.imm & 0x0000FFFF);
-				printf("Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;
-			case 0x0F: //LUI 
-				EX_MEM.ALUOutput = ID_EX.imm << 16;
-				printf("Result: 0x%08X \n", EX_MEM.ALUOutput);
-				break;
-			case 0x20: //LB 
-				printf(" ***LOAD BTYE TESTING****\n\n");
-				printf(" ID_EX.A = 0x%08x \n\n", ID_EX.A);	
-				EX_MEM.ALUOutput =  ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF) );
-				EX_MEM.loadFlag = true;
-				break;
-			case 0x21: //LH 
-				EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
-				EX_MEM.loadFlag = true;	
-				break;
-			case 0x23: //LW
-				EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
-				printf("Base: 0x%08x \n", ID_EX.A);
-				EX_MEM.loadFlag = true;
-				break;
-			case 0x28: //SB 
-				EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
-				EX_MEM.storeFlag = true;
-				printf("0x%08x THIS IS SB ALUOutput (addr) \n\n", EX_MEM.ALUOutput);
-				break;
-			case 0x29: //SH 
-				EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
-				EX_MEM.storeFlag = true;
-				printf("0x%08x THIS IS SH ALUOutput (addr) \n\n", EX_MEM.ALUOutput);
-				break;
-			case 0x2B: //SW
-				EX_MEM.ALUOutput = ID_EX.A + ( (ID_EX.imm & 0x8000) > 0 ? (ID_EX.imm | 0xFFFF0000) : (ID_EX.imm & 0x0000FFFF));
-				printf("Result: 0x%08X \n", EX_MEM.ALUOutput);
-				EX_MEM.storeFlag = true;
-				REG_WRITE_EX_MEM = false;
-				break;
+			if(JIT_BLOCKS[i].exit[slot] != NULL)
+			{
+				JIT_BLOCKS[i].exit[slot][0] = 0xB8;
+				jit_patch32(JIT_BLOCKS[i].exit[slot] + 1, JIT_BLOCKS[i].exit_pc[slot]);
+			}
 		}
 	}
+	JIT_CODE_USED = jit_trampoline_size;
+	JIT_NUM_BLOCKS = 0;
+	memset(JIT_LOOKUP, 0xFF, sizeof(JIT_LOOKUP));
+	JIT_TEXT_LO = UINT32_MAX;
+	JIT_TEXT_HI = 0;
+	JIT_GENERATION++;
+}
 
-	if(branch_jump_flag)
+/************************************************************/
+/* Give the code buffer back, e.g. when a worker thread finishes          */ 
+/************************************************************/
+void jit_release()
+{
+	if(JIT_CODE != NULL)
 	{
-		ID_EX.IR = 0;
-		ID_EX.A = 0;
-		ID_EX.B = 0;
-		ID_EX.imm = 0;
+		jit_flush();
+		munmap(JIT_CODE, JIT_CODE_SIZE);
+		JIT_CODE = NULL;
 	}
-	
+}
 
+/************************************************************/
+/* Drop the translations if [address, address + size) overlaps them   */ 
+/************************************************************/
+void jit_invalidate(uint32_t address, uint32_t size)
+{
+	if(JIT_NUM_BLOCKS != 0 && address < JIT_TEXT_HI && address + size > JIT_TEXT_LO)
+		jit_flush();
 }
 
 /************************************************************/
-/* instruction decode (ID) pipeline stage:                                                         */ 
+/* Direct exit stub: mov eax, pc; mov edx, link; jmp exit. Chaining   */
+/* overwrites its first five bytes with a jmp to the successor block    */ 
 /************************************************************/
-void ID()
+static void jit_emit_stub(jit_block_t *blk, int slot, uint32_t pc)
 {
-	printf("-Instruction Decode- \n");
+	blk->exit[slot] = jit_p;
+	blk->exit_pc[slot] = pc;
+	jit_mov_imm(JIT_EAX, pc);
+	jit_mov_imm(JIT_EDX, ((uint32_t)(blk - JIT_BLOCKS) << 1) | slot);
+	jit_emit8(0xE9);
+	jit_rel32(jit_p, jit_exit);
+	jit_p += 4;
+}
 
-	// Pass PC along for Control instructions
-	ID_EX.PC = IF_ID.PC;
+/************************************************************/
+/* Loads and stores: eax = rs + simm, then the MEM_TLB (MEM_WTLB)   */
+/* lookup of mem_translate() inline, falling back to the mem_* on a    */
+/* miss, a page-straddling access or a store into text. A store that  */
+/* flushed the translations leaves the block at pc + 4, handing back  */
+/* the budget of the instructions after it, since they may be stale.  */
+/************************************************************/
+static void jit_emit_mem(const decoded_inst_t *d, uint32_t pc)
+{
+	bool store = d->flags & INST_STORE;
+	uint32_t size = (d->op == OP_LB || d->op == OP_SB) ? 1 : (d->op == OP_LH || d->op == OP_SH) ? 2 : 4;
+	uint8_t *slow[3], *done, *same;
+	int n = 0, i;
 
-	uint32_t rs = 0, rt = 0, opcode_EX_MEM = 0, opcode_MEM_WB = 0, rd_EX_MEM = 0, rd_MEM_WB = 0, immediate = 0, opcode = 0;
+	jit_load(JIT_EAX, JIT_REG(d->rs));
+	jit_alu_imm(0x05, d->simm);
+	jit_emit8(0x89); jit_emit8(0xC7);	// mov edi, eax
+	if(store)
+	{
+		// stores into text go through mem_write_*() so the caches are invalidated
+		jit_emit8(0x8D); jit_emit8(0x88); jit_emit32(-MEM_TEXT_BEGIN);	// lea ecx, [rax - text]
+		jit_emit8(0x81); jit_emit8(0xF9); jit_emit32(MEM_TEXT_END - MEM_TEXT_BEGIN);	// cmp ecx, text size
+		jit_emit8(0x0F); jit_emit8(0x86); slow[n++] = jit_p; jit_p += 4;	// jbe slow
+	}
+	// ecx = vpn, rdx = TLB index * 16, rsi = MEM_TLB or MEM_WTLB
+	jit_emit8(0x89); jit_emit8(0xC1);
+	jit_emit8(0xC1); jit_emit8(0xE9); jit_emit8(MEM_PAGE_SHIFT);
+	jit_emit8(0x89); jit_emit8(0xCA);
+	jit_emit8(0x83); jit_emit8(0xE2); jit_emit8(MEM_TLB_ENTRIES - 1);
+	jit_emit8(0xC1); jit_emit8(0xE2); jit_emit8(4);
+	jit_emit8(0x48); jit_emit8(0xBE); jit_emit64((uint64_t)(uintptr_t)(store ? MEM_WTLB : MEM_TLB));
+	jit_emit8(0x3B); jit_emit8(0x0C); jit_emit8(0x16);	// cmp ecx, [rsi + rdx]
+	jit_emit8(0x0F); jit_emit8(0x85); slow[n++] = jit_p; jit_p += 4;	// jne slow
+	if(size > 1)
+	{
+		// ecx = page offset, the access must not straddle the page
+		jit_emit8(0x89); jit_emit8(0xC1);
+		jit_emit8(0x81); jit_emit8(0xE1); jit_emit32(MEM_PAGE_MASK);
+		jit_emit8(0x81); jit_emit8(0xF9); jit_emit32(MEM_PAGE_SIZE - size);
+		jit_emit8(0x0F); jit_emit8(0x87); slow[n++] = jit_p; jit_p += 4;	// ja slow
+	}
+	else
+	{
+		jit_emit8(0x89); jit_emit8(0xC1);
+		jit_emit8(0x81); jit_emit8(0xE1); jit_emit32(MEM_PAGE_MASK);
+	}
+	jit_emit8(0x48); jit_emit8(0x8B); jit_emit8(0x74); jit_emit8(0x16); jit_emit8(offsetof(mem_tlb_entry_t, page));	// mov rsi, [rsi + rdx + page]
+	if(store)
+	{
+		jit_load(JIT_EAX, JIT_REG(d->rt));
+		if(size == 1) { jit_emit8(0x88); }			// mov [rsi + rcx], al
+		else if(size == 2) { jit_emit8(0x66); jit_emit8(0x89); }	// mov [rsi + rcx], ax
+		else { jit_emit8(0x89); }				// mov [rsi + rcx], eax
+		jit_emit8(0x04); jit_emit8(0x0E);
+	}
+	else
+	{
+		if(size == 1) { jit_emit8(0x0F); jit_emit8(0xBE); }	// movsx eax, byte [rsi + rcx]
+		else if(size == 2) { jit_emit8(0x0F); jit_emit8(0xBF); }	// movsx eax, word [rsi + rcx]
+		else { jit_emit8(0x8B); }				// mov eax, [rsi + rcx]
+		jit_emit8(0x04); jit_emit8(0x0E);
+	}
+	jit_emit8(0xE9); done = jit_p; jit_p += 4;
 
-	// decrease stall counter if it is set
-	if(stallCounter != 0)
-		stallCounter--;
+	for(i = 0; i < n; i++)
+		jit_rel32(slow[i], jit_p);
+	if(store)
+	{
+		jit_load(JIT_ESI, JIT_REG(d->rt));
+		jit_call(size == 1 ? (void *)mem_write_8 : size == 2 ? (void *)mem_write_16 : (void *)mem_write_32);
+		// mov rax, &JIT_GENERATION; cmp dword [rax], generation; je same
+		jit_emit8(0x48); jit_emit8(0xB8); jit_emit64((uint64_t)(uintptr_t)&JIT_GENERATION);
+		jit_emit8(0x81); jit_emit8(0x38); jit_emit32(JIT_GENERATION);
+		jit_emit8(0x0F); jit_emit8(0x84); same = jit_p; jit_p += 4;
+		// add r12d, instructions left in the block, patched by jit_translate()
+		jit_emit8(0x41); jit_emit8(0x81); jit_emit8(0xC4);
+		jit_refund_at[jit_num_refunds] = jit_p;
+		jit_refund_pc[jit_num_refunds++] = pc;
+		jit_p += 4;
+		jit_mov_imm(JIT_EAX, pc + 4);
+		jit_mov_imm(JIT_EDX, JIT_NO_LINK);
+		jit_emit8(0xE9);
+		jit_rel32(jit_p, jit_exit);
+		jit_p += 4;
+		jit_rel32(same, jit_p);
+	}
+	else
+	{
+		jit_call(size == 1 ? (void *)mem_read_8 : size == 2 ? (void *)mem_read_16 : (void *)mem_read_32);
+		if(size < 4)
+		{
+			// movsx eax, al / ax
+			jit_emit8(0x0F); jit_emit8(size == 1 ? 0xBE : 0xBF); jit_emit8(0xC0);
+		}
+	}
+	jit_rel32(done, jit_p);
+}
 
+/************************************************************/
+/* Translate one non-control-transfer instruction, the x86 version of  */
+/* the SEM() handler plus func_retire()                                                   */ 
+/************************************************************/
+static void jit_emit_inst(const decoded_inst_t *d, uint32_t pc)
+{
+	uint8_t *skip;
 
-	/* STALLING SOLUTION WHEN FORWARDING DISABLED */
-	if(!ENABLE_FORWARDING)
+	switch(d->op)
 	{
-		if(stallCounter == 0)
-		{
-			ID_EX.IR = IF_ID.IR;
-			printf("Instruction ID: 0x%08X \n", IF_ID.IR);
-			rs = (IF_ID.IR & 0x03E00000) >> 21;
-			rt = (IF_ID.IR & 0x001F0000) >> 16;
-			// opcode = (ID_EX.IR & 0xfc000001) >> 26;
-			opcode = (IF_ID.IR & 0xFC000000) >> 26;
-
-			immediate = IF_ID.IR & 0x0000FFFF;
-
-			// used for finding data hazards
-			opcode_EX_MEM = (EX_MEM.IR & 0xFC000000) >> 26;
-			opcode_MEM_WB = (MEM_WB.IR & 0xFC000000) >> 26;
-
-			// special logic for case described below
-			// If its an immediate instruction, "rd" is really rt 
-			if(opcode_EX_MEM == 0x0)
-			{
-				rd_EX_MEM = (EX_MEM.IR & 0x0000F800) >> 11;
-			}
-			else
+		case OP_SLL: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_emit8(0xC1); jit_emit8(0xE0); jit_emit8(d->sa); break;
+		case OP_SRL: jit_load(JIT_EAX, JIT_REG(d->rt)); jit_emit8(0xC1); jit_emit8(0xE8); jit_emit8(d->sa); break;
+		case OP_SRA: jit_load(JIT_EAX, JIT_REG(d->rt)); jit_emit8(0xC1); jit_emit8(0xF8); jit_emit8(d->sa); break;
+		case OP_MFHI: jit_load(JIT_EAX, JIT_HI); break;
+		case OP_MFLO: jit_load(JIT_EAX, JIT_LO); break;
+		case OP_MTHI: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_store(JIT_EAX, JIT_HI); break;
+		case OP_MTLO: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_store(JIT_EAX, JIT_LO); break;
+		case OP_MULT:
+		case OP_MULTU:
+			jit_load(JIT_EAX, JIT_REG(d->rs));
+			jit_load(JIT_ECX, JIT_REG(d->rt));
+			if(d->op == OP_MULT)
 			{
-				rd_EX_MEM = (EX_MEM.IR & 0x001F0000) >> 16;
+				// movsxd rax, eax; movsxd rcx, ecx
+				jit_emit8(0x48); jit_emit8(0x63); jit_emit8(0xC0);
+				jit_emit8(0x48); jit_emit8(0x63); jit_emit8(0xC9);
 			}
-
-			if(opcode_MEM_WB == 0x0)
+			// imul rax, rcx; LO = eax; shr rax, 32; HI = eax
+			jit_emit8(0x48); jit_emit8(0x0F); jit_emit8(0xAF); jit_emit8(0xC1);
+			jit_store(JIT_EAX, JIT_LO);
+			jit_emit8(0x48); jit_emit8(0xC1); jit_emit8(0xE8); jit_emit8(0x20);
+			jit_store(JIT_EAX, JIT_HI);
+			break;
+		case OP_DIV:
+		case OP_DIVU:
+			jit_load(JIT_EAX, JIT_REG(d->rs));
+			jit_load(JIT_ECX, JIT_REG(d->rt));
+			// test ecx, ecx; jz over the divide, HI/LO keep their values
+			jit_emit8(0x85); jit_emit8(0xC9);
+			jit_emit8(0x74); skip = jit_p; jit_emit8(0);
+			if(d->op == OP_DIV)
 			{
-				rd_MEM_WB = (MEM_WB.IR & 0x0000F800) >> 11;
+				jit_emit8(0x99); jit_emit8(0xF7); jit_emit8(0xF9);	// cdq; idiv ecx
 			}
 			else
 			{
-				rd_MEM_WB = (MEM_WB.IR & 0x001F0000) >> 16;
+				jit_emit8(0x31); jit_emit8(0xD2); jit_emit8(0xF7); jit_emit8(0xF1);	// xor edx, edx; div ecx
 			}
+			jit_store(JIT_EAX, JIT_LO);
+			jit_store(JIT_EDX, JIT_HI);
+			*skip = jit_p - (skip + 1);
+			break;
+		case OP_ADD:
+		case OP_ADDU: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_mem(0x03, JIT_REG(d->rt)); break;
+		case OP_SUB:
+		case OP_SUBU: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_mem(0x2B, JIT_REG(d->rt)); break;
+		case OP_AND: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_mem(0x23, JIT_REG(d->rt)); break;
+		case OP_OR: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_mem(0x0B, JIT_REG(d->rt)); break;
+		case OP_XOR: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_mem(0x33, JIT_REG(d->rt)); break;
+		case OP_NOR:
+			jit_load(JIT_EAX, JIT_REG(d->rs));
+			jit_alu_mem(0x0B, JIT_REG(d->rt));
+			jit_emit8(0xF7); jit_emit8(0xD0);	// not eax
+			break;
+		case OP_SLT:
+			jit_load(JIT_EAX, JIT_REG(d->rs));
+			jit_alu_mem(0x3B, JIT_REG(d->rt));
+			jit_setcc(0x92);	// setb: the simulator compares unsigned
+			break;
+		case OP_ADDI:
+		case OP_ADDIU: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_imm(0x05, d->simm); break;
+		case OP_SLTI: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_imm(0x3D, d->simm); jit_setcc(0x9C); break;
+		case OP_ANDI: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_imm(0x25, d->imm); break;
+		case OP_ORI: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_imm(0x0D, d->imm); break;
+		case OP_XORI: jit_load(JIT_EAX, JIT_REG(d->rs)); jit_alu_imm(0x35, d->imm); break;
+		case OP_LUI: jit_mov_imm(JIT_EAX, d->imm << 16); break;
+		case OP_LB:
+		case OP_LH:
+		case OP_LW:
+		case OP_SB:
+		case OP_SH:
+		case OP_SW:
+			jit_emit_mem(d, pc);
+			break;
+		default:
+			break;
+	}
+	if(d->flags & INST_WRITES_REG)
+		jit_store(JIT_EAX, JIT_REG(d->dest));
+}
 
+/************************************************************/
+/* Translate the branch or jump that ends a block                                */ 
+/************************************************************/
+static void jit_emit_branch(jit_block_t *blk, const decoded_inst_t *d, uint32_t pc)
+{
+	uint32_t target = pc + (d->simm << 2);
+	uint8_t cc = 0, *taken;
 
+	switch(d->op)
+	{
+		case OP_J:
+		case OP_JAL:
+			if(d->op == OP_JAL)
+				jit_store_imm(JIT_REG(31), pc + 4);
+			jit_emit_stub(blk, 1, (pc & 0xF0000000) | (d->target << 2));
+			return;
+		case OP_JR:
+		case OP_JALR:
+			jit_load(JIT_ECX, JIT_REG(d->rs));
+			if(d->flags & INST_WRITES_REG)
+				jit_store_imm(JIT_REG(d->dest), pc + 4);
+			jit_emit8(0x89); jit_emit8(0xC8);	// mov eax, ecx
+			jit_mov_imm(JIT_EDX, JIT_NO_LINK);
+			jit_emit8(0xE9);
+			jit_rel32(jit_p, jit_exit);
+			jit_p += 4;
+			return;
+		case OP_BGTZ:
+			// always taken in this simulator, see sem_BGTZ()
+			jit_emit_stub(blk, 1, target);
+			return;
+		case OP_BEQ: cc = 0x84; break;	// je
+		case OP_BNE: cc = 0x85; break;	// jne
+		case OP_BLTZ: cc = 0x88; break;	// js
+		case OP_BGEZ: cc = 0x89; break;	// jns
+		case OP_BLEZ: cc = 0x8E; break;	// jle
+		default: break;
+	}
+	jit_load(JIT_EAX, JIT_REG(d->rs));
+	if(d->op == OP_BEQ || d->op == OP_BNE)
+	{
+		jit_alu_mem(0x3B, JIT_REG(d->rt));
+	}
+	else
+	{
+		jit_emit8(0x85); jit_emit8(0xC0);	// test eax, eax
+	}
+	jit_emit8(0x0F); jit_emit8(cc); taken = jit_p; jit_p += 4;
+	jit_emit_stub(blk, 0, pc + 4);
+	jit_rel32(taken, jit_p);
+	jit_emit_stub(blk, 1, target);
+}
 
-			/* DATA HAZARD CHECK*/
-			// 1 instruction before
-			if((REG_WRITE_EX_MEM != 0) && (rd_EX_MEM != 0))
-			{
-				// if the destination register of ex_mem is the same as the current 
-				// rs or rt register then we have a data hazard
-				if(rd_EX_MEM == rs)
-				{
-					// stall twice
-					rsHazardType1 =  true;
-					stallCounter = 2;
-				}
-				// if rd_EX_MEM == rt AND this is a register - register instruction, OR a load or store instrucion
-				//   otherwise we don't care if rt finds a match with immediate instructions
-				if((rd_EX_MEM == rt) && ((0x0F < opcode) || opcode == 0x0))
-				{
-					// stall twice
-					rtHazardType1 = true;
-					stallCounter = 2;
-				}
-			}
-			// 2 instructions before
-			if((REG_WRITE_MEM_WB != 0) && (rd_MEM_WB != 0))
-			{
-				// if the destination register of mem_wb is the same as the current 
-				// rs or rt register then we have a data hazard 
-				if(rd_MEM_WB == rs)
-				{
-					// stall once if stallCounter equal 0, if its already 2 then keep it at 2!!!
-					rsHazardType2 = true;
-					if(stallCounter == 0)
-						stallCounter = 1;
-				}
-				// Again, excluding immediate instructions, as we dont care if there is an rt match with immediate instructions
-				if((rd_MEM_WB == rt) && ((0x0F < opcode) || opcode == 0x0))
-				{
-					// stall once if stallCounter equal 0, if its already 2 then keep it at 2!!!
-					rtHazardType2 = true;
-					if(stallCounter == 0)
-						stallCounter = 1;
-				}
-			}
+/************************************************************/
+/* Translate the block starting at pc, NULL if it starts with a SYSCALL */ 
+/************************************************************/
+static jit_block_t *jit_translate(uint32_t pc)
+{
+	const decoded_inst_t *d;
+	jit_block_t *blk;
+	uint8_t *count_at[2], *bail_at;
+	uint32_t cur = pc, count = 0, i;
+	bool ended = false;
 
-			// If there is no data hazard, pass on the register readings and immediate 
-			if(stallCounter == 0)
-			{
-				ID_EX.A = CURRENT_STATE.REGS[rs]; 
-				ID_EX.B = CURRENT_STATE.REGS[rt];
-
-				// if we are one cycle after the stall counter is done
-				// 	we have to simulate having access to the WB() stage data through the 
-				// 		writeBackValue variable, the rs or rt hazard still needs handled
-				// 			this first cycle after being done stalling...
-				if(rsHazardType1 || rtHazardType1 || rsHazardType2 || rtHazardType2)
-				{
-					if(rsHazardType1 || (rsHazardType2 && !rtHazardType1))
-					{
-						printf("WriteBack into A 0x%08X \n", writeBackValue);
-						// ID_EX.A = writeBackValue;
-						ID_EX.A = NEXT_STATE.REGS[rs]; 
-						rsHazardType1 = false;
-						rsHazardType2 = false;
-					}
-					if(rtHazardType1 || (rtHazardType2 && !rsHazardType1))
-					{
-						printf("WriteBack into B 0x%08X \n", writeBackValue);
-						// ID_EX.B = writeBackValue;
-						ID_EX.B = NEXT_STATE.REGS[rt]; 
-						rtHazardType1 = false;
-						rtHazardType2 = false;
-					}
-				}
+	if(JIT_NUM_BLOCKS == JIT_MAX_BLOCKS ||
+	   JIT_CODE_USED + (JIT_BLOCK_INSTS + 2) * JIT_INST_BYTES > JIT_CODE_SIZE)
+		jit_flush();
 
-				// sign extend immediate
-				// if the 16th bit is set, sign extend	
-				if( immediate & 0x00008000)
-				{
-					ID_EX.imm = immediate | 0xFFFF0000;
-				}
-				else
-					ID_EX.imm = immediate;
+	blk = &JIT_BLOCKS[JIT_NUM_BLOCKS];
+	blk->exit[0] = blk->exit[1] = NULL;
+	jit_num_refunds = 0;
+	jit_p = JIT_CODE + JIT_CODE_USED;
+	blk->code = jit_p;
 
-			}
-			// otherwise only pass on zeros, this functions as the first stall if a hazard is found
-			else
-			{
-				printf("Hazard Detected \n");
-				ID_EX.IR = 0;
-				ID_EX.A = 0;
-				ID_EX.B = 0;
-				ID_EX.imm = 0;
-			}
+	// cmp r12d, count; jb bail; sub r12d, count
+	jit_emit8(0x41); jit_emit8(0x81); jit_emit8(0xFC); count_at[0] = jit_p; jit_p += 4;
+	jit_emit8(0x0F); jit_emit8(0x82); bail_at = jit_p; jit_p += 4;
+	jit_emit8(0x41); jit_emit8(0x81); jit_emit8(0xEC); count_at[1] = jit_p; jit_p += 4;
 
+	while(count < JIT_BLOCK_INSTS)
+	{
+		d = decode_lookup(cur);
+		if(d->op == OP_SYSCALL)
+			break;
+		count++;
+		if(d->flags & INST_BRANCH)
+		{
+			jit_emit_branch(blk, d, cur);
+			cur += 4;
+			ended = true;
+			break;
 		}
+		jit_emit_inst(d, cur);
+		cur += 4;
 	}
+	if(count == 0)
+		return NULL;
+	if(!ended)
+		jit_emit_stub(blk, 0, cur);
 
+	// bail out with the budget untouched when the block does not fit in it
+	jit_rel32(bail_at, jit_p);
+	jit_mov_imm(JIT_EAX, pc);
+	jit_mov_imm(JIT_EDX, JIT_NO_LINK);
+	jit_emit8(0xE9);
+	jit_rel32(jit_p, jit_exit);
+	jit_p += 4;
+	jit_patch32(count_at[0], count);
+	jit_patch32(count_at[1], count);
+	for(i = 0; i < jit_num_refunds; i++)
+		jit_patch32(jit_refund_at[i], (cur - jit_refund_pc[i] - 4) >> 2);
 
-	/* FORWARDING SECTION*/
-	if(ENABLE_FORWARDING)
-	{
-		#ifdef DEBUG
-			printf("ID Instruction: 0x%08X \n", IF_ID.IR);
-		#endif
+	blk->pc = pc;
+	blk->end = cur;
+	blk->count = count;
+	JIT_CODE_USED = jit_p - JIT_CODE;
+	JIT_LOOKUP[(pc >> 2) & (JIT_LOOKUP_ENTRIES - 1)] = JIT_NUM_BLOCKS++;
+	if(pc < JIT_TEXT_LO)
+		JIT_TEXT_LO = pc;
+	if(cur > JIT_TEXT_HI)
+		JIT_TEXT_HI = cur;
+	return blk;
+}
 
-		bool forwardFlag = false;
+/************************************************************/
+/* Translated block for pc, translating it once it has missed           */
+/* JIT_HOT_MISSES times: NULL keeps cold code in the interpreter,     */
+/* where running it once is cheaper than translating it                    */ 
+/************************************************************/
+static jit_block_t *jit_lookup(uint32_t pc)
+{
+	uint32_t hash = (pc >> 2) & (JIT_LOOKUP_ENTRIES - 1);
+	int32_t index = JIT_LOOKUP[hash];
+	jit_block_t *blk;
 
-		ID_EX.IR = IF_ID.IR;
-		rs = (IF_ID.IR & 0x03E00000) >> 21;
-		rt = (IF_ID.IR & 0x001F0000) >> 16;
+	if(index >= 0 && JIT_BLOCKS[index].pc == pc)
+		return &JIT_BLOCKS[index];
+	if(JIT_HEAT_PC[hash] != pc)
+	{
+		JIT_HEAT_PC[hash] = pc;
+		JIT_HEAT[hash] = 0;
+	}
+	if(!JIT_EAGER && JIT_HEAT[hash] < JIT_HOT_MISSES)
+	{
+		JIT_HEAT[hash]++;
+		return NULL;
+	}
+	blk = jit_translate(pc);
+	// a SYSCALL has nothing to translate, cool it down instead of retrying every time
+	if(blk == NULL)
+		JIT_HEAT[hash] = 0;
+	return blk;
+}
 
-		// opcode = (ID_EX.IR & 0xfc000001) >> 26;
-		opcode = (IF_ID.IR & 0xFC000000) >> 26;
+/************************************************************/
+/* Run like func_run(), through translated blocks where possible      */ 
+/************************************************************/
+uint32_t jit_run(uint32_t max_instructions, uint32_t stop_pc)
+{
+	uint32_t executed = 0, translated = 0, budget, link, generation;
+	uint32_t out[2];
+	jit_block_t *blk, *next;
 
-		immediate = IF_ID.IR & 0x0000FFFF;
+	// translated blocks end at the branch, they know nothing of delay slots
+	if(ENABLE_DELAY_SLOT || !jit_init())
+		return func_run(max_instructions, stop_pc);
 
-		// used for finding data hazards
-		opcode_EX_MEM = (EX_MEM.IR & 0xFC000000) >> 26;
-		opcode_MEM_WB = (MEM_WB.IR & 0xFC000000) >> 26;
-		// If its an immediate instruction, "rd" is really rt 
-		if(opcode_EX_MEM == 0x0)
-		{
-			rd_EX_MEM = (EX_MEM.IR & 0x0000F800) >> 11;
-		}
-	 	//really rt_EX_MEM
-		else
+	while(executed < max_instructions && CURRENT_STATE.PC != stop_pc)
+	{
+		blk = jit_lookup(CURRENT_STATE.PC);
+		if(blk == NULL || blk->count > max_instructions - executed ||
+		   (stop_pc > blk->pc && stop_pc < blk->end))
 		{
-			rd_EX_MEM = (EX_MEM.IR & 0x001F0000) >> 16;
+			executed += func_run(1, stop_pc);
+			if(RUN_FLAG == FALSE)
+				break;
+			continue;
 		}
+		// with a stop PC, run one block per entry so it is checked between blocks
+		budget = stop_pc == UINT32_MAX ? max_instructions - executed : blk->count;
+		CURRENT_STATE.PC = jit_enter(&CURRENT_STATE, budget, blk->code, out);
+		executed += budget - out[0];
+		translated += budget - out[0];
 
-		if(opcode_MEM_WB == 0x0)
-		{
-			rd_MEM_WB = (MEM_WB.IR & 0x0000F800) >> 11;
-		}
-		else
+		link = out[1];
+		if(link != JIT_NO_LINK && stop_pc == UINT32_MAX)
 		{
-			rd_MEM_WB = (MEM_WB.IR & 0x001F0000) >> 16;
+			generation = JIT_GENERATION;
+			next = jit_lookup(CURRENT_STATE.PC);
+			blk = &JIT_BLOCKS[link >> 1];
+			if(next != NULL && generation == JIT_GENERATION)
+			{
+				blk->exit[link & 1][0] = 0xE9;
+				jit_rel32(blk->exit[link & 1] + 1, next->code);
+			}
 		}
+	}
+	INSTRUCTION_COUNT += translated;
+	return executed;
+}
+#else
+uint32_t jit_run(uint32_t max_instructions, uint32_t stop_pc)
+{
+	return func_run(max_instructions, stop_pc);
+}
+void jit_flush() { }
+void jit_release() { }
+void jit_invalidate(uint32_t address, uint32_t size) { }
+#endif
 
-		// Normal Case (Lab 3 stuff)
-		ID_EX.A = CURRENT_STATE.REGS[rs]; 
-		ID_EX.B = CURRENT_STATE.REGS[rt];
-
-		if(CURRENT_STATE.REGS[rs] != NEXT_STATE.REGS[rs])
-		{
-			ID_EX.A = NEXT_STATE.REGS[rs]; 
-		}
-		if(CURRENT_STATE.REGS[rt] != NEXT_STATE.REGS[rt])
-		{
-			ID_EX.B = NEXT_STATE.REGS[rt]; 
-		}	
+/************************************************************/
+/* Hash of every non-zero word in memory, for comparing runs               */ 
+/************************************************************/
+static uint64_t mem_digest()
+{
+	uint64_t hash = 14695981039346656037ULL;
+	uint32_t i, j, k, word;
 
-		// sign extend immediate
-		// if the 16th bit is set, sign extend	
-		if( immediate & 0x00008000)
-		{
-			printf("SET \n");
-			ID_EX.imm = immediate | 0xFFFF0000;
+	for (i = 0; i < MEM_DIR_ENTRIES; i++) {
+		if (MEM_PAGE_DIR[i] == NULL) {
+			continue;
 		}
-		else
-			ID_EX.imm = immediate;
-
-
-		// FORWARDING SECTION
-		//forward from EX stage									//rs_ID_EX
-		if((REG_WRITE_EX_MEM != 0) && (rd_EX_MEM != 0) && (rd_EX_MEM == rs))
-		{	
-			if(!(opcode_EX_MEM > 0x28 ))
-			{
-				//Forward A = 0x10
-				ID_EX.A = EX_MEM.ALUOutput;
-				printf("rs-rd collision from EX_MEM \n");
-				printf("condition 1\n");
-
-				// Specific Logic for if a Load Word hazard is found
-				if((0x20 <= opcode_EX_MEM) && (opcode_EX_MEM <= 0x23))
-				{
-					printf("LW Hazard Detected \n");
-					stallCounter = 1;
-				}
-
-				forwardFlag = true;
+		for (j = 0; j < MEM_TABLE_ENTRIES; j++) {
+			if (MEM_PAGE_DIR[i][j] == NULL) {
+				continue;
 			}
-		}							   							//rt_ID_EX
-		if((REG_WRITE_EX_MEM != 0) && (rd_EX_MEM != 0) && (rd_EX_MEM == rt))
-		{
-			// Opcodes that are to be included for hazard detection
-			if(((0x0F < opcode) || (opcode == 0x0) || (opcode < 0x8)) && !(opcode_EX_MEM > 0x28 ) )
-			{
-				//ForwardB = 0x10
-				ID_EX.B = EX_MEM.ALUOutput;
-				printf("rt-rd collision from EX_MEM \n");
-				printf("condition 2\n");
-				//printf(" %08x \n", EX_MEM.ALUOutput);
-
-				// Specific Logic for if a Load Word hazard is found
-				if((0x20 <= opcode_EX_MEM) && (opcode_EX_MEM <= 0x23))
-				{
-					printf("LW Hazard Detected \n");
-					stallCounter = 1;
+			for (k = 0; k < MEM_PAGE_SIZE; k += 4) {
+				word = load_le32(MEM_PAGE_DIR[i][j] + k);
+				if (word != 0) {
+					hash = (hash ^ ((i << MEM_DIR_SHIFT) | (j << MEM_PAGE_SHIFT) | k)) * 1099511628211ULL;
+					hash = (hash ^ word) * 1099511628211ULL;
 				}
-
-				forwardFlag = true;
-
 			}
 		}
+	}
+	return hash;
+}
 
-		//forward from MEM stage											//rs_ID_EX		//rs_ID_EX
-		if((REG_WRITE_MEM_WB != 0) && (rd_MEM_WB != 0) && !((REG_WRITE_EX_MEM != 0) && (rd_EX_MEM != 0) && (rd_EX_MEM == rs)) && (rd_MEM_WB == rs))
-		{
-			if(!(opcode_MEM_WB > 0x28 ))
-			{
-				//ForwardA = 0x01
-				ID_EX.A = MEM_WB.ALUOutput;
-				//might need to stall for WB
-				printf("rs-rd collision from MEM_WB \n");
-				printf("condition 3\n");
-
-				// If load word hazard we need the LMD val, not the ALUoutput
-				if((0x20 <= opcode_MEM_WB) && (opcode_MEM_WB <= 0x23))
-				{
-					ID_EX.A = MEM_WB.LMD;
-				}
+/************************************************************/
+/* Differential test: run the program for the given number of              */
+/* instructions through the interpreter and then the JIT, from a fresh */
+/* load each time, and compare the architectural state and memory    */ 
+/************************************************************/
+bool jit_check(uint32_t instructions)
+{
+	CPU_State expect;
+	uint32_t expect_executed, expect_count, executed;
+	uint64_t expect_mem;
+	int saved_trace = TRACE_LEVEL;
+	int i;
+	bool ok;
 
-				forwardFlag = true;
-			}
-		}														//rt_ID_EX		//rt_ID_EX
-		if((REG_WRITE_MEM_WB != 0) && (rd_MEM_WB != 0) && !((REG_WRITE_EX_MEM != 0) && (rd_EX_MEM != 0) && (rd_EX_MEM == rt)) && (rd_MEM_WB == rt))
-		{
-			if(((0x0F < opcode) || (opcode == 0x0)) && !(opcode_MEM_WB > 0x28 ))
-			{
-				//ForwardB = 0x01
-				ID_EX.B = MEM_WB.ALUOutput;
-				printf("rt-rd collision from MEM_WB \n");
-				printf("condition 4\n");
-
-				// If load word hazard we need the LMD val, not the ALUoutput
-				if((0x20 <= opcode_MEM_WB) && (opcode_MEM_WB <= 0x23))
-				{
-					ID_EX.A = MEM_WB.LMD;
-				}
+	TRACE_LEVEL = TRACE_NONE;
+	reset();
+	restart_program();
+	expect_executed = func_run(instructions, UINT32_MAX);
+	expect = CURRENT_STATE;
+	expect_count = INSTRUCTION_COUNT;
+	expect_mem = mem_digest();
 
-				forwardFlag = true;
+	// translate every block on first sight, or short programs never leave the interpreter
+	reset();
+	restart_program();
+	JIT_EAGER = true;
+	executed = jit_run(instructions, UINT32_MAX);
+	JIT_EAGER = false;
+	ok = executed == expect_executed && INSTRUCTION_COUNT == expect_count;
 
-			}
+	if (CURRENT_STATE.PC != expect.PC) {
+		printf("PC: interpreter 0x%08x, jit 0x%08x\n", expect.PC, CURRENT_STATE.PC);
+		ok = false;
+	}
+	for (i = 0; i < MIPS_REGS; i++) {
+		if (CURRENT_STATE.REGS[i] != expect.REGS[i]) {
+			printf("R%d: interpreter 0x%08x, jit 0x%08x\n", i, expect.REGS[i], CURRENT_STATE.REGS[i]);
+			ok = false;
 		}
+	}
+	if (CURRENT_STATE.HI != expect.HI || CURRENT_STATE.LO != expect.LO) {
+		printf("HI/LO: interpreter 0x%08x/0x%08x, jit 0x%08x/0x%08x\n", expect.HI, expect.LO, CURRENT_STATE.HI, CURRENT_STATE.LO);
+		ok = false;
+	}
+	if (mem_digest() != expect_mem) {
+		printf("memory contents differ\n");
+		ok = false;
+	}
+	printf("jit check %s: %u instructions, %s\n", prog_file, executed, ok ? "OK" : "MISMATCH");
 
-		if(forwardFlag)
-		{
-			printf("Forwarding... \n");
-			forwardFlag = false;
-		}
-		// otherwise only pass on zeros
-		if(stallCounter != 0 )
-		{
-			printf("Hazard Detected \n");
-			ID_EX.IR = 0;
-			ID_EX.A = 0;
-			ID_EX.B = 0;
-			ID_EX.imm = 0;
+	reset();
+	restart_program();
+	TRACE_LEVEL = saved_trace;
+	return ok;
+}
 
-		}
+/************************************************************/
+/* Stop fetching and run the pipeline until every instruction in        */
+/* flight has retired, leaving CURRENT_STATE.PC at the next one          */ 
+/************************************************************/
+void pipeline_drain()
+{
+	fetch_gated = true;
+	while(RUN_FLAG && (ooo_active() ? (OOO.count != 0 || OOO.fetched.count != 0) : superscalar_active() ?
+		(SS.if_id.count != 0 || SS.id_ex.count != 0 || SS.ex_mem.count != 0 || SS.mem_wb.count != 0) :
+		(IF_ID.IR != 0 || ID_EX.IR != 0 || EX_MEM.IR != 0 || MEM_WB.IR != 0 || stallCounter != 0 || delay_slot_pending ||
+		STORE_BUFFER.count != 0 || pipe_busy(&PIPE))))
+	{
+		cycle();
 	}
+	fetch_gated = false;
+}
 
-	/* Branch & Jump Detection Section*/
-	opcode = (IF_ID.IR & 0xFC000000) >> 26;
-	uint32_t function = IF_ID.IR & 0x0000003F;
-	// if the opcode is a branch or jump instruction, set the branch_jump flag!
-	// if(0x01 <= opcode <= 0x07 || 0x08 <= function <= 0x09 )
-	if((0x01 <= opcode && opcode <= 0x07) || (function == 0x08) || (function == 0x09) ) 
+/************************************************************/
+/* Fast-forward functionally for max_instructions, or until the PC      */
+/* reaches stop_pc, then hand the state back to the pipeline model     */ 
+/************************************************************/
+void fast_forward(uint32_t max_instructions, uint32_t stop_pc)
+{
+	uint32_t executed = 0;
+
+	if(RUN_FLAG == FALSE)
 	{
-		printf("Opcode of 0x%08X is 0x%08X \n", IF_ID.IR, opcode);
-		printf("Branch or Jump Instruction detected: \n");
-		// branch_jump_flag = true;
+		printf("Simulation Stopped.\n\n");
+		return;
 	}
 
+	// retire what the pipeline holds so the architectural state is exact
+	pipeline_drain();
+	store_buffer_flush();
+
+	executed = JIT_ENABLED ? jit_run(max_instructions, stop_pc) : func_run(max_instructions, stop_pc);
+
+	// hand over: the pipeline restarts empty at the fast-forwarded PC
+	NEXT_STATE = CURRENT_STATE;
+	bubble_latch(&IF_ID);
+	bubble_latch(&ID_EX);
+	bubble_latch(&EX_MEM);
+	bubble_latch(&MEM_WB);
+	pipe_reset();
+	stallCounter = 0;
+	branch_jump_flag = false;
+	delay_slot_pending = false;
+	SS.redirect = false;
+	OOO.resync = true;
+	OOO.redirect = false;
+	REG_WRITE_EX_MEM = REG_WRITE_MEM_WB = 0;
 
+	TRACE(TRACE_INFO, "Fast-forwarded %u instructions, PC: 0x%08x\n\n", executed, CURRENT_STATE.PC);
 }
 
 /************************************************************/
-/* instruction fetch (IF) pipeline stage:                                                              */ 
+/* Pipeline throughput benchmark: rerun the program until the given  */
+/* number of cycles has been simulated and report cycles per second */ 
 /************************************************************/
-void IF()
+void bench_simulation(uint32_t cycles)
 {
-	if(stallCounter == 0 && !branch_jump_flag)
-	{
-		IF_ID.IR = mem_read_32(CURRENT_STATE.PC);
-		IF_ID.PC = CURRENT_STATE.PC;
-		printf("Current Instruction: 0x%08X \n", IF_ID.IR);
+	uint32_t done = 0, runs = 0;
+	int saved_trace = TRACE_LEVEL;
+	double t0, elapsed;
 
-		// increment PC
-		NEXT_STATE.PC = CURRENT_STATE.PC + 4;
+	TRACE_LEVEL = TRACE_NONE;
+	snapshot_save(SNAPSHOT_SCRATCH);
+	restart_program();
+	t0 = now_seconds();
+	while (done < cycles) {
+		if (RUN_FLAG == FALSE) {
+			restart_program();
+			runs++;
+		}
+		cycle();
+		done++;
 	}
-	// effectively stalling IF there is a branch to be taken
-	if(branch_jump_flag == true)
-	{
-		branch_jump_flag = false;
-		IF_ID.IR = 0;
-		IF_ID.PC = 0;
+	elapsed = now_seconds() - t0;
+	TRACE_LEVEL = saved_trace;
+
+	printf("%s dispatch: %u cycles (%u program runs) in %.3f s, %.0f cycles/sec\n\n",
+		EX_DISPATCH_NAME, done, runs, elapsed, done / elapsed);
+	snapshot_restore(SNAPSHOT_SCRATCH);
+	snapshot_drop(SNAPSHOT_SCRATCH);
+}
+
+/************************************************************/
+/* Rerun the program through a functional engine for the given number */
+/* of instructions, returning the elapsed seconds                                    */ 
+/************************************************************/
+static double bench_engine(uint32_t (*engine)(uint32_t, uint32_t), uint32_t instructions, uint32_t *runs)
+{
+	uint32_t done = 0;
+	double t0, elapsed;
 
-		ID_EX.IR = 0;
-		ID_EX.A = 0;
-		ID_EX.B = 0;
-		ID_EX.imm = 0;
+	*runs = 0;
+	snapshot_save(SNAPSHOT_SCRATCH);
+	restart_program();
+	t0 = now_seconds();
+	while (done < instructions) {
+		done += engine(instructions - done, UINT32_MAX);
+		if (RUN_FLAG == FALSE) {
+			restart_program();
+			(*runs)++;
+		}
 	}
-	
+	elapsed = now_seconds() - t0;
+	snapshot_restore(SNAPSHOT_SCRATCH);
+	snapshot_drop(SNAPSHOT_SCRATCH);
+	return elapsed;
+}
+
+/************************************************************/
+/* Functional throughput benchmark, the fast-forward counterpart      */
+/* of bench_simulation()                                                                           */ 
+/************************************************************/
+void bench_functional(uint32_t instructions)
+{
+	uint32_t runs;
+	double elapsed = bench_engine(func_run, instructions, &runs);
+
+	printf("functional: %u instructions (%u program runs) in %.3f s, %.0f instructions/sec\n\n",
+		instructions, runs, elapsed, instructions / elapsed);
 }
 
+/************************************************************/
+/* Interpreter against JIT, in millions of simulated instructions per */
+/* second                                                                                                          */ 
+/************************************************************/
+void bench_jit(uint32_t instructions)
+{
+	uint32_t runs;
+	double interp, jit;
+
+	interp = bench_engine(func_run, instructions, &runs);
+	jit = bench_engine(jit_run, instructions, &runs);
+
+	printf("interpreter: %.1f MIPS, jit: %.1f MIPS (%u program runs, %u blocks, %u KB code), speedup %.1fx\n\n",
+		instructions / interp / 1e6, instructions / jit / 1e6, runs, JIT_NUM_BLOCKS, JIT_CODE_USED / 1024,
+		interp / jit);
+}
 
 /************************************************************/
 /* Initialize Memory                                                                                                    */ 
 /************************************************************/
 void initialize() { 
 	init_memory();
+	bubble_latch(&IF_ID);
+	bubble_latch(&ID_EX);
+	bubble_latch(&EX_MEM);
+	bubble_latch(&MEM_WB);
+	mdu_reset();
+	ss_reset();
 	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
 	NEXT_STATE = CURRENT_STATE;
 	RUN_FLAG = TRUE;
@@ -1133,36 +6689,26 @@ void initialize() {
 /************************************************************/
 void print_program(uint32_t addr){
 	/*IMPLEMENT THIS*/
-	uint32_t instruction, opcode, function, rs, rt, rd, sa, immediate, target;
-	
-	instruction = mem_read_32(addr);
-	
-	opcode = (instruction & 0xFC000000) >> 26;
-	function = instruction & 0x0000003F;
-	rs = (instruction & 0x03E00000) >> 21;
-	rt = (instruction & 0x001F0000) >> 16;
-	rd = (instruction & 0x0000F800) >> 11;
-	sa = (instruction & 0x000007C0) >> 6;
-	immediate = instruction & 0x0000FFFF;
-	target = instruction & 0x03FFFFFF;
+	const decoded_inst_t *d = decode_lookup(addr);
+	uint32_t rs = d->rs, rt = d->rt, rd = d->rd, sa = d->sa, immediate = d->imm, target = d->target;
 	
-	if(opcode == 0x00){
+	if(d->opcode == 0x00){
 		/*R format instructions here*/
 		
-		switch(function){
-			case 0x00:
+		switch(d->op){
+			case OP_SLL:
 				printf("SLL $r%u, $r%u, 0x%x\n", rd, rt, sa);
 				break;
-			case 0x02:
+			case OP_SRL:
 				printf("SRL $r%u, $r%u, 0x%x\n", rd, rt, sa);
 				break;
-			case 0x03:
+			case OP_SRA:
 				printf("SRA $r%u, $r%u, 0x%x\n", rd, rt, sa);
 				break;
-			case 0x08:
+			case OP_JR:
 				printf("JR $r%u\n", rs);
 				break;
-			case 0x09:
+			case OP_JALR:
 				if(rd == 31){
 					printf("JALR $r%u\n", rs);
 				}
@@ -1170,58 +6716,58 @@ void print_program(uint32_t addr){
 					printf("JALR $r%u, $r%u\n", rd, rs);
 				}
 				break;
-			case 0x0C:
+			case OP_SYSCALL:
 				printf("SYSCALL\n");
 				break;
-			case 0x10:
+			case OP_MFHI:
 				printf("MFHI $r%u\n", rd);
 				break;
-			case 0x11:
+			case OP_MTHI:
 				printf("MTHI $r%u\n", rs);
 				break;
-			case 0x12:
+			case OP_MFLO:
 				printf("MFLO $r%u\n", rd);
 				break;
-			case 0x13:
+			case OP_MTLO:
 				printf("MTLO $r%u\n", rs);
 				break;
-			case 0x18:
+			case OP_MULT:
 				printf("MULT $r%u, $r%u\n", rs, rt);
 				break;
-			case 0x19:
+			case OP_MULTU:
 				printf("MULTU $r%u, $r%u\n", rs, rt);
 				break;
-			case 0x1A:
+			case OP_DIV:
 				printf("DIV $r%u, $r%u\n", rs, rt);
 				break;
-			case 0x1B:
+			case OP_DIVU:
 				printf("DIVU $r%u, $r%u\n", rs, rt);
 				break;
-			case 0x20:
+			case OP_ADD:
 				printf("ADD $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x21:
+			case OP_ADDU:
 				printf("ADDU $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x22:
+			case OP_SUB:
 				printf("SUB $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x23:
+			case OP_SUBU:
 				printf("SUBU $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x24:
+			case OP_AND:
 				printf("AND $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x25:
+			case OP_OR:
 				printf("OR $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x26:
+			case OP_XOR:
 				printf("XOR $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x27:
+			case OP_NOR:
 				printf("NOR $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
-			case 0x2A:
+			case OP_SLT:
 				printf("SLT $r%u, $r%u, $r%u\n", rd, rs, rt);
 				break;
 			default:
@@ -1230,70 +6776,68 @@ void print_program(uint32_t addr){
 		}
 	}
 	else{
-		switch(opcode){
-			case 0x01:
-				if(rt == 0){
-					printf("BLTZ $r%u, 0x%x\n", rs, immediate<<2);
-				}
-				else if(rt == 1){
-					printf("BGEZ $r%u, 0x%x\n", rs, immediate<<2);
-				}
+		switch(d->op){
+			case OP_BLTZ:
+				printf("BLTZ $r%u, 0x%x\n", rs, immediate<<2);
+				break;
+			case OP_BGEZ:
+				printf("BGEZ $r%u, 0x%x\n", rs, immediate<<2);
 				break;
-			case 0x02:
+			case OP_J:
 				printf("J 0x%x\n", (addr & 0xF0000000) | (target<<2));
 				break;
-			case 0x03:
+			case OP_JAL:
 				printf("JAL 0x%x\n", (addr & 0xF0000000) | (target<<2));
 				break;
-			case 0x04:
+			case OP_BEQ:
 				printf("BEQ $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
 				break;
-			case 0x05:
+			case OP_BNE:
 				printf("BNE $r%u, $r%u, 0x%x\n", rs, rt, immediate<<2);
 				break;
-			case 0x06:
+			case OP_BLEZ:
 				printf("BLEZ $r%u, 0x%x\n", rs, immediate<<2);
 				break;
-			case 0x07:
+			case OP_BGTZ:
 				printf("BGTZ $r%u, 0x%x\n", rs, immediate<<2);
 				break;
-			case 0x08:
+			case OP_ADDI:
 				printf("ADDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
-			case 0x09:
+			case OP_ADDIU:
 				printf("ADDIU $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
-			case 0x0A:
+			case OP_SLTI:
 				printf("SLTI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
-			case 0x0C:
+			case OP_ANDI:
 				printf("ANDI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
-			case 0x0D:
+			case OP_ORI:
 				printf("ORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
-			case 0x0E:
+			case OP_XORI:
 				printf("XORI $r%u, $r%u, 0x%x\n", rt, rs, immediate);
 				break;
-			case 0x0F:
+			case OP_LUI:
 				printf("LUI $r%u, 0x%x\n", rt, immediate);
 				break;
-			case 0x20:
+			case OP_LB:
 				printf("LB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
-			case 0x21:
+			case OP_LH:
 				printf("LH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
-			case 0x23:
+			case OP_LW:
 				printf("LW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
-			case 0x28:
+			case OP_SB:
 				printf("SB $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
-			case 0x29:
+			case OP_SH:
 				printf("SH $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
-			case 0x2B:
+			case OP_SW:
 				printf("SW $r%u, 0x%x($r%u)\n", rt, immediate, rs);
 				break;
 			default:
@@ -1306,9 +6850,44 @@ void print_program(uint32_t addr){
 /************************************************************/
 /* Print the current pipeline                                                                                    */ 
 /************************************************************/
+static void show_group(const char *name, const ss_group_t *g){
+	uint32_t k;
+
+	printf("%s:", name);
+	for(k = 0; k < g->count; k++)
+		printf(" 0x%08X@0x%08X", g->slot[k].d.IR, g->slot[k].pc);
+	printf("\n");
+}
+
 void show_pipeline(){
+	const ooo_entry_t *e;
+	uint32_t k;
+
 	printf("\n---Pipeline Contents---\n");
 	printf("Cycle Count: %d \n", CYCLE_COUNT);
+	if(ooo_active())
+	{
+		// ROB oldest first: waiting in a station, executing, or done
+		printf("PC: 0x%08X, fetch PC: 0x%08X, ROB %u/%u\n", CURRENT_STATE.PC, OOO.fetch_pc, OOO.count, OOO.rob_entries);
+		show_group("Fetched", &OOO.fetched);
+		for(k = 0; k < OOO.count; k++)
+		{
+			e = &OOO.rob[(OOO.head + k) % OOO.rob_entries];
+			printf("ROB[%u]: 0x%08X@0x%08X %s\n", k, e->d.IR, e->pc,
+				e->in_rs ? "waiting" : (ooo_done(e) ? "done" : "executing"));
+		}
+		return;
+	}
+	if(superscalar_active())
+	{
+		// instruction@PC for each slot, oldest first
+		printf("PC: 0x%08X (%u-wide)\n", CURRENT_STATE.PC, SS.width);
+		show_group("IF/ID", &SS.if_id);
+		show_group("ID/EX", &SS.id_ex);
+		show_group("EX/MEM", &SS.ex_mem);
+		show_group("MEM/WB", &SS.mem_wb);
+		return;
+	}
 	//IF/ID pipeline register
 	printf("PC: 0x%08X \n", CURRENT_STATE.PC - 4); // this is often called after running a cylce, so to show
 													// the expected PC, show the previous one
@@ -1338,26 +6917,631 @@ void show_pipeline(){
 	printf("MEM/WB.LMD 0x%08x \n", MEM_WB.LMD);
 }
 
+/***************************************************************/
+/* Print command line usage                                                                                       */
+/***************************************************************/
+void usage(const char *name) {
+	printf("Usage: %s [options] <input program>...\n\n", name);
+	printf("The program is a hex .in file, a MUMI image or an ELF32 little-endian MIPS executable.\n");
+	printf("Without --batch the simulator starts the interactive prompt.\n\n");
+	printf("--batch\t\t\t-- run without the prompt, then print the requested dumps and exit\n");
+	printf("--cycles <n>\t\t-- in batch mode, stop after <n> cycles (default: run to completion)\n");
+	printf("--forwarding <0|1>\t-- disable/enable forwarding, a list such as 0,1 runs every program with each\n");
+	printf("--early-branch <0|1>\t-- resolve branches in EX (default) or ID\n");
+	printf("--delay-slot <0|1>\t-- execute the instruction after every branch and jump, as on MIPS hardware\n");
+	printf("--jobs <n>\t\t-- worker threads for a parallel run (default: one per core)\n");
+	printf("--ff <n>\t\t-- fast-forward <n> instructions functionally before the pipelined run\n");
+	printf("--ff-pc <addr>\t\t-- fast-forward functionally until the PC reaches <addr> (hex)\n");
+	printf("--write-image <file>\t-- save the loaded program as a binary MUMI image and exit\n");
+	printf("--jit\t\t\t-- fast-forward through the JIT\n");
+	printf("--jit-check <n>\t\t-- compare <n> instructions of interpreter and JIT, then exit\n");
+	printf("--trace <n>\t\t-- trace level, 0 none .. 3 detail (batch default 0, interactive 3)\n");
+	printf("--dump regs\t\t-- dump registers when the run ends\n");
+	printf("--dump pipeline\t\t-- dump the pipeline registers when the run ends\n");
+	printf("--dump mem:<start>:<stop>\t-- dump memory (hex addresses) when the run ends\n");
+	printf("--stats-json <file>\t-- write the pipeline counters as JSON on exit (- for stdout)\n");
+	printf("--pipetrace <file>\t-- record the pipeline registers, stalls, flushes and forwards of a single run\n");
+	printf("--pipetrace-convert <trace> <out>\t-- write a trace as Chrome trace JSON if <out> ends in .json, else for Konata\n");
+	printf("--profile <n>\t\t-- profile every instruction of a single run and print the <n> most expensive instructions and blocks\n");
+	printf("--l1i <spec>\t\t-- L1 instruction cache, <size>:<assoc>:<line>[:lru|plru|random[:wb|wt[:<miss cycles>]]]\n");
+	printf("--l1d <spec>\t\t-- L1 data cache, same format (default: no caches, single-cycle memory)\n");
+	printf("--l2 <spec>\t\t-- unified L2 below both, same format with the hit latency last; brings the DRAM model\n");
+	printf("--dram <banks>:<row bytes>[:<tCAS>[:<tRCD>[:<tRP>]]]\t-- DRAM with open row buffers (default 8:2k:15:15:15)\n");
+	printf("--mshrs <n>\t\t-- misses outstanding below the L1s at once (default 8)\n");
+	printf("--prefetch <kind>[:<degree>[:<entries>]]\t-- L1D prefetcher: nextline, stride (PC-indexed table) or stream\n");
+	printf("--store-buffer <n>\t-- stores retire into an <n>-entry buffer that drains to the L1D (default 0: none)\n");
+	printf("--stages <list>\t\t-- scalar pipeline depth, e.g. IF1,IF2,ID,EX1,EX2,MEM1,MEM2,WB (default IF,ID,EX,MEM,WB)\n");
+	printf("--issue <n>\t\t-- superscalar in-order pipeline, up to <n> instructions per cycle (default 1)\n");
+	printf("--ooo <rob>[:<rs>[:<lsq>[:<width>]]]\t-- out-of-order core instead, checked against the functional model\n");
+	printf("\t\t\t   after the run (default stations and queue half the ROB, width 4)\n");
+	printf("--mdu <mult>[:<div>]\t-- multiply/divide unit latency in cycles (default 1:1)\n");
+	printf("--bp <spec>\t\t-- branch predictor, <nottaken|bimodal|gshare|tournament>[:<table bits>[:<btb>[:<ras>]]]\n");
+	printf("\t\t\t   (default nottaken with no BTB: every taken branch flushes)\n\n");
+	printf("With several programs, a forwarding list or --jobs, every program/forwarding pair is\n");
+	printf("simulated on a pool of threads (use --cycles to cap programs that never exit) and one\n");
+	printf("report with cycles, instructions and a digest of the final state is printed instead of dumps.\n\n");
+}
+
+/***************************************************************/
+/* Non-interactive run: simulate, then print the --dump requests       */
+/***************************************************************/
+int run_batch(uint32_t cycles, int argc, char *argv[]) {
+	uint32_t start, stop;
+	int i, status = 0;
+
+	if (cycles == 0) {
+		runAll();
+	}
+	else {
+		run(cycles);
+	}
+	if (ooo_active() && !ooo_check(true)) {
+		status = 1;
+	}
+
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--profile") == 0) {
+			profile_report(strtoul(argv[i+1], NULL, 0));
+			continue;
+		}
+		if (strcmp(argv[i], "--dump") != 0) {
+			continue;
+		}
+		if (strcmp(argv[i+1], "regs") == 0) {
+			rdump();
+		}
+		else if (strcmp(argv[i+1], "pipeline") == 0) {
+			show_pipeline();
+		}
+		else if (sscanf(argv[i+1], "mem:%x:%x", &start, &stop) == 2) {
+			mdump(start, stop);
+		}
+		else {
+			printf("Error: unknown dump '%s'\n", argv[i+1]);
+			return 1;
+		}
+	}
+	return status;
+}
+
+/***************************************************************/
+/* Hash of the architectural state: registers, HI/LO and memory         */
+/***************************************************************/
+static uint64_t state_digest() {
+	uint64_t hash = mem_digest();
+	int i;
+
+	for (i = 0; i < MIPS_REGS; i++) {
+		hash = (hash ^ CURRENT_STATE.REGS[i]) * 1099511628211ULL;
+	}
+	hash = (hash ^ CURRENT_STATE.HI) * 1099511628211ULL;
+	hash = (hash ^ CURRENT_STATE.LO) * 1099511628211ULL;
+	return hash;
+}
+
+/***************************************************************/
+/* Check the out-of-order core against the functional model: rerun    */
+/* as many instructions as it retired from a fresh load and compare  */
+/* the PC, registers, HI/LO and memory. The run is left where it was. */
+/***************************************************************/
+bool ooo_check(bool report) {
+	CPU_State expect = CURRENT_STATE;
+	uint32_t instructions = INSTRUCTION_COUNT;
+	uint64_t expect_digest = state_digest();
+	int saved_trace = TRACE_LEVEL;
+	int i;
+	bool ok;
+
+	TRACE_LEVEL = TRACE_NONE;
+	snapshot_save(SNAPSHOT_SCRATCH);
+	reset();
+	restart_program();
+	INSTRUCTION_COUNT = 0;
+	func_run(instructions, UINT32_MAX);
+	ok = state_digest() == expect_digest && CURRENT_STATE.PC == expect.PC;
+
+	if (report) {
+		if (CURRENT_STATE.PC != expect.PC) {
+			printf("PC: functional 0x%08x, out-of-order 0x%08x\n", CURRENT_STATE.PC, expect.PC);
+		}
+		for (i = 0; i < MIPS_REGS; i++) {
+			if (CURRENT_STATE.REGS[i] != expect.REGS[i]) {
+				printf("R%d: functional 0x%08x, out-of-order 0x%08x\n", i, CURRENT_STATE.REGS[i], expect.REGS[i]);
+			}
+		}
+		if (CURRENT_STATE.HI != expect.HI || CURRENT_STATE.LO != expect.LO) {
+			printf("HI/LO: functional 0x%08x/0x%08x, out-of-order 0x%08x/0x%08x\n",
+				CURRENT_STATE.HI, CURRENT_STATE.LO, expect.HI, expect.LO);
+		}
+		printf("ooo check %s: %u instructions, %s\n", prog_file, instructions, ok ? "OK" : "MISMATCH");
+	}
+
+	snapshot_restore(SNAPSHOT_SCRATCH);
+	snapshot_drop(SNAPSHOT_SCRATCH);
+	TRACE_LEVEL = saved_trace;
+	return ok;
+}
+
+/***************************************************************/
+/* Run one job on the calling thread's simulator instance                   */
+/***************************************************************/
+static void run_job(sim_batch_t *batch, sim_job_t *job) {
+	double t0 = now_seconds();
+
+	TRACE_LEVEL = TRACE_NONE;
+	ENABLE_FORWARDING = job->forwarding;
+	ENABLE_EARLY_BRANCH = batch->early_branch;
+	ENABLE_DELAY_SLOT = batch->delay_slot;
+	JIT_ENABLED = batch->jit;
+	snprintf(prog_file, sizeof(prog_file), "%s", job->program);
+
+	initialize();
+	job->loaded = load_program() && (batch->l1i == NULL || cache_configure(&L1I, batch->l1i)) &&
+		(batch->l1d == NULL || cache_configure(&L1D, batch->l1d)) && (batch->bp == NULL || bp_configure(batch->bp)) &&
+		(batch->mdu == NULL || mdu_configure(batch->mdu)) && (batch->issue == NULL || ss_configure(batch->issue)) &&
+		(batch->ooo == NULL || ooo_configure(batch->ooo)) &&
+		(batch->l2 == NULL || memsys_configure("l2", batch->l2)) &&
+		(batch->dram == NULL || memsys_configure("dram", batch->dram)) &&
+		(batch->mshrs == NULL || memsys_configure("mshrs", batch->mshrs)) &&
+		(batch->prefetch == NULL || prefetch_configure(batch->prefetch)) &&
+		(batch->store_buffer == NULL || store_buffer_configure(batch->store_buffer)) &&
+		(batch->stages == NULL || pipe_configure(batch->stages));
+	if (job->loaded) {
+		restart_program();
+		INSTRUCTION_COUNT = 0;
+		CYCLE_COUNT = 0;
+		if (batch->ff_instructions != 0 || batch->ff_pc != UINT32_MAX) {
+			fast_forward(batch->ff_instructions != 0 ? batch->ff_instructions : UINT32_MAX, batch->ff_pc);
+		}
+		if (batch->cycles == 0) {
+			runAll();
+		}
+		else {
+			run(batch->cycles);
+		}
+		// a run cut short by --cycles can leave stores buffered, the digest wants them in memory
+		store_buffer_flush();
+		job->finished = RUN_FLAG == FALSE;
+		job->cycles = CYCLE_COUNT;
+		job->instructions = INSTRUCTION_COUNT;
+		job->pc = CURRENT_STATE.PC;
+		job->digest = state_digest();
+		job->counters = COUNTERS;
+		job->l1i = L1I;
+		job->l1d = L1D;
+		job->l2 = L2;
+		job->dram = DRAM;
+		job->memsys = MEMSYS;
+		job->prefetch = PREFETCH;
+		job->store_buffer = STORE_BUFFER;
+		job->bp = BP;
+		job->mdu = MDU;
+		job->ss = SS;
+		job->ooo = OOO;
+		if (ooo_active()) {
+			job->ooo_check = ooo_check(false) ? 1 : -1;
+		}
+	}
+	// the job keeps the cache statistics, not the tag arrays
+	job->l1i.tags = job->l1d.tags = job->l1i.plru = job->l1d.plru = NULL;
+	job->l1i.lru = job->l1d.lru = NULL;
+	job->l2.tags = job->l2.plru = NULL;
+	job->l2.lru = NULL;
+	job->bp.bimodal = job->bp.gshare = job->bp.chooser = NULL;
+	job->bp.btb_tags = job->bp.btb_targets = job->bp.ras = NULL;
+	job->ooo.rob = NULL;
+	cache_release(&L1I);
+	cache_release(&L1D);
+	cache_release(&L2);
+	memset(&DRAM, 0, sizeof(DRAM));
+	memset(&MEMSYS, 0, sizeof(MEMSYS));
+	memset(&PREFETCH, 0, sizeof(PREFETCH));
+	bp_release();
+	ooo_release();
+	free_memory();
+	job->seconds = now_seconds() - t0;
+}
+
+/***************************************************************/
+/* Take a job from the tail of the worker's own queue, or steal one    */
+/* from the head of another. No jobs are added once the run starts,    */
+/* so finding every queue empty means the batch is done.                   */
+/***************************************************************/
+static bool next_job(sim_batch_t *batch, int worker, uint32_t *index) {
+	sim_queue_t *queue;
+	int i;
+
+	for (i = 0; i < batch->num_workers; i++) {
+		queue = &batch->queues[(worker + i) % batch->num_workers];
+		pthread_mutex_lock(&queue->lock);
+		if (queue->head != queue->tail) {
+			*index = i == 0 ? queue->jobs[--queue->tail] : queue->jobs[queue->head++];
+			pthread_mutex_unlock(&queue->lock);
+			return true;
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+	return false;
+}
+
+typedef struct {
+	sim_batch_t *batch;
+	int worker;
+} sim_worker_t;
+
+static void *batch_worker(void *arg) {
+	sim_worker_t *self = arg;
+	uint32_t index;
+
+	while (next_job(self->batch, self->worker, &index)) {
+		self->batch->jobs[index].worker = self->worker;
+		run_job(self->batch, &self->batch->jobs[index]);
+	}
+	jit_release();
+	return NULL;
+}
+
+/***************************************************************/
+/* Run every job of the batch on num_workers threads, each thread     */
+/* being an independent simulator instance, then print one report.     */
+/* Returns non-zero if any program failed to load.                                */
+/***************************************************************/
+int run_parallel(sim_batch_t *batch) {
+	pthread_t *threads;
+	sim_worker_t *workers;
+	uint64_t total_cycles = 0, total_instructions = 0;
+	uint32_t i, done = 0, stopped = 0, failed = 0, mismatched = 0;
+	double t0, elapsed, busy = 0;
+	const char *status;
+	int w;
+
+	if (batch->num_workers > (int)batch->num_jobs) {
+		batch->num_workers = batch->num_jobs;
+	}
+	threads = calloc(batch->num_workers, sizeof(pthread_t));
+	workers = calloc(batch->num_workers, sizeof(sim_worker_t));
+	batch->queues = calloc(batch->num_workers, sizeof(sim_queue_t));
+	assert(threads != NULL && workers != NULL && batch->queues != NULL);
+
+	// deal the jobs out round-robin, stealing evens out what this gets wrong
+	for (w = 0; w < batch->num_workers; w++) {
+		pthread_mutex_init(&batch->queues[w].lock, NULL);
+		batch->queues[w].jobs = calloc(batch->num_jobs / batch->num_workers + 1, sizeof(uint32_t));
+		assert(batch->queues[w].jobs != NULL);
+	}
+	for (i = 0; i < batch->num_jobs; i++) {
+		sim_queue_t *queue = &batch->queues[i % batch->num_workers];
+		queue->jobs[queue->tail++] = i;
+	}
+
+	t0 = now_seconds();
+	for (w = 0; w < batch->num_workers; w++) {
+		workers[w].batch = batch;
+		workers[w].worker = w;
+		if (pthread_create(&threads[w], NULL, batch_worker, &workers[w]) != 0) {
+			printf("Error: cannot start worker thread %d\n", w);
+			exit(1);
+		}
+	}
+	for (w = 0; w < batch->num_workers; w++) {
+		pthread_join(threads[w], NULL);
+	}
+	elapsed = now_seconds() - t0;
+
+	printf("%-32s %3s %8s %12s %12s %6s %10s %16s\n",
+		"program", "fwd", "status", "cycles", "instructions", "CPI", "PC", "digest");
+	for (i = 0; i < batch->num_jobs; i++) {
+		sim_job_t *job = &batch->jobs[i];
+		if (!job->loaded) {
+			printf("%-32s %3d %8s\n", job->program, job->forwarding, "error");
+			failed++;
+			continue;
+		}
+		status = job->ooo_check < 0 ? "mismatch" : job->finished ? "done" : "stopped";
+		job->finished ? done++ : stopped++;
+		mismatched += job->ooo_check < 0;
+		total_cycles += job->cycles;
+		total_instructions += job->instructions;
+		busy += job->seconds;
+		printf("%-32s %3d %8s %12u %12u %6.2f 0x%08x %016llx\n", job->program, job->forwarding, status,
+			job->cycles, job->instructions, job->instructions ? (double)job->cycles / job->instructions : 0.0,
+			job->pc, (unsigned long long)job->digest);
+	}
+	printf("\n%u jobs on %d workers: %u done, %u stopped at the cycle limit, %u failed to load\n",
+		batch->num_jobs, batch->num_workers, done, stopped, failed);
+	if (batch->ooo != NULL) {
+		printf("out-of-order check: %u of %u runs match the functional model\n",
+			batch->num_jobs - failed - mismatched, batch->num_jobs - failed);
+	}
+	printf("%llu cycles, %llu instructions in %.3f s (%.3f s of simulation, %.1fx parallel), %.0f cycles/sec\n",
+		(unsigned long long)total_cycles, (unsigned long long)total_instructions, elapsed, busy,
+		elapsed > 0 ? busy / elapsed : 0.0, elapsed > 0 ? total_cycles / elapsed : 0.0);
+
+	if (batch->stats_json != NULL) {
+		FILE *out = strcmp(batch->stats_json, "-") == 0 ? stdout : fopen(batch->stats_json, "w");
+		if (out == NULL) {
+			printf("Error: cannot write stats to %s\n", batch->stats_json);
+			failed++;
+		}
+		else {
+			fprintf(out, "[\n");
+			for (i = 0; i < batch->num_jobs; i++) {
+				sim_job_t *job = &batch->jobs[i];
+				fprintf(out, "  {\n    \"program\": \"%s\",\n    \"forwarding\": %d,\n", job->program, job->forwarding != 0);
+				fprintf(out, "    \"status\": \"%s\",\n", !job->loaded ? "error" : job->finished ? "done" : "stopped");
+				counters_write_json(out, &job->counters, &job->l1i, &job->l1d, &job->l2, &job->dram,
+					&job->memsys, &job->prefetch, &job->store_buffer, &job->bp, &job->mdu, &job->ss, &job->ooo, "    ");
+				fprintf(out, "  }%s\n", i + 1 < batch->num_jobs ? "," : "");
+			}
+			fprintf(out, "]\n");
+			if (out != stdout) {
+				fclose(out);
+			}
+		}
+	}
+
+	for (w = 0; w < batch->num_workers; w++) {
+		pthread_mutex_destroy(&batch->queues[w].lock);
+		free(batch->queues[w].jobs);
+	}
+	free(batch->queues);
+	free(workers);
+	free(threads);
+	return failed != 0 || mismatched != 0;
+}
+
+/***************************************************************/
+/* --stats-json for single runs, written however the simulator exits */
+/***************************************************************/
+static const char *stats_json_path;
+
+static void write_stats_at_exit(void) {
+	stats_write_json(stats_json_path);
+}
+
 /***************************************************************/
 /* main                                                                                                                                   */
 /***************************************************************/
 int main(int argc, char *argv[]) {                              
-	printf("\n**************************\n");
-	printf("Welcome to MU-MIPS SIM...\n");
-	printf("**************************\n\n");
-	
-	if (argc < 2) {
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n",  argv[0]);
-		exit(1);
-	}
+	const char *program = NULL;
+	const char **programs;
+	const char *forwarding = "0";
+	int num_programs = 0, num_workers = 0, num_forwarding;
+	sim_batch_t parallel;
+	bool batch = false;
+	uint32_t cycles = 0;
+	uint32_t ff_instructions = 0, ff_pc = UINT32_MAX;
+	uint32_t jit_check_instructions = 0;
+	const char *image = NULL;
+	const char *l1i = NULL, *l1d = NULL, *l2 = NULL, *dram = NULL, *mshrs = NULL, *prefetch = NULL, *store_buffer = NULL, *bp = NULL, *mdu = NULL, *issue = NULL, *ooo = NULL;
+	const char *stages = NULL;
+	const char *pipetrace = NULL;
+	bool profile = false;
+	int trace = -1;
+	int i;
 
 	// default this to zero
 	ENABLE_FORWARDING = 0;
 	stallCounter = 0;
+	programs = calloc(argc, sizeof(char *));
+	assert(programs != NULL);
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--batch") == 0) {
+			batch = true;
+		}
+		else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc) {
+			cycles = strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--forwarding") == 0 && i + 1 < argc) {
+			forwarding = argv[++i];
+			ENABLE_FORWARDING = atoi(forwarding);
+		}
+		else if (strcmp(argv[i], "--early-branch") == 0 && i + 1 < argc) {
+			ENABLE_EARLY_BRANCH = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--delay-slot") == 0 && i + 1 < argc) {
+			ENABLE_DELAY_SLOT = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			num_workers = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			trace = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--ff") == 0 && i + 1 < argc) {
+			ff_instructions = strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--ff-pc") == 0 && i + 1 < argc) {
+			ff_pc = strtoul(argv[++i], NULL, 16);
+		}
+		else if (strcmp(argv[i], "--write-image") == 0 && i + 1 < argc) {
+			image = argv[++i];
+		}
+		else if (strcmp(argv[i], "--jit") == 0) {
+			JIT_ENABLED = true;
+		}
+		else if (strcmp(argv[i], "--jit-check") == 0 && i + 1 < argc) {
+			jit_check_instructions = strtoul(argv[++i], NULL, 0);
+		}
+		else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc) {
+			i++; /* handled by run_batch() once the run is over */
+		}
+		else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+			stats_json_path = argv[++i];
+		}
+		else if (strcmp(argv[i], "--l1i") == 0 && i + 1 < argc) {
+			l1i = argv[++i];
+		}
+		else if (strcmp(argv[i], "--l1d") == 0 && i + 1 < argc) {
+			l1d = argv[++i];
+		}
+		else if (strcmp(argv[i], "--l2") == 0 && i + 1 < argc) {
+			l2 = argv[++i];
+		}
+		else if (strcmp(argv[i], "--dram") == 0 && i + 1 < argc) {
+			dram = argv[++i];
+		}
+		else if (strcmp(argv[i], "--mshrs") == 0 && i + 1 < argc) {
+			mshrs = argv[++i];
+		}
+		else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc) {
+			prefetch = argv[++i];
+		}
+		else if (strcmp(argv[i], "--store-buffer") == 0 && i + 1 < argc) {
+			store_buffer = argv[++i];
+		}
+		else if (strcmp(argv[i], "--bp") == 0 && i + 1 < argc) {
+			bp = argv[++i];
+		}
+		else if (strcmp(argv[i], "--mdu") == 0 && i + 1 < argc) {
+			mdu = argv[++i];
+		}
+		else if (strcmp(argv[i], "--stages") == 0 && i + 1 < argc) {
+			stages = argv[++i];
+		}
+		else if (strcmp(argv[i], "--issue") == 0 && i + 1 < argc) {
+			issue = argv[++i];
+		}
+		else if (strcmp(argv[i], "--ooo") == 0 && i + 1 < argc) {
+			ooo = argv[++i];
+		}
+		else if (strcmp(argv[i], "--pipetrace") == 0 && i + 1 < argc) {
+			pipetrace = argv[++i];
+		}
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			profile = true;
+			i++; /* the report size is read by run_batch() */
+		}
+		else if (strcmp(argv[i], "--pipetrace-convert") == 0 && i + 2 < argc) {
+			return pipetrace_convert(argv[i + 1], argv[i + 2]);
+		}
+		else if (strcmp(argv[i], "--help") == 0 || argv[i][0] == '-') {
+			usage(argv[0]);
+			exit(argv[i][1] == '-' && argv[i][2] == 'h' ? 0 : 1);
+		}
+		else {
+			programs[num_programs++] = program = argv[i];
+		}
+	}
+
+	// configured here to check the specs, parallel jobs configure their own copies
+	if ((l1i != NULL && !cache_configure(&L1I, l1i)) || (l1d != NULL && !cache_configure(&L1D, l1d)) ||
+		(bp != NULL && !bp_configure(bp)) || (mdu != NULL && !mdu_configure(mdu)) ||
+		(issue != NULL && !ss_configure(issue)) || (ooo != NULL && !ooo_configure(ooo)) ||
+		(l2 != NULL && !memsys_configure("l2", l2)) || (dram != NULL && !memsys_configure("dram", dram)) ||
+		(mshrs != NULL && !memsys_configure("mshrs", mshrs)) ||
+		(prefetch != NULL && !prefetch_configure(prefetch)) ||
+		(store_buffer != NULL && !store_buffer_configure(store_buffer)) ||
+		(stages != NULL && !pipe_configure(stages))) {
+		exit(1);
+	}
+
+	/* several programs, several forwarding settings or --jobs: run them all in parallel */
+	num_forwarding = 1;
+	for (i = 0; forwarding[i] != '\0'; i++) {
+		num_forwarding += forwarding[i] == ',';
+	}
+	if (num_programs > 1 || num_forwarding > 1 || num_workers > 0) {
+		const char *value = forwarding, *comma;
+		int p, f;
 
-	strcpy(prog_file, argv[1]);
+		parallel.num_jobs = num_programs * num_forwarding;
+		parallel.jobs = calloc(parallel.num_jobs, sizeof(sim_job_t));
+		assert(parallel.jobs != NULL);
+		for (f = 0; f < num_forwarding; f++) {
+			for (p = 0; p < num_programs; p++) {
+				parallel.jobs[f * num_programs + p].program = programs[p];
+				parallel.jobs[f * num_programs + p].forwarding = atoi(value);
+			}
+			if ((comma = strchr(value, ',')) == NULL) {
+				break;
+			}
+			value = comma + 1;
+		}
+		parallel.cycles = cycles;
+		parallel.ff_instructions = ff_instructions;
+		parallel.ff_pc = ff_pc;
+		parallel.jit = JIT_ENABLED;
+		parallel.stats_json = stats_json_path;
+		parallel.l1i = l1i;
+		parallel.l1d = l1d;
+		parallel.l2 = l2;
+		parallel.dram = dram;
+		parallel.mshrs = mshrs;
+		parallel.prefetch = prefetch;
+		parallel.store_buffer = store_buffer;
+		parallel.bp = bp;
+		parallel.mdu = mdu;
+		parallel.issue = issue;
+		parallel.stages = stages;
+		parallel.ooo = ooo;
+		parallel.early_branch = ENABLE_EARLY_BRANCH;
+		parallel.delay_slot = ENABLE_DELAY_SLOT;
+		parallel.num_workers = num_workers > 0 ? num_workers : sysconf(_SC_NPROCESSORS_ONLN);
+		if (parallel.num_jobs == 0) {
+			printf("Error: You should provide input file.\n");
+			usage(argv[0]);
+			exit(1);
+		}
+		return run_parallel(&parallel);
+	}
+
+	TRACE_LEVEL = trace >= 0 ? trace : (batch ? TRACE_NONE : TRACE_DETAIL);
+
+	if (!batch) {
+		printf("\n**************************\n");
+		printf("Welcome to MU-MIPS SIM...\n");
+		printf("**************************\n\n");
+	}
+	
+	if (program == NULL) {
+		printf("Error: You should provide input file.\n");
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (strlen(program) >= sizeof(prog_file)) {
+		printf("Error: program path too long: %s\n", program);
+		exit(1);
+	}
+	strcpy(prog_file, program);
 	initialize();
-	load_program();
+	if (!load_program()) {
+		exit(1);
+	}
+	snapshot_save(SNAPSHOT_BOOT);
+	if (stats_json_path != NULL) {
+		atexit(write_stats_at_exit);
+	}
+
+	if (image != NULL) {
+		return write_image(image);
+	}
+
+	if (jit_check_instructions != 0) {
+		return jit_check(jit_check_instructions) ? 0 : 1;
+	}
+
+	if (ff_instructions != 0 || ff_pc != UINT32_MAX) {
+		fast_forward(ff_instructions != 0 ? ff_instructions : UINT32_MAX, ff_pc);
+	}
+
+	if (pipetrace != NULL) {
+		if (!pipetrace_open(pipetrace)) {
+			exit(1);
+		}
+		pipetrace_at_exit();
+	}
+
+	if (profile) {
+		profile_enable();
+	}
+
+	if (batch) {
+		return run_batch(cycles, argc, argv);
+	}
+
 	help();
 	while (1){
 		handle_command();
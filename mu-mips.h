@@ -5,6 +5,27 @@
 
 #define DEBUG 1
 
+/* Every piece of mutable simulator state below is SIM_LOCAL: each thread */
+/* is its own simulator instance, see run_parallel().                                   */
+#define SIM_LOCAL __thread
+
+/******************************************************************************/
+/* Trace output                                                                                                                                              */
+/******************************************************************************/
+/* TRACE_LEVEL picks the verbosity at run time, TRACE_MAX caps it at compile */
+/* time: building with -DTRACE_MAX=0 compiles every trace out of the hot path. */
+#define TRACE_NONE   0	/* nothing but explicitly requested dumps */
+#define TRACE_INFO   1	/* program load and simulation start/stop */
+#define TRACE_STAGE  2	/* per-cycle stage banners */
+#define TRACE_DETAIL 3	/* per-instruction values inside each stage */
+
+#ifndef TRACE_MAX
+#define TRACE_MAX TRACE_DETAIL
+#endif
+
+#define TRACE(level, ...) \
+	do { if ((level) <= TRACE_MAX && (level) <= TRACE_LEVEL) printf(__VA_ARGS__); } while (0)
+
 /******************************************************************************/
 /* MIPS memory layout                                                                                                                                      */
 /******************************************************************************/
@@ -26,18 +47,50 @@
 
 typedef struct {
 	uint32_t begin, end;
-	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
+/* regions only bound the legal addresses, the backing store is paged below */
 mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
 };
 
 #define NUM_MEM_REGION 4
+
+/******************************************************************************/
+/* Sparse paged memory                                                                                                                                   */
+/******************************************************************************/
+/* 4 KB pages are allocated on first write, reads of untouched pages return zero. */
+/* A 32-bit address splits into | dir (10) | table (10) | offset (12) |             */
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT)
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_DIR_SHIFT 22
+#define MEM_DIR_ENTRIES 1024
+#define MEM_TABLE_ENTRIES 1024
+#define MEM_PAGE_HEADER 16	/* reference count in front of each page */
+
+SIM_LOCAL uint8_t **MEM_PAGE_DIR[MEM_DIR_ENTRIES];
+SIM_LOCAL uint32_t MEM_PAGES_ALLOCATED;
+
+/* Direct-mapped translation cache in front of the page table.            */
+/* Only pages that exist and lie inside a region are ever entered.     */
+#define MEM_TLB_ENTRIES 64
+#define MEM_TLB_INVALID 0xFFFFFFFF
+
+typedef struct {
+	uint32_t vpn;
+	uint8_t *page;
+} mem_tlb_entry_t;
+
+SIM_LOCAL mem_tlb_entry_t MEM_TLB[MEM_TLB_ENTRIES];
+SIM_LOCAL mem_tlb_entry_t MEM_WTLB[MEM_TLB_ENTRIES];	/* stores: pages not shared with a snapshot */
+
+/* legality of each 64 KB chunk of the address space, every region is 64 KB aligned */
+#define MEM_CHUNK_SHIFT 16
+SIM_LOCAL uint8_t MEM_CHUNK_LEGAL[1 << (32 - MEM_CHUNK_SHIFT)];
 #define MIPS_REGS 32
 
 typedef struct CPU_State_Struct {
@@ -47,9 +100,127 @@ typedef struct CPU_State_Struct {
   uint32_t HI, LO;                          /* special regs for mult/div. */
 } CPU_State;
 
+/******************************************************************************/
+/* Decoded instructions                                                                                                                                */
+/******************************************************************************/
+/* Every operation the simulator knows, listed once so the op enum, the names */
+/* and any per-op tables are generated from the same list.                                  */
+#define MIPS_OPS(X) \
+	X(INVALID) \
+	X(SLL) X(SRL) X(SRA) X(JR) X(JALR) X(SYSCALL) \
+	X(MFHI) X(MTHI) X(MFLO) X(MTLO) X(MULT) X(MULTU) X(DIV) X(DIVU) \
+	X(ADD) X(ADDU) X(SUB) X(SUBU) X(AND) X(OR) X(XOR) X(NOR) X(SLT) \
+	X(BLTZ) X(BGEZ) X(J) X(JAL) X(BEQ) X(BNE) X(BLEZ) X(BGTZ) \
+	X(ADDI) X(ADDIU) X(SLTI) X(ANDI) X(ORI) X(XORI) X(LUI) \
+	X(LB) X(LH) X(LW) X(SB) X(SH) X(SW)
+
+typedef enum {
+#define MIPS_OP_ENUM(name) OP_##name,
+	MIPS_OPS(MIPS_OP_ENUM)
+#undef MIPS_OP_ENUM
+	NUM_MIPS_OPS
+} mips_op_t;
+
+/* decoded instruction flags */
+#define INST_WRITES_REG	0x01	/* WB writes REGS[dest] */
+#define INST_LOAD		0x02
+#define INST_STORE		0x04
+#define INST_BRANCH	0x08	/* any branch or jump */
+#define INST_HILO		0x10	/* reads or writes HI/LO, waits for the multiply/divide unit */
+
+typedef struct {
+	uint32_t IR;		/* raw instruction word */
+	uint32_t imm;		/* zero-extended immediate */
+	uint32_t simm;		/* sign-extended immediate */
+	uint32_t target;	/* 26-bit jump target */
+	uint8_t op;		/* mips_op_t */
+	uint8_t opcode, function, rs, rt, rd, sa;
+	uint8_t dest;		/* register written by WB when INST_WRITES_REG */
+	uint8_t flags;
+} decoded_inst_t;
+
+extern const char *MIPS_OP_NAMES[NUM_MIPS_OPS];
+
+/* Direct-mapped decode cache keyed by PC, stores into text invalidate it */
+#define DECODE_CACHE_ENTRIES (1 << 14)
+#define DECODE_TAG_INVALID 0xFFFFFFFF
+
+SIM_LOCAL uint32_t DECODE_TAGS[DECODE_CACHE_ENTRIES];
+SIM_LOCAL decoded_inst_t DECODE_CACHE[DECODE_CACHE_ENTRIES];
+
+/* Outcome of executing one decoded instruction, see alu_execute() */
+#define EXEC_WRITES_HI 0x01
+#define EXEC_WRITES_LO 0x02
+
+typedef struct {
+	uint32_t ALUOutput;	/* result, or effective address of loads/stores */
+	uint32_t HI, LO;	/* in: current HI/LO, out: new values per hilo */
+	uint32_t next_pc;	/* target when taken */
+	uint8_t taken;		/* control transfer redirects the PC */
+	uint8_t hilo;		/* EXEC_WRITES_HI/LO */
+} exec_result_t;
+
+/* EX dispatch engine, -DEX_DISPATCH_THREADED selects computed-goto dispatch */
+#if defined(EX_DISPATCH_THREADED) && !defined(__GNUC__)
+#undef EX_DISPATCH_THREADED
+#endif
+#ifdef EX_DISPATCH_THREADED
+#define EX_DISPATCH_NAME "threaded"
+#else
+#define EX_DISPATCH_NAME "switch"
+#endif
+
+/* Basic-block JIT for x86-64 hosts, -DNO_JIT leaves only the interpreter */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(_WIN32) && !defined(NO_JIT)
+#define MIPS_JIT 1
+#endif
+
+#define JIT_CODE_SIZE (16 << 20)	/* bytes of host code before a full flush */
+#define JIT_MAX_BLOCKS 16384
+#define JIT_BLOCK_INSTS 64		/* longest straight-line run per block */
+#define JIT_INST_BYTES 192		/* worst-case host code per MIPS instruction */
+#define JIT_LOOKUP_ENTRIES (1 << 14)
+#define JIT_HOT_MISSES 8		/* lookups of a PC that miss before its block is translated */
+#define JIT_NO_LINK 0xFFFFFFFF	/* exit that cannot be chained (indirect jump, bail out) */
+
+typedef struct {
+	uint32_t pc;		/* first instruction */
+	uint32_t end;		/* address after the last instruction */
+	uint32_t count;		/* instructions in the block */
+	uint8_t *code;
+	uint8_t *exit[2];	/* patchable direct exits: fall-through, taken */
+	uint32_t exit_pc[2];
+} jit_block_t;
+
+/* host code enters through a trampoline: returns the next PC, out[0] the */
+/* unused instruction budget and out[1] the exit to chain (or JIT_NO_LINK) */
+typedef uint32_t (*jit_entry_t)(CPU_State *state, uint32_t budget, const uint8_t *code, uint32_t *out);
+
+SIM_LOCAL bool JIT_ENABLED;	/* fast-forward through the JIT instead of the interpreter */
+SIM_LOCAL uint8_t *JIT_CODE;
+SIM_LOCAL uint32_t JIT_CODE_USED;
+SIM_LOCAL jit_block_t JIT_BLOCKS[JIT_MAX_BLOCKS];
+SIM_LOCAL uint32_t JIT_NUM_BLOCKS;
+SIM_LOCAL int32_t JIT_LOOKUP[JIT_LOOKUP_ENTRIES];	/* PC hash -> JIT_BLOCKS index, -1 if empty */
+SIM_LOCAL uint32_t JIT_HEAT_PC[JIT_LOOKUP_ENTRIES];	/* PC hash -> PC whose misses JIT_HEAT counts */
+SIM_LOCAL uint8_t JIT_HEAT[JIT_LOOKUP_ENTRIES];	/* up to JIT_HOT_MISSES */
+SIM_LOCAL bool JIT_EAGER;	/* translate on the first miss, see jit_check() */
+SIM_LOCAL uint32_t JIT_TEXT_LO, JIT_TEXT_HI;	/* span of translated MIPS code */
+SIM_LOCAL uint32_t JIT_GENERATION;	/* bumped by every flush */
+
+/* What IF predicted for a branch or jump, checked when it resolves in EX */
+typedef struct {
+	uint32_t next_pc;	/* where IF fetched from next */
+	uint32_t history;	/* global history the direction was predicted with */
+	uint32_t ras_top;	/* return stack top after this instruction's push or pop */
+	bool resolved;		/* already checked by ID under ENABLE_EARLY_BRANCH */
+} bp_prediction_t;
+
 typedef struct CPU_Pipeline_Reg_Struct{
 	uint32_t PC;
 	uint32_t IR;
+	decoded_inst_t D;	/* decoded form of IR */
+	bp_prediction_t pred;
 	uint32_t A;
 	uint32_t B;
 	uint32_t imm;
@@ -65,49 +236,624 @@ typedef struct CPU_Pipeline_Reg_Struct{
 /* CPU State info.                                                                                                               */
 /***************************************************************/
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
-uint32_t CYCLE_COUNT;
-uint32_t PROGRAM_SIZE; /*in words*/
+SIM_LOCAL CPU_State CURRENT_STATE, NEXT_STATE;
+SIM_LOCAL int RUN_FLAG;	/* run flag*/
+SIM_LOCAL int TRACE_LEVEL;	/* current verbosity, see TRACE() */
+SIM_LOCAL uint32_t INSTRUCTION_COUNT;
+SIM_LOCAL uint32_t CYCLE_COUNT;
+SIM_LOCAL uint32_t PROGRAM_SIZE; /*in words*/
+SIM_LOCAL uint32_t PROGRAM_ENTRY;	/* PC the program starts at */
 
 /* GLOBALS */
-int ENABLE_FORWARDING;
-int REG_WRITE_EX_MEM;
-int REG_WRITE_MEM_WB;
-int stallCounter;
-uint32_t writeBackValue;
+SIM_LOCAL int ENABLE_FORWARDING;
+SIM_LOCAL int ENABLE_EARLY_BRANCH;	/* resolve branches in ID instead of EX */
+SIM_LOCAL int ENABLE_DELAY_SLOT;	/* the instruction after a branch or jump always executes */
+SIM_LOCAL int REG_WRITE_EX_MEM;
+SIM_LOCAL int REG_WRITE_MEM_WB;
+SIM_LOCAL int stallCounter;
+SIM_LOCAL uint32_t writeBackValue;
 
 // Flags
-bool rsHazardType1;
-bool rtHazardType1;
-bool rsHazardType2;
-bool rtHazardType2;
-bool oneCycleAfterHazard;
-bool branch_jump_flag;
+SIM_LOCAL bool branch_jump_flag;
+SIM_LOCAL bool early_branch_flag;	/* a branch redirected fetch without flushing, IF drops this cycle's fetch */
+SIM_LOCAL bool delay_slot_pending;	/* IF fetched a branch, its delay slot comes next */
+SIM_LOCAL uint32_t delay_slot_target;	/* where IF goes once the delay slot is fetched */
+SIM_LOCAL bool fetch_gated;	/* IF inserts bubbles instead of fetching, used to drain the pipeline */
 
 /*Forwarding Flags*/ 
-uint32_t ForwardA;
-uint32_t ForwardB;
+SIM_LOCAL uint32_t ForwardA;
+SIM_LOCAL uint32_t ForwardB;
 
 
 /***************************************************************/
 /* Pipeline Registers.                                                                                                        */
 /***************************************************************/
-CPU_Pipeline_Reg IF_ID;
-CPU_Pipeline_Reg ID_EX;
-CPU_Pipeline_Reg EX_MEM;
-CPU_Pipeline_Reg MEM_WB;
+SIM_LOCAL CPU_Pipeline_Reg IF_ID;
+SIM_LOCAL CPU_Pipeline_Reg ID_EX;
+SIM_LOCAL CPU_Pipeline_Reg EX_MEM;
+SIM_LOCAL CPU_Pipeline_Reg MEM_WB;
+
+/***************************************************************/
+/* Pipeline depth. IF, EX and MEM can each be split into up to       */
+/* PIPE_MAX_SPLIT sub-stages, e.g. IF1 IF2 ID EX1 EX2 MEM WB. A split   */
+/* stage still does its work in its first sub-stage; the inner latches */
+/* behind it only delay the instruction's arrival in the stage's       */
+/* output latch (IF/ID, EX/MEM or MEM/WB), so ID's hazard unit waits   */
+/* longer for results and loads, and a branch resolved in EX1 owes   */
+/* IF the fetch slots the later EX sub-stages would have lost. Only    */
+/* the scalar pipeline is split, and only without delay slots.          */
+/***************************************************************/
+#define PIPE_MAX_SPLIT 4
+
+typedef enum {
+	STAGE_IF,
+	STAGE_ID,
+	STAGE_EX,
+	STAGE_MEM,
+	STAGE_WB,
+	NUM_STAGES
+} pipe_stage_t;
+
+typedef struct {
+	uint32_t depth[NUM_STAGES];	/* sub-stages, ID and WB always 1 (0 reads as 1) */
+	CPU_Pipeline_Reg inner[NUM_STAGES][PIPE_MAX_SPLIT - 1];	/* latches inside a split stage, [0] youngest */
+	uint32_t fetch_hold;	/* bubbles IF still owes a branch resolved before the end of EX, or a store into text */
+} pipe_stages_t;
+
+SIM_LOCAL pipe_stages_t PIPE;
+
+SIM_LOCAL char prog_file[256];
+
+/***************************************************************/
+/* Pipeline performance counters. Every one is a plain increment on  */
+/* a path the pipeline already takes, so they are always on.           */
+/* Functional fast-forward does not touch them.                              */
+/***************************************************************/
+typedef enum {
+	STALL_RAW_EX_MEM,	/* no forwarding, producer one ahead in EX/MEM */
+	STALL_RAW_MEM_WB,	/* no forwarding, producer two ahead in MEM/WB */
+	STALL_LOAD_USE,		/* forwarding, load result not ready until MEM/WB */
+	STALL_BRANCH,		/* early branch resolution, operand still in flight */
+	STALL_MDU,		/* HI/LO still busy in the multiply/divide unit */
+	NUM_STALL_CAUSES
+} stall_cause_t;
+
+typedef struct {
+	uint64_t cycles;
+	uint64_t instructions;		/* retired by WB, or by EX for SYSCALL */
+	uint64_t stall_cycles[NUM_STALL_CAUSES];
+	uint64_t forward_a_ex_mem, forward_a_mem_wb;	/* ForwardA == 0x10 / 0x01 */
+	uint64_t forward_b_ex_mem, forward_b_mem_wb;	/* ForwardB == 0x10 / 0x01 */
+	uint64_t branches;			/* branches and jumps resolved in EX */
+	uint64_t branch_flushes;		/* ... that were taken and flushed IF/ID */
+	uint64_t loads, stores, syscalls;
+} sim_counters_t;
+
+SIM_LOCAL sim_counters_t COUNTERS;
+SIM_LOCAL stall_cause_t stallCause;	/* what set stallCounter */
+
+/***************************************************************/
+/* L1 caches. Only tags are modelled, data always comes from the     */
+/* backing memory, so a cache changes timing but never results.       */
+/* Each set's ways are contiguous in tags[] and lru[]. A tag is the   */
+/* line address with CACHE_VALID/CACHE_DIRTY in the low bits.           */
+/***************************************************************/
+#define CACHE_VALID 0x1
+#define CACHE_DIRTY 0x2
+#define CACHE_MAX_ASSOC 32
+#define CACHE_NO_MISS 0xFFFFFFFF	/* never a word-aligned address */
+
+typedef enum { CACHE_LRU, CACHE_PLRU, CACHE_RANDOM } cache_policy_t;
+
+typedef struct {
+	bool enabled;
+	/* configuration */
+	uint32_t size, assoc, line_size, miss_latency;
+	uint32_t hit_latency;	/* only the L2 has one, an L1 hit is part of its stage */
+	cache_policy_t policy;
+	bool write_back;		/* otherwise write-through, no allocate on a write miss */
+	/* derived */
+	uint32_t sets, line_shift;
+	uint32_t *tags;		/* sets * assoc */
+	uint8_t *lru;		/* LRU: recency rank of each way, 0 is most recent */
+	uint32_t *plru;		/* PLRU: one tree of assoc - 1 bits per set */
+	uint32_t random;		/* xorshift state for CACHE_RANDOM */
+	uint32_t mru;		/* index into tags[] of the last hit, skips the set search on repeats */
+	uint32_t victim;		/* line address of the last dirty line written back */
+	/* the outstanding miss, the access at pending_addr completes at ready */
+	uint32_t pending_addr;
+	uint64_t ready;
+	/* statistics */
+	uint64_t reads, read_misses, writes, write_misses, writebacks, stall_cycles;
+} cache_t;
+
+SIM_LOCAL cache_t L1I, L1D;
+
+/***************************************************************/
+/* Memory hierarchy below the L1s (--l2, --dram): a unified L2, MSHRs  */
+/* for the misses outstanding below it and a DRAM with one row buffer */
+/* per bank. memsys_access() is the single entry point, every engine  */
+/* reaches it through cache_ready() when an L1 misses and gets back   */
+/* the cycles until the line arrives. Writes are posted: they update  */
+/* the L2 and keep DRAM banks busy but never stall. Without --l2 or     */
+/* --dram an L1 miss costs its flat miss_latency as before, and an L1 */
+/* that is off is still single-cycle. Like the L1s, only timing is        */
+/* modelled. Consecutive rows go to consecutive banks, so a stream    */
+/* hits in one row buffer and then moves on to the next bank.              */
+/***************************************************************/
+#define MSHR_MAX 64
+#define DRAM_MAX_BANKS 64
+#define DRAM_NO_ROW 0xFFFFFFFF
+#define MEMSYS_LINE_SHIFT 6	/* DRAM burst, and MSHR granularity without an L2 */
+
+typedef struct {
+	uint32_t line;		/* address >> line_shift */
+	uint64_t ready;		/* cycle the fill completes, free from then on */
+} mshr_t;
+
+typedef struct {
+	bool enabled;		/* configured with --dram, an L2 turns it on too */
+	uint32_t banks, row_size;
+	uint32_t t_cas, t_rcd, t_rp;	/* column access, row activate, precharge, in cycles */
+	uint32_t open_row[DRAM_MAX_BANKS];	/* DRAM_NO_ROW while precharged */
+	uint64_t bank_ready[DRAM_MAX_BANKS];	/* cycle the bank finishes its last access */
+	/* statistics */
+	uint64_t reads, writes, row_hits, row_empty, row_conflicts;
+	uint64_t bank_conflicts, bank_wait_cycles;	/* accesses that found their bank busy */
+} dram_t;
+
+typedef struct {
+	bool enabled;		/* L2.enabled || DRAM.enabled */
+	uint32_t line_shift;	/* of the L2, else MEMSYS_LINE_SHIFT */
+	uint32_t mshrs;
+	mshr_t mshr[MSHR_MAX];
+	/* statistics */
+	uint64_t fills, writes;		/* reads that missed an L1, posted writes */
+	uint64_t merged;			/* fills that joined an MSHR already in flight */
+	uint64_t mshr_full, mshr_wait_cycles;	/* fills that waited for a free MSHR */
+	uint64_t fill_cycles;		/* sum of fill latencies */
+} memsys_t;
+
+SIM_LOCAL cache_t L2;
+SIM_LOCAL dram_t DRAM;
+SIM_LOCAL memsys_t MEMSYS;
+
+/***************************************************************/
+/* L1D prefetcher (--prefetch), trained by every load that reaches the */
+/* D-cache. Prefetched lines wait in a small fully-associative buffer   */
+/* beside the L1D instead of being filled into it, so a useless        */
+/* prefetch never evicts anything. A load that misses the L1D but finds */
+/* its line in the buffer takes it: at once if the prefetch has          */
+/* completed (timely), or after the rest of its latency (late).          */
+/*   next-line: every L1D miss fetches the next <degree> lines            */
+/*   stride: a table indexed by load PC learns each load's stride and,  */
+/*     once it repeats, fetches <degree> strides ahead                         */
+/*   stream: two misses to adjacent lines start a stream in their       */
+/*     direction, each further miss on it fetches <degree> lines ahead   */
+/* Prefetches go through memsys_access() when the hierarchy is on, and  */
+/* take MSHRs like any other fill.                                                          */
+/***************************************************************/
+#define PF_BUFFER_ENTRIES 32
+#define PF_MAX_TABLE 256
+
+typedef enum { PF_NONE, PF_NEXT_LINE, PF_STRIDE, PF_STREAM } prefetch_kind_t;
+
+typedef struct {
+	uint32_t line;		/* address >> L1D.line_shift */
+	uint64_t ready;		/* cycle the line arrives */
+	bool valid;
+} pf_buffer_entry_t;
+
+typedef struct {
+	uint32_t pc, last_addr;
+	int32_t stride;
+	uint8_t confidence;	/* 0-3, prefetches from 2 */
+} pf_stride_entry_t;
+
+typedef struct {
+	uint32_t next_line;	/* the miss that continues the stream */
+	int32_t direction;	/* +1 or -1, 0 while unconfirmed */
+	uint64_t last_use;
+} pf_stream_t;
+
+typedef struct {
+	prefetch_kind_t kind;
+	uint32_t degree;
+	uint32_t entries;		/* stride table entries or streams */
+	pf_buffer_entry_t buffer[PF_BUFFER_ENTRIES];
+	uint32_t next_slot;	/* the buffer is replaced FIFO */
+	pf_stride_entry_t table[PF_MAX_TABLE];
+	pf_stream_t streams[PF_MAX_TABLE];
+	/* statistics */
+	uint64_t issued, redundant;	/* sent, dropped as already cached or buffered */
+	uint64_t useful, late, late_cycles;	/* claimed by a load, still in flight then */
+	uint64_t useless;		/* evicted from the buffer unclaimed */
+	uint64_t misses;		/* load misses the buffer did not cover */
+} prefetcher_t;
+
+SIM_LOCAL prefetcher_t PREFETCH;
+
+/***************************************************************/
+/* Store buffer (--store-buffer <depth>) between the in-order MEM      */
+/* stages and the L1D. A store leaves MEM as soon as it has an entry:   */
+/* stores to a word that already has one combine into it, so runs of  */
+/* SB/SH to adjacent bytes drain as one word write. The oldest entry  */
+/* drains into the L1D one write at a time and stays in the buffer,   */
+/* closed to combining, until its write (miss included) is done. A    */
+/* load whose bytes the youngest entry for its word holds entirely      */
+/* takes them from it without touching the cache; one that only       */
+/* partly overlaps an entry waits for it to drain. Unaligned accesses  */
+/* wait for the buffer to empty. The out-of-order core keeps stores in */
+/* its own queue and does not use it.                                                 */
+/***************************************************************/
+#define STORE_BUFFER_MAX 64
+
+typedef struct {
+	uint32_t addr;		/* word address */
+	uint32_t data;		/* the word as memory would hold it, valid where mask is set */
+	uint8_t mask;		/* bit i: byte addr + i was written */
+	uint32_t pc;		/* of the first store in the entry */
+} store_buffer_entry_t;
+
+typedef struct {
+	uint32_t depth;		/* 0: stores write memory from MEM directly */
+	store_buffer_entry_t entry[STORE_BUFFER_MAX];
+	uint32_t head, count;
+	bool draining;		/* the head entry's L1D write is under way */
+	uint64_t busy_until;	/* cycle that write completes */
+	/* statistics */
+	uint64_t stores, combined, drains, forwards;
+	uint64_t full_cycles, partial_cycles;	/* MEM waiting on a full buffer / a partial overlap */
+	uint64_t occupancy;	/* summed over cycles */
+} store_buffer_t;
+
+SIM_LOCAL store_buffer_t STORE_BUFFER;
+
+/***************************************************************/
+/* Branch prediction in IF: a direction predictor for conditional      */
+/* branches, a direct-mapped BTB for targets and a return address     */
+/* stack for JR $31. EX flushes only when the prediction was wrong.  */
+/* The default, not-taken with no BTB, flushes every taken branch.     */
+/***************************************************************/
+#define BP_NO_PC 0xFFFFFFFF
+
+typedef enum { BP_NOT_TAKEN, BP_BIMODAL, BP_GSHARE, BP_TOURNAMENT } bp_kind_t;
+
+typedef struct {
+	/* configuration */
+	bp_kind_t kind;
+	uint32_t table_bits;	/* log2 of the counter tables, also the history length */
+	uint32_t btb_entries, ras_entries;
+	/* state */
+	uint8_t *bimodal;	/* 2-bit counters indexed by PC */
+	uint8_t *gshare;		/* 2-bit counters indexed by PC ^ history */
+	uint8_t *chooser;	/* tournament, >= 2 trusts gshare over bimodal */
+	uint32_t history;	/* outcomes of the last table_bits conditional branches */
+	uint32_t *btb_tags, *btb_targets;
+	uint32_t *ras;
+	uint32_t ras_top;
+	/* statistics */
+	uint64_t conditional, conditional_correct;
+	uint64_t btb_lookups, btb_hits, returns, returns_correct;
+} branch_predictor_t;
+
+SIM_LOCAL branch_predictor_t BP;
+
+/***************************************************************/
+/* Multiply/divide unit beside the integer pipeline. MULT/DIV leave   */
+/* EX straight away but keep HI/LO busy for their latency, and any     */
+/* instruction using HI/LO (another multiply included, the unit is not  */
+/* pipelined) waits in ID until the result is ready. Latencies of 1 */
+/* are the original single-cycle behavior.                                              */
+/***************************************************************/
+typedef struct {
+	/* configuration */
+	uint32_t mult_latency, div_latency;	/* cycles in the unit, mdu_reset() makes 0 a 1 */
+	/* state */
+	uint64_t ready;		/* COUNTERS.cycles at which HI/LO may be used in EX */
+	/* statistics */
+	uint64_t mults, divs, busy_cycles;
+} mdu_t;
+
+SIM_LOCAL mdu_t MDU;
+
+/***************************************************************/
+/* Superscalar mode, width > 1: an in-order pipeline whose latches   */
+/* hold groups of up to width instructions. IF fetches sequential      */
+/* words up to a predicted-taken branch (or the end of the I-cache     */
+/* line), ID issues the oldest instructions that have their operands,  */
+/* do not depend on each other and fit the pairing table, and EX has   */
+/* an ALU per slot. Branches resolve in EX; early resolution and delay */
+/* slots stay with the scalar pipeline, which width 1 keeps using.     */
+/***************************************************************/
+#define SS_MAX_WIDTH 8
 
-char prog_file[32];
+typedef enum {
+	SS_CLASS_ALU,		/* everything not listed below */
+	SS_CLASS_MEM,		/* loads and stores, one D-cache port */
+	SS_CLASS_BRANCH,
+	SS_CLASS_MDU,		/* MULT/DIV and HI/LO moves */
+	SS_CLASS_SYSCALL,
+	NUM_SS_CLASSES
+} ss_class_t;
 
+typedef struct {
+	uint32_t pc;
+	decoded_inst_t d;
+	bp_prediction_t pred;
+	uint32_t a, b;		/* operands, read or forwarded by ID */
+	uint32_t value;		/* ALU result, the loaded value after MEM */
+	uint8_t dest;		/* register written back, 0 for none */
+} ss_slot_t;
+
+typedef struct {
+	ss_slot_t slot[SS_MAX_WIDTH];	/* oldest first */
+	uint32_t count;
+} ss_group_t;
+
+typedef struct {
+	/* configuration */
+	uint32_t width;
+	uint32_t limit[NUM_SS_CLASSES];	/* pairing table: issues per cycle by class */
+	/* state */
+	ss_group_t if_id, id_ex, ex_mem, mem_wb;
+	bool redirect;		/* EX redirected fetch, IF sits this cycle out */
+	/* statistics */
+	uint64_t issued[SS_MAX_WIDTH + 1];	/* cycles in which ID issued n instructions */
+	uint64_t dependency_splits;	/* groups cut short by a dependence inside them */
+	uint64_t structural_splits;	/* ... by the pairing table */
+} superscalar_t;
+
+SIM_LOCAL superscalar_t SS;
+
+/***************************************************************/
+/* Out-of-order engine (--ooo): up to width instructions a cycle are  */
+/* fetched, renamed into the reorder buffer and parked in reservation */
+/* stations, issue oldest-first once their operands are ready, and     */
+/* retire in order, which is the only place CURRENT_STATE and memory  */
+/* change. Loads wait in the load/store queue until every older store */
+/* address is known and take a matching store's data directly; stores */
+/* write memory at retirement. A mispredicted branch squashes the     */
+/* younger entries when it executes.                                                   */
+/***************************************************************/
+#define OOO_MAX_ENTRIES 512
+#define OOO_HI 32		/* rename table slots past the GPRs */
+#define OOO_LO 33
+#define OOO_NUM_REGS 34
+#define OOO_NO_ENTRY 0xFFFF
+#define OOO_SOURCES 4	/* rs, rt, and HI/LO for DIV/DIVU */
+
+typedef struct {
+	uint64_t seq;		/* program order, 0 once the entry retired or was squashed */
+	uint32_t pc;
+	decoded_inst_t d;
+	bp_prediction_t pred;
+	uint8_t src[OOO_SOURCES];	/* renamed sources, OOO_HI/OOO_LO for MFHI/MFLO, 0 for none; a divide */
+				/* reads HI/LO too, a zero divisor leaves them as they were */
+	uint16_t producer[OOO_SOURCES];	/* ROB index of the in-flight producer, or OOO_NO_ENTRY */
+	uint64_t producer_seq[OOO_SOURCES];
+	uint8_t dest;		/* GPR written at retirement, 0 for none */
+	uint8_t hilo;		/* EXEC_WRITES_HI/LO */
+	bool in_rs;		/* waiting in a reservation station */
+	bool issued;		/* executing, the result is ready at COUNTERS.cycles == ready */
+	bool loaded;		/* loads: read memory or took a store's data */
+	bool mispredicted;
+	uint64_t ready;
+	uint32_t a, b;
+	uint32_t value, hi, lo;	/* result, value is the address for loads until they load */
+	uint32_t address;
+	uint32_t next_pc;		/* architectural successor, known once executed */
+} ooo_entry_t;
+
+typedef struct {
+	/* configuration, rob_entries 0 is off */
+	uint32_t rob_entries, rs_entries, lsq_entries, width;
+	/* state */
+	ooo_entry_t *rob;		/* circular, rob_entries long */
+	uint32_t head, count;
+	uint32_t rs_used, lsq_used;
+	uint16_t rat[OOO_NUM_REGS];	/* youngest in-flight writer of each register */
+	uint64_t next_seq;
+	ss_group_t fetched;	/* fetched and predicted, waiting to be renamed */
+	uint32_t fetch_pc;
+	bool resync;		/* fetch_pc restarts at CURRENT_STATE.PC */
+	bool redirect;		/* a mispredict squashed this cycle, fetch sits it out */
+	/* statistics */
+	uint64_t issued[SS_MAX_WIDTH + 1];	/* cycles in which n instructions issued */
+	uint64_t rob_full, rs_full, lsq_full;	/* cycles rename stopped on each */
+	uint64_t occupancy;	/* ROB entries in use, summed over cycles */
+	uint64_t load_forwards, squashed;
+} ooo_t;
+
+SIM_LOCAL ooo_t OOO;
+
+/***************************************************************/
+/* Pipeline trace (--pipetrace): what IF_ID, ID_EX, EX_MEM and MEM_WB */
+/* hold at the end of every cycle, with the stall, flush and forward   */
+/* events. After the header ("MUPT", version, first cycle, all 32-bit  */
+/* little-endian) each cycle is a latch byte and an event byte:          */
+/*   latch byte, 2 bits per latch from IF_ID up: PT_SAME held over,    */
+/*     PT_ADVANCE took what the latch before held, PT_BUBBLE, or          */
+/*     PT_NEW followed by varint(zigzag(PC - last new PC) << 1 | IR       */
+/*     follows) and the IR, which is left out when it matches the last   */
+/*     word seen at that PC's slot in a table of PT_IR_SLOTS                 */
+/*   event byte: stall cause + 1 (bits 0-2), a flush (bit 3), forward  */
+/*     A and B sources (bits 4-5 and 6-7: 1 EX/MEM, 2 MEM/WB)            */
+/* A latch byte of PT_IDLE stands for a varint count of cycles in which */
+/* nothing changed. Only the scalar pipeline is traced, superscalar and */
+/* out-of-order cycles are recorded as idle.                                          */
+/***************************************************************/
+#define PT_MAGIC "MUPT"
+#define PT_VERSION 1
+#define PT_HEADER_SIZE 12
+#define PT_SAME 0
+#define PT_ADVANCE 1
+#define PT_BUBBLE 2
+#define PT_NEW 3
+#define PT_IDLE 0xFF		/* all four PT_NEW, which IF never produces */
+#define PT_FLUSH 0x08
+#define PT_IR_SLOTS 4096
+#define PT_NO_PC 0xFFFFFFFF
+#define PT_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+	FILE *out;
+	uint8_t *buf;		/* PT_BUFFER_SIZE bytes, written out when full */
+	uint32_t used;
+	uint32_t pc[4], ir[4];	/* what each latch held last cycle, IR 0 is a bubble */
+	uint32_t last_pc;		/* PC of the last PT_NEW */
+	uint32_t slot_pc[PT_IR_SLOTS], slot_ir[PT_IR_SLOTS];
+	sim_counters_t last;	/* counters at the previous cycle, for the events */
+	uint64_t idle;		/* idle cycles not written yet */
+	/* statistics */
+	uint64_t cycles, bytes;
+} pipetrace_t;
+
+SIM_LOCAL pipetrace_t PIPETRACE;
+
+/***************************************************************/
+/* Per-instruction profile (profile on): exact counts for every text  */
+/* word, indexed by (PC - MEM_TEXT_BEGIN) >> 2. Stall cycles are the */
+/* cycles an instruction held the front end up in ID (hazards, MDU)   */
+/* plus the cycles its fetch or memory access waited on a cache miss. */
+/* Entries is NULL while profiling is off, so every hook is one test.   */
+/***************************************************************/
+typedef struct {
+	uint64_t executions;		/* retired, as counted in COUNTERS.instructions */
+	uint64_t stall_cycles;
+	uint64_t icache_misses, dcache_misses;
+	uint64_t mispredicts;		/* as counted in COUNTERS.branch_flushes */
+} profile_entry_t;
+
+typedef struct {
+	profile_entry_t *entries;
+	uint32_t words;		/* PROGRAM_SIZE when profiling was turned on */
+} profile_t;
+
+SIM_LOCAL profile_t PROFILE;
+
+/***************************************************************/
+/* Program images. A MUMI image is a 28-byte little-endian header,  */
+/*   "MUMI", version, entry, text address, text bytes,                        */
+/*   data address, data bytes,                                                                 */
+/* followed by the raw text and then the raw data.                              */
+/***************************************************************/
+#define MUMI_MAGIC "MUMI"
+#define MUMI_VERSION 1
+#define MUMI_HEADER_SIZE 28
+
+#define ELF32_EHDR_SIZE 52
+#define ELF32_PHDR_SIZE 32
+#define ELF_MACHINE_MIPS 8
+#define ELF_PT_LOAD 1
+
+/***************************************************************/
+/* Snapshots: everything cycle() and the engines read, memory pages    */
+/* are shared copy-on-write so saving and restoring cost O(touched   */
+/* pages) pointer copies.                                                                               */
+/***************************************************************/
+#define NUM_SNAPSHOTS 8
+#define SNAPSHOT_BOOT NUM_SNAPSHOTS	/* the freshly loaded program, restored by reset() */
+#define SNAPSHOT_SCRATCH (NUM_SNAPSHOTS + 1)	/* held across ooo_check() */
+
+typedef struct {
+	bool valid;
+	CPU_State current, next;
+	CPU_Pipeline_Reg if_id, id_ex, ex_mem, mem_wb;
+	int run_flag;
+	uint32_t instruction_count, cycle_count, program_size;
+	int reg_write_ex_mem, reg_write_mem_wb, stall_counter;
+	uint32_t write_back_value, forward_a, forward_b;
+	bool branch_jump_flag, early_branch_flag, fetch_gated;
+	bool delay_slot_pending;
+	uint32_t delay_slot_target;
+	stall_cause_t stall_cause;
+	sim_counters_t counters;
+	cache_t l1i, l1d, l2;		/* tag arrays are copies owned by the snapshot */
+	dram_t dram;
+	memsys_t memsys;
+	prefetcher_t prefetch;
+	store_buffer_t store_buffer;
+	pipe_stages_t pipe;	/* inner latches only kept for the same depths */
+	branch_predictor_t bp;	/* tables too */
+	mdu_t mdu;
+	superscalar_t ss;	/* latches only kept for the same width */
+	ooo_t ooo;		/* ROB copy owned by the snapshot, kept for the same sizes */
+	uint8_t **pages[MEM_DIR_ENTRIES];
+	uint32_t pages_allocated;
+} sim_snapshot_t;
+
+SIM_LOCAL sim_snapshot_t SNAPSHOTS[NUM_SNAPSHOTS + 2];
+
+
+/***************************************************************/
+/* Parallel batch runner, see run_parallel(): one job per program and */
+/* parameter variant, spread over worker threads that steal work    */
+/* from each other's queues once their own runs dry.                       */
+/***************************************************************/
+typedef struct {
+	const char *program;
+	int forwarding;
+	/* results */
+	bool loaded;
+	bool finished;		/* reached SYSCALL within the cycle limit */
+	uint32_t cycles, instructions, pc;
+	uint64_t digest;		/* registers, HI/LO and memory, see state_digest() */
+	sim_counters_t counters;
+	cache_t l1i, l1d, l2;		/* statistics only */
+	dram_t dram;
+	memsys_t memsys;
+	prefetcher_t prefetch;	/* statistics only */
+	store_buffer_t store_buffer;	/* statistics only */
+	branch_predictor_t bp;	/* statistics only */
+	mdu_t mdu;
+	superscalar_t ss;	/* statistics only */
+	ooo_t ooo;		/* statistics only */
+	int ooo_check;		/* 1 matched the functional model, -1 did not, 0 not checked */
+	double seconds;
+	int worker;
+} sim_job_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t *jobs;		/* indices into sim_batch_t.jobs */
+	uint32_t head, tail;	/* thieves take from head, the owner from tail */
+} sim_queue_t;
+
+typedef struct {
+	sim_job_t *jobs;
+	uint32_t num_jobs;
+	uint32_t cycles;		/* per job, 0 runs to completion */
+	uint32_t ff_instructions, ff_pc;
+	bool jit;
+	const char *stats_json;	/* write every job's counters here, or NULL */
+	const char *l1i, *l1d;	/* cache_configure() specs, or NULL */
+	const char *l2, *dram, *mshrs;	/* memsys_configure() specs, or NULL */
+	const char *prefetch;	/* prefetch_configure() spec, or NULL */
+	const char *store_buffer;	/* store_buffer_configure() depth, or NULL */
+	const char *bp;		/* bp_configure() spec, or NULL */
+	const char *mdu;		/* mdu_configure() spec, or NULL */
+	const char *issue;	/* ss_configure() width, or NULL */
+	const char *ooo;		/* ooo_configure() spec, or NULL */
+	const char *stages;	/* pipe_configure() stage list, or NULL */
+	int early_branch;
+	int delay_slot;
+	int num_workers;
+	sim_queue_t *queues;	/* one per worker */
+} sim_batch_t;
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
 void help();
 uint32_t mem_read_32(uint32_t address);
+uint32_t mem_read_16(uint32_t address);
+uint32_t mem_read_8(uint32_t address);
 void mem_write_32(uint32_t address, uint32_t value);
+void mem_write_16(uint32_t address, uint32_t value);
+void mem_write_8(uint32_t address, uint32_t value);
+bool mem_write_block(uint32_t address, const uint8_t *src, uint32_t size);
+void bench_memory(uint32_t iterations);
 void cycle();
 void run(int num_cycles);
 void runAll();
@@ -116,7 +862,9 @@ void rdump();
 void handle_command();
 void reset();
 void init_memory();
-void load_program();
+void free_memory();
+bool load_program();
+int write_image(const char *path);
 void handle_pipeline(); /*IMPLEMENT THIS*/
 void WB();/*IMPLEMENT THIS*/
 void MEM();/*IMPLEMENT THIS*/
@@ -126,6 +874,74 @@ void IF();/*IMPLEMENT THIS*/
 void show_pipeline();/*IMPLEMENT THIS*/
 void initialize();
 void print_program(); /*IMPLEMENT THIS*/
+void decode_instruction(uint32_t instruction, decoded_inst_t *d);
+const decoded_inst_t *decode_lookup(uint32_t pc);
+void decode_invalidate(uint32_t address, uint32_t size);
+void decode_flush();
+void alu_execute(const decoded_inst_t *d, uint32_t pc, uint32_t a, uint32_t b, exec_result_t *r);
+void bench_simulation(uint32_t cycles);
+void bench_functional(uint32_t instructions);
+uint32_t func_run(uint32_t max_instructions, uint32_t stop_pc);
+bool func_step();
+void pipeline_drain();
+void fast_forward(uint32_t max_instructions, uint32_t stop_pc);
+uint32_t jit_run(uint32_t max_instructions, uint32_t stop_pc);
+void jit_flush();
+void jit_release();
+void jit_invalidate(uint32_t address, uint32_t size);
+bool jit_check(uint32_t instructions);
+void bench_jit(uint32_t instructions);
+void snapshot_save(int slot);
+bool snapshot_restore(int slot);
+void snapshot_drop(int slot);
+void bench_reset(uint32_t iterations);
+bool cache_configure(cache_t *c, const char *spec);
+void cache_reset(cache_t *c);
+void cache_release(cache_t *c);
+void cache_dump(const char *name, const cache_t *c);
+bool memsys_configure(const char *level, const char *spec);
+void memsys_reset();
+uint32_t memsys_access(uint32_t addr, bool write);
+void memsys_dump(const cache_t *l2, const dram_t *dram, const memsys_t *memsys);
+bool prefetch_configure(const char *spec);
+void prefetch_reset();
+void prefetch_dump(const prefetcher_t *pf);
+bool store_buffer_configure(const char *spec);
+void store_buffer_reset();
+void store_buffer_flush();
+void store_buffer_dump(const store_buffer_t *sb, const sim_counters_t *c);
+bool bp_configure(const char *spec);
+void bp_reset();
+void bp_release();
+void bp_dump(const branch_predictor_t *bp, const sim_counters_t *c);
+bool mdu_configure(const char *spec);
+void mdu_reset();
+void mdu_dump(const mdu_t *mdu);
+bool pipe_configure(const char *spec);
+void pipe_reset();
+void pipe_dump();
+bool ss_configure(const char *spec);
+void ss_reset();
+void ss_dump(const superscalar_t *ss, const sim_counters_t *c);
+void ss_pipeline();
+bool ooo_configure(const char *spec);
+void ooo_reset();
+void ooo_release();
+void ooo_cycle();
+void ooo_dump(const ooo_t *ooo, const sim_counters_t *c);
+bool ooo_check(bool report);
+bool pipetrace_open(const char *path);
+void pipetrace_close();
+void pipetrace_cycle();
+int pipetrace_convert(const char *in_path, const char *out_path);
+void profile_enable();
+void profile_disable();
+void profile_report(uint32_t top);
+void stats_dump();
+bool stats_write_json(const char *path);
+void usage(const char *name);
+int run_batch(uint32_t cycles, int argc, char *argv[]);
+int run_parallel(sim_batch_t *batch);
 
 
 